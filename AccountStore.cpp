@@ -0,0 +1,200 @@
+#include "AccountStore.hpp"
+
+#include <crypt.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// Equal-length inputs are compared in full, so the time taken does not
+// depend on where they first differ.
+static bool sameHash(const char* computed, const std::string& stored) {
+  size_t length = std::strlen(computed);
+  if (length != stored.size()) {
+    return false;
+  }
+  unsigned char difference = 0;
+  for (size_t i = 0; i < length; ++i) {
+    difference |= computed[i] ^ stored[i];
+  }
+  return difference == 0;
+}
+
+static void wipe(std::string& secret) {
+  std::fill(secret.begin(), secret.end(), '\0');
+  secret.clear();
+}
+
+AccountStore::AccountStore() : stopping(false), lastRequest(0) {
+  notifyPipe[0] = -1;
+  notifyPipe[1] = -1;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&ready, NULL);
+}
+
+AccountStore::~AccountStore() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&ready);
+  pthread_mutex_unlock(&mutex);
+  for (size_t i = 0; i < workers.size(); ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (notifyPipe[i] >= 0) {
+      close(notifyPipe[i]);
+    }
+  }
+  pthread_cond_destroy(&ready);
+  pthread_mutex_destroy(&mutex);
+}
+
+// Blank lines and lines starting with '#' are skipped.
+bool AccountStore::load(const std::string& path) {
+  std::ifstream file(path.c_str());
+  if (!file) {
+    std::cerr << "Cannot read accounts from " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    size_t colon = line.find(':');
+    if (colon == 0 || colon == std::string::npos ||
+        colon + 1 == line.size()) {
+      std::cerr << "Ignoring malformed account line in " << path << std::endl;
+      continue;
+    }
+    hashes[line.substr(0, colon)] = line.substr(colon + 1);
+  }
+  std::cout << "Loaded " << hashes.size() << " accounts" << std::endl;
+  return true;
+}
+
+bool AccountStore::start(size_t threads) {
+  if (pipe(notifyPipe) < 0 ||
+      fcntl(notifyPipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(notifyPipe[1], F_SETFL, O_NONBLOCK) < 0) {
+    std::cerr << "Failed to create the account check pipe." << std::endl;
+    return false;
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workerMain, this) != 0) {
+      std::cerr << "Failed to start account check threads." << std::endl;
+      return false;
+    }
+    workers.push_back(thread);
+  }
+  return true;
+}
+
+bool AccountStore::empty() const { return hashes.empty(); }
+
+int AccountStore::getNotifyFd() const { return notifyPipe[0]; }
+
+unsigned long AccountStore::submit(const std::string& account,
+                                   const std::string& password) {
+  if (workers.empty() || hashes.empty()) {
+    return 0;
+  }
+  Check check;
+  std::map<std::string, std::string>::const_iterator it =
+      hashes.find(account);
+  check.known = it != hashes.end();
+  check.stored = check.known ? it->second : hashes.begin()->second;
+  check.account = account;
+  check.password = password;
+  pthread_mutex_lock(&mutex);
+  if (checks.size() >= kMaxQueued) {
+    pthread_mutex_unlock(&mutex);
+    wipe(check.password);
+    return 0;
+  }
+  check.request = ++lastRequest;
+  checks.push_back(check);
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&mutex);
+  wipe(check.password);
+  return lastRequest;
+}
+
+// Empty the pipe before taking the results: a result that arrives after the
+// swap finds the list empty again and writes a new byte.
+void AccountStore::takeResults(std::vector<Result>& taken) {
+  char drain[64];
+  while (read(notifyPipe[0], drain, sizeof(drain)) > 0) {
+  }
+  pthread_mutex_lock(&mutex);
+  taken.swap(results);
+  pthread_mutex_unlock(&mutex);
+}
+
+std::string AccountStore::hash(const std::string& password) {
+  char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+  if (crypt_gensalt_rn("$y$", 0, NULL, 0, setting, sizeof(setting)) ==
+      NULL) {
+    return "";
+  }
+  struct crypt_data data;
+  std::memset(&data, 0, sizeof(data));
+  const char* hashed =
+      crypt_rn(password.c_str(), setting, &data, sizeof(data));
+  std::string result = hashed ? hashed : "";
+  std::memset(&data, 0, sizeof(data));
+  return result;
+}
+
+void* AccountStore::workerMain(void* arg) {
+  static_cast<AccountStore*>(arg)->workerLoop();
+  return NULL;
+}
+
+// crypt_rn keeps its state in data, so each worker hashes independently.
+void AccountStore::workerLoop() {
+  struct crypt_data* data = new struct crypt_data;
+  while (true) {
+    pthread_mutex_lock(&mutex);
+    while (checks.empty() && !stopping) {
+      pthread_cond_wait(&ready, &mutex);
+    }
+    if (stopping) {
+      pthread_mutex_unlock(&mutex);
+      break;
+    }
+    Check check = checks.front();
+    wipe(checks.front().password);
+    checks.pop_front();
+    pthread_mutex_unlock(&mutex);
+
+    std::memset(data, 0, sizeof(*data));
+    const char* computed = crypt_rn(check.password.c_str(),
+                                    check.stored.c_str(), data, sizeof(*data));
+    wipe(check.password);
+    Result result;
+    result.request = check.request;
+    result.account = check.account;
+    result.accepted =
+        check.known && computed && sameHash(computed, check.stored);
+
+    pthread_mutex_lock(&mutex);
+    bool wasEmpty = results.empty();
+    results.push_back(result);
+    pthread_mutex_unlock(&mutex);
+    if (wasEmpty) {
+      char byte = 0;
+      ssize_t written = write(notifyPipe[1], &byte, 1);
+      (void)written;  // A full pipe already has a wakeup pending
+    }
+  }
+  std::memset(data, 0, sizeof(*data));
+  delete data;
+}
@@ -0,0 +1,71 @@
+#ifndef ACCOUNTSTORE_HPP
+#define ACCOUNTSTORE_HPP
+
+#include <pthread.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// Per-account credentials (ircserv -a <file>), one "account:hash" line per
+// account, where hash is a crypt(3) string; yescrypt ($y$, from
+// ircserv -K) takes tens of milliseconds and megabytes of memory per check
+// by design. Checks therefore never run on the event loop: submit() queues
+// one for the worker threads and returns at once, and each verdict comes
+// back through takeResults() after a byte on getNotifyFd() wakes the loop.
+class AccountStore {
+ public:
+  struct Result {
+    unsigned long request;
+    std::string account;
+    bool accepted;
+  };
+
+  // Checks queued beyond this fail at once instead of waiting behind a
+  // reconnect storm
+  static const size_t kMaxQueued = 1024;
+
+  AccountStore();
+  ~AccountStore();
+
+  bool load(const std::string& path);
+  bool start(size_t threads);
+  bool empty() const;
+  int getNotifyFd() const;  // -1 until started
+
+  // 0 when the queue is full. Unknown accounts are hashed against a stored
+  // hash anyway, so the reply time does not reveal which names exist.
+  unsigned long submit(const std::string& account,
+                       const std::string& password);
+  void takeResults(std::vector<Result>& results);
+
+  static std::string hash(const std::string& password);  // A new $y$ hash
+
+ private:
+  AccountStore(const AccountStore&);
+  AccountStore& operator=(const AccountStore&);
+
+  struct Check {
+    unsigned long request;
+    std::string account;
+    std::string password;
+    std::string stored;
+    bool known;
+  };
+
+  static void* workerMain(void* arg);
+  void workerLoop();
+
+  std::map<std::string, std::string> hashes;  // Account -> crypt(3) hash
+  std::vector<pthread_t> workers;
+  int notifyPipe[2];  // Workers write a byte when results go from empty
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+  std::deque<Check> checks;     // Oldest first; guarded by mutex
+  std::vector<Result> results;  // Guarded by mutex
+  bool stopping;                // Guarded by mutex
+  unsigned long lastRequest;    // Loop thread only
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "AdmissionControl.hpp"
+
+#include <sys/time.h>
+
+#include <cstdio>
+#include <iostream>
+
+// How long a host that connects faster than the rate stays rejected.
+static const unsigned long long kRejectMs = 30 * 1000;
+static const unsigned long long kHostKind = 1ULL << 32;
+static const unsigned long long kSubnetKind = 2ULL << 32;
+
+static std::string formatAddress(unsigned int address) {
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", address >> 24,
+           (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff);
+  return text;
+}
+
+AdmissionControl::AdmissionControl()
+    : table(1024), used(0), perHost(16), perSubnet(64), ratePerSecond(5) {}
+
+void AdmissionControl::configure(unsigned perHost, unsigned perSubnet,
+                                 unsigned ratePerSecond) {
+  this->perHost = perHost;
+  this->perSubnet = perSubnet;
+  this->ratePerSecond = ratePerSecond;
+}
+
+unsigned long long AdmissionControl::nowMs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return static_cast<unsigned long long>(now.tv_sec) * 1000 +
+         now.tv_usec / 1000;
+}
+
+// Returns the slot for key, claiming an empty one if needed. The caller
+// makes sure the table has room first.
+AdmissionControl::Slot& AdmissionControl::find(unsigned long long key) {
+  size_t mask = table.size() - 1;
+  size_t i = static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+  while (table[i].key != 0 && table[i].key != key) {
+    i = (i + 1) & mask;
+  }
+  if (table[i].key == 0) {
+    Slot empty = {key, 0, 0, 0, 0};  // The first refill fills the bucket
+    table[i] = empty;
+    ++used;
+  }
+  return table[i];
+}
+
+AdmissionControl::Slot* AdmissionControl::lookup(unsigned long long key) {
+  size_t mask = table.size() - 1;
+  size_t i = static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+  while (table[i].key != 0) {
+    if (table[i].key == key) {
+      return &table[i];
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+// Token bucket: ratePerSecond tokens a second, up to two seconds' worth.
+void AdmissionControl::refill(Slot& slot, unsigned long long now) {
+  unsigned long long capacity = ratePerSecond * 2 * 1000ULL;
+  unsigned long long tokens =
+      slot.tokens + (now - slot.refilled) * ratePerSecond;
+  slot.tokens = static_cast<unsigned int>(tokens < capacity ? tokens
+                                                            : capacity);
+  slot.refilled = now;
+}
+
+// Rehash without the slots that no longer hold anything (no connections,
+// not rejected, bucket full), doubling the table if it is still half full.
+void AdmissionControl::sweep(unsigned long long now) {
+  std::vector<Slot> old;
+  old.swap(table);
+  size_t live = 0;
+  for (size_t i = 0; i < old.size(); ++i) {
+    if (old[i].key == 0) {
+      continue;
+    }
+    refill(old[i], now);
+    if (old[i].active > 0 || old[i].rejectUntil > now ||
+        old[i].tokens < ratePerSecond * 2 * 1000) {
+      ++live;
+    } else {
+      old[i].key = 0;
+    }
+  }
+  size_t size = old.size();
+  while ((live + 2) * 2 > size) {
+    size *= 2;
+  }
+  table.assign(size, Slot());
+  used = 0;
+  for (size_t i = 0; i < old.size(); ++i) {
+    if (old[i].key != 0) {
+      find(old[i].key) = old[i];
+    }
+  }
+}
+
+bool AdmissionControl::admit(unsigned int address) {
+  if ((address >> 24) == 127 ||
+      (perHost == 0 && perSubnet == 0 && ratePerSecond == 0)) {
+    return true;
+  }
+  unsigned long long now = nowMs();
+  if ((used + 2) * 2 > table.size()) {
+    sweep(now);
+  }
+  Slot& host = find(kHostKind | address);
+  if (host.rejectUntil > now) {
+    return false;
+  }
+  Slot& subnet = find(kSubnetKind | (address & 0xffffff00));
+  if ((perHost > 0 && host.active >= perHost) ||
+      (perSubnet > 0 && subnet.active >= perSubnet)) {
+    return false;
+  }
+  if (ratePerSecond > 0) {
+    refill(host, now);
+    if (host.tokens < 1000) {
+      host.rejectUntil = now + kRejectMs;
+      std::cerr << "Rejecting connections from " << formatAddress(address)
+                << " for " << kRejectMs / 1000 << "s (connect rate)"
+                << std::endl;
+      return false;
+    }
+    host.tokens -= 1000;
+  }
+  ++host.active;
+  ++subnet.active;
+  return true;
+}
+
+void AdmissionControl::release(unsigned int address) {
+  Slot* host = lookup(kHostKind | address);
+  Slot* subnet = lookup(kSubnetKind | (address & 0xffffff00));
+  if (host && host->active > 0) {
+    --host->active;
+  }
+  if (subnet && subnet->active > 0) {
+    --subnet->active;
+  }
+}
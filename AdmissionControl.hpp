@@ -0,0 +1,45 @@
+#ifndef ADMISSIONCONTROL_HPP
+#define ADMISSIONCONTROL_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Per-source limits checked right after accept(), before a ClientHandler is
+// allocated. Each IPv4 host and each /24 has a slot in one open-addressing
+// table (linear probing, no per-entry allocation), holding its live
+// connection count, a token bucket for the connect rate and the time until
+// which it is rejected outright. A host that exceeds the rate is put on the
+// reject list for a while, so a flood costs one probe per attempt.
+// Loopback is exempt, so local tools and server links are never throttled.
+class AdmissionControl {
+ public:
+  AdmissionControl();
+
+  // Zero disables a limit.
+  void configure(unsigned perHost, unsigned perSubnet, unsigned ratePerSecond);
+  bool admit(unsigned int address);  // Host byte order
+  void release(unsigned int address);
+
+ private:
+  struct Slot {
+    unsigned long long key;  // kind << 32 | address; 0 = empty
+    unsigned int active;
+    unsigned int tokens;             // Scaled by 1000; hosts only
+    unsigned long long refilled;     // ms
+    unsigned long long rejectUntil;  // ms; hosts only
+  };
+
+  Slot& find(unsigned long long key);
+  Slot* lookup(unsigned long long key);
+  void refill(Slot& slot, unsigned long long now);
+  void sweep(unsigned long long now);
+  static unsigned long long nowMs();
+
+  std::vector<Slot> table;  // Size is a power of two
+  size_t used;
+  unsigned perHost;
+  unsigned perSubnet;
+  unsigned ratePerSecond;
+};
+
+#endif
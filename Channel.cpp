@@ -2,137 +2,251 @@
 
 #include "ClientHandler.hpp"
 #include "IRCServer.hpp"
+#include "StateStore.hpp"
+
+// Record one applied flag, adding a sign only when it differs from the
+// previous flag's ("+it-l").
+static void appendModeChange(std::string& flags, std::string& arguments,
+                             char& sign, bool adding, char flag,
+                             const std::string& argument) {
+  char wanted = adding ? '+' : '-';
+  if (sign != wanted) {
+    flags += wanted;
+    sign = wanted;
+  }
+  flags += flag;
+  if (!argument.empty()) {
+    arguments += " " + argument;
+  }
+}
 
+// MODE <channel> <flags> [<argument>...], e.g. "+itk-l key".
+// Every flag is applied before anything is sent: the state is saved once and
+// members get one MODE line listing only what actually changed. Flags that
+// fail (bad argument, unknown letter) are reported and skipped.
 void Channel::setMode(const std::string& mode, ClientHandler* operatorHandler) {
+  std::istringstream modeStream(mode);
+  std::string flags;
+  std::vector<std::string> arguments;
+  std::string argument;
+  modeStream >> flags;
+  while (modeStream >> argument) {
+    if (argument[0] == ':') {
+      argument.erase(0, 1);
+    }
+    arguments.push_back(argument);
+  }
+  const std::string& nickname = operatorHandler->getNickname();
+  if (flags.empty()) {
+    operatorHandler->sendMessage(":Server 324 " + nickname + " " + name + " " +
+                                 getModeString());
+    return;
+  }
+  if (arguments.empty() && (flags == "b" || flags == "+b" || flags == "e" ||
+                            flags == "+e")) {
+    sendMaskList(operatorHandler, flags[flags.size() - 1]);  // Anyone may ask
+    return;
+  }
   if (!isOperator(operatorHandler)) {
     operatorHandler->sendMessage(
-        ":Server 482 " + operatorHandler->getNickname() + " " + name +
+        ":Server 482 " + nickname + " " + name +
         " :You must be a channel op or higher to set channel mode.");
     return;
   }
 
-  std::string modeFlag = mode.substr(0, 2);
-  if (modeFlag == "+i") {
-    setInviteMode(true, operatorHandler);
-  } else if (modeFlag == "-i") {
-    setInviteMode(false, operatorHandler);
-  } else if (modeFlag == "+t") {
-    setTopicControlMode(true, operatorHandler);
-  } else if (modeFlag == "-t") {
-    setTopicControlMode(false, operatorHandler);
-  } else if (modeFlag == "+k") {
-    if (mode.length() > 2) {
-      std::string password = mode.substr(3);
-      if (!password.empty()) setPasswordMode(password, operatorHandler);
-    } else
-      operatorHandler->sendMessage(":Server 461 " +
-                                   operatorHandler->getNickname() + " " + name +
-                                   " :Not enough parameters");
-  } else if (modeFlag == "-k" && hasPassword()) {
-    removePasswordMode(operatorHandler);
-  } else if (modeFlag == "+l") {
-    if (mode.length() > 2) {  // Check if there are more characters after "+l"
-      std::string limit = mode.substr(3);  // Get the limit following "+l"
-      int limitValue = 0;
-      bool valid = true;
-      for (size_t i = 0; i < limit.length(); ++i) {
-        if (!isdigit(limit[i])) {
-          valid = false;
-          break;
-        }
-        limitValue = limitValue * 10 + (limit[i] - '0');
+  std::string applied;
+  std::string appliedArguments;
+  char sign = 0;
+  bool adding = true;
+  size_t next = 0;
+  for (size_t i = 0; i < flags.size(); ++i) {
+    char flag = flags[i];
+    if (flag == '+' || flag == '-') {
+      adding = (flag == '+');
+      continue;
+    }
+    bool* toggle = flag == 'i'   ? &inviteOnly
+                   : flag == 't' ? &topicControl
+                   : flag == 'u' ? &auditorium
+                                 : NULL;
+    if (toggle) {
+      if (*toggle != adding) {
+        *toggle = adding;
+        appendModeChange(applied, appliedArguments, sign, adding, flag, "");
       }
-      if (valid && limitValue > 0) {
-        setLimit(limitValue, operatorHandler);
+    } else if (flag == 'k') {
+      if (!adding) {
+        if (next < arguments.size()) {
+          ++next;  // "-k <key>": the key itself is not checked
+        }
+        if (hasPassword()) {
+          removeChannelPassword();
+          appendModeChange(applied, appliedArguments, sign, false, 'k', "*");
+        }
+      } else if (next < arguments.size()) {
+        setChannelPassword(arguments[next]);
+        appendModeChange(applied, appliedArguments, sign, true, 'k',
+                         arguments[next++]);
       } else {
+        operatorHandler->sendMessage(":Server 461 " + nickname + " " + name +
+                                     " :Not enough parameters");
+      }
+    } else if (flag == 'l') {
+      if (!adding) {
+        if (maxClients > 0) {
+          maxClients = 0;
+          appendModeChange(applied, appliedArguments, sign, false, 'l', "");
+        }
+        continue;
+      }
+      if (next >= arguments.size()) {
+        operatorHandler->sendMessage(":Server 461 " + nickname + " " + name +
+                                     " :Not enough parameters");
+        continue;
+      }
+      const std::string& limit = arguments[next++];
+      size_t limitValue = 0;
+      bool valid = !limit.empty() && limit.size() < 10;
+      for (size_t j = 0; valid && j < limit.length(); ++j) {
+        valid = isdigit(limit[j]);
+        limitValue = limitValue * 10 + (limit[j] - '0');
+      }
+      if (!valid || limitValue == 0) {
         operatorHandler->sendMessage(
-            ":Server 473 " + operatorHandler->getNickname() +
+            ":Server 473 " + nickname +
             " :Channel limit must be a number greater than 0.");
+      } else if (limitValue != maxClients) {
+        maxClients = limitValue;
+        appendModeChange(applied, appliedArguments, sign, true, 'l', limit);
+      }
+    } else if (flag == 'b' || flag == 'e') {
+      if (next >= arguments.size()) {
+        if (adding) {
+          sendMaskList(operatorHandler, flag);
+        }
+        continue;
+      }
+      std::string mask = MaskList::normalize(arguments[next++]);
+      MaskList& list = flag == 'b' ? bans : exceptions;
+      if (adding ? list.add(mask) : list.remove(mask)) {
+        ++maskListVersion;
+        appendModeChange(applied, appliedArguments, sign, adding, flag, mask);
+      }
+    } else if (flag == 'o') {
+      if (next >= arguments.size()) {
+        operatorHandler->sendMessage(":Server 461 " + nickname + " " + name +
+                                     " :Not enough parameters");
+        continue;
       }
+      const std::string& target = arguments[next++];
+      ClientHandler* member = findMember(target);
+      if (member == NULL) {
+        operatorHandler->sendMessage(":Server 441 " + nickname + " " + name +
+                                     " " + target +
+                                     " :They aren't on that channel.");
+      } else if (adding && !isOperator(member)) {
+        operators.insert(member);
+        forgetRestoredOperator(member);
+        appendModeChange(applied, appliedArguments, sign, true, 'o', target);
+      } else if (!adding && isOperator(member)) {
+        operators.erase(member);
+        appendModeChange(applied, appliedArguments, sign, false, 'o', target);
+      }
+    } else {
+      operatorHandler->sendMessage(":Server 472 " + nickname + " " +
+                                   std::string(1, flag) +
+                                   " :is unknown mode char to me");
     }
-  } else if (modeFlag == "-l") {
-    setLimit(0, operatorHandler);
-  } else if (modeFlag == "+o") {
-    if (mode.length() > 2)
-      setOperatorMode(true, mode.substr(3), operatorHandler);
-  } else if (modeFlag == "-o") {
-    if (mode.length() > 2)
-      setOperatorMode(false, mode.substr(3), operatorHandler);
-  }
-}
-
-void Channel::setLimit(int limit, ClientHandler* operatorHandler) {
-  if (limit < 0) {
-    operatorHandler->sendMessage(":Server 473 " +
-                                 operatorHandler->getNickname() + " " + name +
-                                 " :Channel limit must be greater than 0.");
+  }
+  if (applied.empty()) {
     return;
   }
-  std::string change;
-  if (limit > 0) {
+  saveState();
+  sendModeChangeMessage(operatorHandler, applied + appliedArguments);
+}
+
+// Current flags for RPL_CHANNELMODEIS; the key itself is not shown.
+std::string Channel::getModeString() const {
+  std::string flags = "+";
+  std::string arguments;
+  if (inviteOnly) flags += "i";
+  if (topicControl) flags += "t";
+  if (auditorium) flags += "u";
+  if (hasPassword()) flags += "k";
+  if (maxClients > 0) {
     std::ostringstream oss;
-    oss << "+l " << limit;
-    change = oss.str();
-  } else {
-    change = "-l";
+    oss << " " << maxClients;
+    flags += "l";
+    arguments = oss.str();
   }
-  maxClients = limit;
-  sendModeChangeMessage(operatorHandler, change);
+  return flags + arguments;
 }
 
-bool Channel::isFull() const {
-  return maxClients > 0 && clients.size() >= maxClients;
+// RPL_BANLIST (367/368) or RPL_EXCEPTLIST (348/349).
+void Channel::sendMaskList(ClientHandler* client, char list) {
+  const std::vector<std::string>& masks =
+      (list == 'b' ? bans : exceptions).getMasks();
+  const std::string& nickname = client->getNickname();
+  for (size_t i = 0; i < masks.size(); ++i) {
+    client->sendMessage((list == 'b' ? ":Server 367 " : ":Server 348 ") +
+                        nickname + " " + name + " " + masks[i]);
+  }
+  client->sendMessage(list == 'b' ? ":Server 368 " + nickname + " " + name +
+                                        " :End of channel ban list"
+                                  : ":Server 349 " + nickname + " " + name +
+                                        " :End of channel exception list");
 }
 
-bool Channel::isInviteOnly() const { return inviteOnly; }
-
-void Channel::setOperatorMode(bool enable, const std::string& nickname,
-                              ClientHandler* operatorHandler) {
-  std::map<ClientHandler*, bool>::iterator it;
-  for (it = clients.begin(); it != clients.end(); ++it) {
-    if (it->first->getNickname() == nickname) {
-      if (enable) {
-        addOperator(it->first);
-      } else {
-        removeOperator(it->first);
-      }
-      return;
+// Members are looked up once per change of the lists or of their nick
+// (see forgetBanStatus); everything else hits the cache.
+bool Channel::isBanned(ClientHandler* client) {
+  bool member = clients.count(client) > 0;
+  if (member) {
+    std::map<ClientHandler*, std::pair<unsigned long, bool> >::iterator it =
+        banCache.find(client);
+    if (it != banCache.end() && it->second.first == maskListVersion) {
+      return it->second.second;
     }
   }
-  operatorHandler->sendMessage(":Server 441 " + operatorHandler->getNickname() +
-                               " " + name + " " + nickname +
-                               " :They aren't on that channel.");
+  bool banned = bans.matches(client->getNickname(), client->getUsername(),
+                             client->getHostname()) &&
+                !exceptions.matches(client->getNickname(),
+                                    client->getUsername(),
+                                    client->getHostname());
+  if (member) {
+    banCache[client] = std::make_pair(maskListVersion, banned);
+  }
+  return banned;
 }
 
-void Channel::setInviteMode(bool enable, ClientHandler* operatorHandler) {
-  std::string change = enable ? "+i" : "-i";
-  inviteOnly = enable;
-  sendModeChangeMessage(operatorHandler, change);
+void Channel::forgetBanStatus(ClientHandler* client) {
+  banCache.erase(client);
 }
 
-void Channel::setTopicControlMode(bool enable, ClientHandler* operatorHandler) {
-  std::string change = enable ? "+t" : "-t";
-  topicControl = enable;
-  sendModeChangeMessage(operatorHandler, change);
+ClientHandler* Channel::findMember(const std::string& nickname) const {
+  std::map<ClientHandler*, bool>::const_iterator it;
+  for (it = clients.begin(); it != clients.end(); ++it) {
+    if (it->first->getNickname() == nickname) {
+      return it->first;
+    }
+  }
+  return NULL;
 }
 
-void Channel::setPasswordMode(const std::string& password,
-                              ClientHandler* operatorHandler) {
-  setChannelPassword(password);
-  sendModeChangeMessage(operatorHandler, "+k :" + password);
+bool Channel::isFull() const {
+  return maxClients > 0 && clients.size() >= maxClients;
 }
 
-void Channel::removePasswordMode(ClientHandler* operatorHandler) {
-  removeChannelPassword();
-  sendModeChangeMessage(operatorHandler, "-k");
-}
+bool Channel::isInviteOnly() const { return inviteOnly; }
+
+bool Channel::isAuditorium() const { return auditorium; }
 
 void Channel::sendModeChangeMessage(ClientHandler* operatorHandler,
                                     const std::string& modeChange) {
   std::string message = ":" + operatorHandler->getNickname() + "!" +
                         operatorHandler->getUsername() + "@" +
                         operatorHandler->getHostname() + " MODE " + name +
-                        " :" + modeChange;
+                        " " + modeChange;
   broadcastMessage(message, NULL);
 }
 
@@ -148,8 +262,16 @@ bool Channel::checkPassword(const std::string& password) const {
 
 bool Channel::hasPassword() const { return !channelPassword.empty(); }
 
-Channel::Channel(const std::string& name)
-    : name(name), inviteOnly(false), topicControl(true), maxClients(0) {}
+Channel::Channel(const std::string& name, StateStore* store,
+                 ModuleManager* modules)
+    : name(name),
+      inviteOnly(false),
+      topicControl(true),
+      auditorium(false),
+      maxClients(0),
+      store(store),
+      modules(modules),
+      maskListVersion(0) {}
 
 Channel::~Channel() {}
 
@@ -157,7 +279,9 @@ const std::string& Channel::getName() const { return name; }
 
 void Channel::addClient(ClientHandler* client) {
   clients.insert(std::make_pair(client, true));
-  if (operators.empty()) {
+  if (wasRestoredOperator(client)) {
+    addOperator(client);  // Was an operator before the server restarted
+  } else if (operators.empty() && restoredOperators.empty()) {
     addOperator(client);
   }
   if (!topic.empty()) {
@@ -170,8 +294,14 @@ void Channel::addClient(ClientHandler* client) {
   }
 }
 
+// Users joining on another server; their own server handles the rest.
+void Channel::addRemoteClient(ClientHandler* client) {
+  clients.insert(std::make_pair(client, true));
+}
+
 void Channel::removeClient(ClientHandler* client) {
   clients.erase(client);
+  banCache.erase(client);
   if (isOperator(client)) removeOperator(client);
 }
 
@@ -183,8 +313,30 @@ bool Channel::isOperator(ClientHandler* client) const {
   return operators.find(client) != operators.end();
 }
 
+// An op saved with an account gets +o back only from a client logged in
+// to it. One saved by nick alone (no account, or a record from before
+// accounts) only gets it in a channel it is alone in, so taking the nick
+// is not enough to take over an occupied channel.
+bool Channel::wasRestoredOperator(ClientHandler* client) const {
+  if (!client->getAccount().empty() &&
+      restoredOperators.count("$" + client->getAccount())) {
+    return true;
+  }
+  return clients.size() == 1 && clients.count(client) &&
+         restoredOperators.count(client->getNickname());
+}
+
+void Channel::forgetRestoredOperator(ClientHandler* client) {
+  restoredOperators.erase(client->getNickname());
+  if (!client->getAccount().empty()) {
+    restoredOperators.erase("$" + client->getAccount());
+  }
+}
+
 void Channel::addOperator(ClientHandler* client) {
   operators.insert(client);
+  forgetRestoredOperator(client);
+  saveState();
   broadcastMessage(":" + client->getNickname() + "!" + client->getUsername() +
                        "@" + client->getHostname() + " MODE " + name +
                        " +o :" + client->getNickname(),
@@ -193,6 +345,7 @@ void Channel::addOperator(ClientHandler* client) {
 
 void Channel::removeOperator(ClientHandler* client) {
   operators.erase(client);
+  saveState();
   if (client->isActive()) {
     broadcastMessage(":" + client->getNickname() + "!" + client->getUsername() +
                          "@" + client->getHostname() + " MODE " + name +
@@ -201,9 +354,22 @@ void Channel::removeOperator(ClientHandler* client) {
   }
 }
 
+// Channels at least this big get each broadcast line built and logged once
+// instead of once per member.
+static const size_t kLargeChannel = 1000;
+
 void Channel::broadcastMessage(const std::string& message,
                                ClientHandler* sender) {
   std::map<ClientHandler*, bool>::iterator it;
+  if (clients.size() >= kLargeChannel) {
+    std::string line = logLargeBroadcast(message);
+    for (it = clients.begin(); it != clients.end(); ++it) {
+      if (sender == NULL || it->first != sender) {
+        it->first->queueLine(line);
+      }
+    }
+    return;
+  }
   for (it = clients.begin(); it != clients.end(); ++it) {
     if (sender == NULL || it->first != sender) {
       it->first->sendMessage(message);
@@ -211,12 +377,89 @@ void Channel::broadcastMessage(const std::string& message,
   }
 }
 
+// Send to every member not yet reached in this fan-out epoch.
+void Channel::broadcastUnmarked(const std::string& message,
+                                unsigned long epoch) {
+  std::map<ClientHandler*, bool>::iterator it;
+  if (clients.size() >= kLargeChannel) {
+    std::string line = logLargeBroadcast(message);
+    for (it = clients.begin(); it != clients.end(); ++it) {
+      if (it->first->markFanout(epoch)) {
+        it->first->queueLine(line);
+      }
+    }
+    return;
+  }
+  for (it = clients.begin(); it != clients.end(); ++it) {
+    if (it->first->markFanout(epoch)) {
+      it->first->sendMessage(message);
+    }
+  }
+}
+
+// With no channel hooks loaded this is a single test.
+bool Channel::droppedByModules(const std::string& message,
+                               ClientHandler* sender) {
+  return modules && modules->hasChannelHooks() &&
+         modules->runChannelHooks(this, message, sender) ==
+             ModuleManager::kDrop;
+}
+
+std::string Channel::logLargeBroadcast(const std::string& message) const {
+  std::cout << "Sending  : " << message << " (to " << clients.size()
+            << " members of " << name.str() << ")" << std::endl;
+  return message + "\r\n";
+}
+
+// JOIN/PART lines go to every other member, unless the channel is an
+// auditorium (+u): then only operators see them, so a mass join into a huge
+// channel does not fan out to everyone.
+void Channel::broadcastMembershipChange(const std::string& message,
+                                        ClientHandler* sender) {
+  if (!auditorium || isOperator(sender)) {
+    broadcastMessage(message, sender);  // Everyone can see operators
+    return;
+  }
+  std::set<ClientHandler*>::iterator it;
+  for (it = operators.begin(); it != operators.end(); ++it) {
+    if (*it != sender) {
+      (*it)->sendMessage(message);
+    }
+  }
+}
+
+// QUIT and NICK, once per user across channels (see broadcastUnmarked). In
+// an auditorium only operators learn about a non-operator, as above.
+void Channel::broadcastMembershipUnmarked(const std::string& message,
+                                          ClientHandler* sender,
+                                          unsigned long epoch) {
+  if (!auditorium || isOperator(sender)) {
+    broadcastUnmarked(message, epoch);
+    return;
+  }
+  std::set<ClientHandler*>::iterator it;
+  for (it = operators.begin(); it != operators.end(); ++it) {
+    if ((*it)->markFanout(epoch)) {
+      (*it)->sendMessage(message);
+    }
+  }
+}
+
 bool Channel::isEmpty() const { return clients.empty(); }
 
-std::string Channel::getClientList() const {
+const std::map<ClientHandler*, bool>& Channel::getClients() const {
+  return clients;
+}
+
+// In an auditorium, non-operators only see the operators and themselves.
+std::string Channel::getClientList(ClientHandler* viewer) const {
   std::string list;
+  bool showAll = !auditorium || isOperator(viewer);
   std::map<ClientHandler*, bool>::const_iterator it;
   for (it = clients.begin(); it != clients.end(); ++it) {
+    if (!showAll && it->first != viewer && !isOperator(it->first)) {
+      continue;
+    }
     if (it->second && isOperator(it->first)) {
       list += "@";
     } else {
@@ -238,6 +481,7 @@ const std::string& Channel::getTopicSetter() const { return topicSetter; }
 void Channel::setTopic(const std::string& newTopic, const std::string& setter) {
   topic = newTopic;
   topicSetter = setter;
+  saveState();
   std::string topicMessage = ":" + setter + " TOPIC " + name + " :" + newTopic;
 }
 
@@ -248,11 +492,110 @@ bool Channel::checkInvitation(ClientHandler* client) {
   std::cout << "Invited size: " << invited.size() << std::endl;
   std::cout << "Invited contains client: "
             << (invited.find(client) != invited.end()) << std::endl;
-  return invited.find(client) != invited.end();
+  // Operators saved with an account may come back without an invite
+  return invited.find(client) != invited.end() ||
+         (!client->getAccount().empty() &&
+          restoredOperators.count("$" + client->getAccount()) > 0);
 }
 void Channel::inviteClient(ClientHandler* client) { invited.insert(client); }
 void Channel::removeInvitation(ClientHandler* client) {
   if (invited.find(client) != invited.end()) {
     invited.erase(client);
   }
-}
\ No newline at end of file
+}
+
+void Channel::saveState() {
+  if (store) {
+    std::string payload;
+    encodeState(payload);
+    store->append(payload);
+  }
+}
+
+// Payload: name, topic, topic setter, key, mode flags (+i +t +u), limit,
+// operators ("$account", or the nick if not logged in), then the ban and
+// exception masks (absent in records written before +b/+e existed).
+void Channel::encodeState(std::string& out) const {
+  StateStore::putString(out, name);
+  StateStore::putString(out, topic);
+  StateStore::putString(out, topicSetter);
+  StateStore::putString(out, channelPassword);
+  StateStore::putU32(out, (inviteOnly ? 1 : 0) | (topicControl ? 2 : 0) |
+                              (auditorium ? 4 : 0));
+  StateStore::putU32(out, maxClients);
+  StateStore::putU32(out, operators.size() + restoredOperators.size());
+  std::set<ClientHandler*>::const_iterator op;
+  for (op = operators.begin(); op != operators.end(); ++op) {
+    const std::string& account = (*op)->getAccount();
+    StateStore::putString(out, account.empty() ? (*op)->getNickname()
+                                               : "$" + account);
+  }
+  std::set<std::string>::const_iterator nick;
+  for (nick = restoredOperators.begin(); nick != restoredOperators.end();
+       ++nick) {
+    StateStore::putString(out, *nick);
+  }
+  const MaskList* lists[2] = {&bans, &exceptions};
+  for (size_t l = 0; l < 2; ++l) {
+    const std::vector<std::string>& masks = lists[l]->getMasks();
+    StateStore::putU32(out, masks.size());
+    for (size_t i = 0; i < masks.size(); ++i) {
+      StateStore::putString(out, masks[i]);
+    }
+  }
+}
+
+bool Channel::decodeName(const std::string& payload, std::string& name) {
+  const char* data = payload.data();
+  return StateStore::getString(data, data + payload.size(), name);
+}
+
+bool Channel::restoreState(const std::string& payload) {
+  const char* data = payload.data();
+  const char* end = data + payload.size();
+  std::string savedName;
+  std::string savedSetter;
+  unsigned int flags;
+  unsigned int limit;
+  unsigned int operatorCount;
+  if (!StateStore::getString(data, end, savedName) ||
+      !StateStore::getString(data, end, topic) ||
+      !StateStore::getString(data, end, savedSetter) ||
+      !StateStore::getString(data, end, channelPassword) ||
+      !StateStore::getU32(data, end, flags) ||
+      !StateStore::getU32(data, end, limit) ||
+      !StateStore::getU32(data, end, operatorCount)) {
+    return false;
+  }
+  topicSetter = savedSetter;
+  inviteOnly = flags & 1;
+  topicControl = flags & 2;
+  auditorium = flags & 4;
+  maxClients = limit;
+  restoredOperators.clear();
+  for (unsigned int i = 0; i < operatorCount; ++i) {
+    std::string nick;
+    if (!StateStore::getString(data, end, nick)) {
+      return false;
+    }
+    restoredOperators.insert(nick);
+  }
+  bans = MaskList();
+  exceptions = MaskList();
+  ++maskListVersion;
+  MaskList* lists[2] = {&bans, &exceptions};
+  for (size_t l = 0; l < 2 && data != end; ++l) {
+    unsigned int maskCount;
+    if (!StateStore::getU32(data, end, maskCount)) {
+      return false;
+    }
+    for (unsigned int i = 0; i < maskCount; ++i) {
+      std::string mask;
+      if (!StateStore::getString(data, end, mask)) {
+        return false;
+      }
+      lists[l]->add(mask);
+    }
+  }
+  return true;
+}
@@ -5,17 +5,24 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 #include <ctime> // For time_t
 
+#include "InternedString.hpp"
+#include "MaskList.hpp"
+
 class ClientHandler; 
 class IRCServer;     
+class ModuleManager;
+class StateStore;
 class Channel {
  public:
-  Channel(const std::string& name);
+  Channel(const std::string& name, StateStore* store, ModuleManager* modules);
   ~Channel();
 
   const std::string& getName() const;
   void addClient(ClientHandler* client);
+  void addRemoteClient(ClientHandler* client);  // No auto-op, no topic reply
   void removeClient(ClientHandler* client);
   bool isClientMember(ClientHandler* client) const;
   bool isOperator(
@@ -23,8 +30,18 @@ class Channel {
   void addOperator(ClientHandler* client);  // Add an operator
   void removeOperator(ClientHandler* client);  // Remove an operator
   void broadcastMessage(const std::string& message, ClientHandler* sender);
+  void broadcastUnmarked(const std::string& message, unsigned long epoch);
+  // Channel hooks see PRIVMSG and NOTICE only, so a module cannot hide a
+  // JOIN, KICK, QUIT or NICK from the members
+  bool droppedByModules(const std::string& message, ClientHandler* sender);
+  void broadcastMembershipChange(const std::string& message,
+                                 ClientHandler* sender);
+  void broadcastMembershipUnmarked(const std::string& message,
+                                   ClientHandler* sender, unsigned long epoch);
   bool isEmpty() const;
-  std::string getClientList() const;  // Return list of clients in the channel
+  const std::map<ClientHandler*, bool>& getClients() const;
+  std::string getClientList(
+      ClientHandler* viewer) const;  // Return list of clients in the channel
   std::string getChannelName() const {
     return name;
   };  // Return list of channel names
@@ -33,18 +50,17 @@ class Channel {
   void setInviteOnly(bool inviteOnly);
   bool isInviteOnly() const;
   void setMode(const std::string& mode,
-               ClientHandler* operatorHandler);  // Set specific mode
+               ClientHandler* operatorHandler);  // Apply a whole mode string
   void setTopicControl(bool mode);               // Set topic control mode
   bool getTopicControl() const;                  // Get topic control status
-  void setInviteMode(bool enable, ClientHandler* operatorHandler);
-  void setTopicControlMode(bool enable, ClientHandler* operatorHandler);
-  void setPasswordMode(const std::string& password,
-                       ClientHandler* operatorHandler);
-  void removePasswordMode(ClientHandler* operatorHandler);
+  std::string getModeString() const;
+  void sendMaskList(ClientHandler* client, char list);
+  bool isBanned(ClientHandler* client);  // +b and not +e, cached per member
+  void forgetBanStatus(ClientHandler* client);
+  ClientHandler* findMember(const std::string& nickname) const;
+  bool isAuditorium() const;
   void sendModeChangeMessage(ClientHandler* operatorHandler,
                              const std::string& modeChange);
-  void setOperatorMode(bool enable, const std::string& nickname,
-                       ClientHandler* operatorHandler);
 
   // Password management
   void setChannelPassword(const std::string& password);
@@ -53,7 +69,6 @@ class Channel {
   bool hasPassword() const;  // Check if the channel has a password
 
   // User limit management
-  void setLimit(int limit, ClientHandler* operatorHandler);
   bool isFull() const;
 
   const std::string& getTopic() const;  // Get the current topic
@@ -64,21 +79,42 @@ class Channel {
   void setTopic(const std::string& newTopic,
                 const std::string& setter);  // Set a new topic
 
+  // Persistence (see StateStore)
+  void saveState();
+  void encodeState(std::string& out) const;
+  bool restoreState(const std::string& payload);
+  static bool decodeName(const std::string& payload, std::string& name);
+
 bool checkInvitation(ClientHandler *client);
 void inviteClient(ClientHandler *client);
 void removeInvitation(ClientHandler *client);
  private:
-  std::string name;
+  std::string logLargeBroadcast(const std::string& message) const;
+  bool wasRestoredOperator(ClientHandler* client) const;
+  void forgetRestoredOperator(ClientHandler* client);
+
+  InternedString name;
   std::map<ClientHandler*, bool> clients;  // Maps clients to a bool (typically
                                            // if they are active/not banned)
   std::set<ClientHandler*> operators;      // Set of operators in this channel
   std::set<ClientHandler*> invited;        // Set of invited clients
   bool inviteOnly;                         // Whether the channel is invite-only
   bool topicControl;  // Whether topic control is restricted to operators
+  bool auditorium;    // Whether join/part is only shown to operators (+u)
   std::string channelPassword;  // Optional password for the channel
   size_t maxClients;        // Maximum number of clients allowed in the channel
   std::string topic;        // The current topic of the channel
-  std::string topicSetter;  // The nickname of the user who set the topic
+  InternedString topicSetter;  // The nickname of the user who set the topic
+  StateStore* store;        // NULL when persistence is off
+  ModuleManager* modules;   // Channel hooks from loaded modules
+  // Saved ops not back yet: "$account" for an op who was logged in, else
+  // the bare nick
+  std::set<std::string> restoredOperators;
+  MaskList bans;                            // +b
+  MaskList exceptions;                      // +e
+  unsigned long maskListVersion;  // Bumped on every +b/-b/+e/-e
+  // Member -> (maskListVersion it was computed for, banned)
+  std::map<ClientHandler*, std::pair<unsigned long, bool> > banCache;
 
 };
 
@@ -1,6 +1,11 @@
 #include "ClientHandler.hpp"
 
+#include <arpa/inet.h>
+
+#include <cstring>
+
 #include "Channel.hpp"
+#include "DeflateStream.hpp"
 #include "IRCServer.hpp"
 
 ClientHandler::ClientHandler(int socket, IRCServer* server)
@@ -8,43 +13,246 @@ ClientHandler::ClientHandler(int socket, IRCServer* server)
       clientSocket(socket),
       active(true),
       isPassed(false),
-      isWelcomed(false) {}
+      isWelcomed(false),
+      fanoutMark(0),
+      link(false),
+      uplink(NULL),
+      peerAddress(0),
+      backlogged(false),
+      handlingCommand(false),
+      outputMidLine(false),
+      deflate(NULL),
+      corkFlushes(false),
+      hostFromLookup(false),
+      lookupRequest(0),
+      loginRequest(0),
+      loginBySasl(false),
+      capHeld(false),
+      saslEnabled(false),
+      saslStarted(false) {
+#ifdef IRC_TLS
+  ssl = NULL;
+#endif
+}
 
 ClientHandler::~ClientHandler() {
+  if (loginRequest != 0) {
+    server->cancelLogin(loginRequest);
+  }
+  if (lookupRequest != 0) {
+    server->cancelHostLookup(this, lookupRequest);
+  }
+  server->getMonitors().clear(this);
+  server->getUserIndex().remove(this);
   server->unregisterNickname(nickname);
-  close(clientSocket);
+#ifdef IRC_TLS
+  if (ssl) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+  }
+#endif
+  delete deflate;
+  if (clientSocket >= 0) {
+    close(clientSocket);
+  }
 }
 
 void ClientHandler::processInput() {
+#ifdef IRC_TLS
+  if (ssl) {
+    processTlsInput();
+    return;
+  }
+#endif
   const size_t bufferSize = 1024;
   char buffer[bufferSize];
-  static std::string accumulatedInput;
-  std::string command;
   ssize_t bytesRead = read(clientSocket, buffer, sizeof(buffer) - 1);
 
   if (bytesRead > 0) {
-    buffer[bytesRead] = '\0';
-    accumulatedInput += buffer;
-
-    size_t pos = 0;
-    while ((pos = accumulatedInput.find("\n")) != std::string::npos) {
-      if (pos > 0 && accumulatedInput[pos - 1] != '\r') {
-        command = accumulatedInput.substr(0, pos);
-      } else
-        command = accumulatedInput.substr(0, pos - 1);
-      std::cout << "Received : " << command << "$" << std::endl;
-      processCommand(command);
-      accumulatedInput.erase(0, pos + 1);
-    }
+    consumeInput(buffer, bytesRead);
   } else if (bytesRead == 0) {
     std::cout << "Client disconnected." << std::endl;
-    handleDisconnect();
+    handleDisconnect("Connection closed");
   } else {
     std::cerr << "Read error." << std::endl;
-    handleDisconnect();
+    handleDisconnect("Read error");
+  }
+}
+
+// Lines a connection may run per loop iteration before the others get a
+// turn. Links carry every remote user's traffic, so they get more. A
+// connection whose unfinished line grows past kInputLimit is dropped.
+static const size_t kLinesPerTick = 16;
+static const size_t kBytesPerTick = 4096;
+static const size_t kLinkLinesPerTick = 4096;
+static const size_t kInputLimit = 64 * 1024;
+
+// Append raw bytes to this client's input buffer and run this iteration's
+// share of the complete lines. While lines are left over from an earlier
+// iteration the server's backlog turn runs them instead, and the server
+// stops reading this client until they are done.
+void ClientHandler::consumeInput(const char* data, size_t length) {
+  if (server->getCapture() && !link) {
+    server->getCapture()->recordData(this, data, length);
+  }
+  accumulatedInput.append(data, length);
+  if (backlogged) {
+    return;
+  }
+  runInputBudget();
+  if (!backlogged && accumulatedInput.size() > kInputLimit) {
+    std::cerr << "Input line too long." << std::endl;
+    accumulatedInput.clear();
+    handleDisconnect("Excess Flood");
   }
 }
 
+// Offsets in one line of input: its end ('\n'), the end of its command
+// (first ' ') and its first '\r'. Each is the line's length when absent.
+struct LineBreaks {
+  size_t length;
+  size_t space;
+  size_t carriageReturn;
+};
+
+// memchr is the C library's vector search (SSE2/AVX2 picked at load time
+// on x86), so short lines cost three short vector scans.
+static void scanLine(const char* data, size_t length, LineBreaks& line) {
+  const char* found =
+      static_cast<const char*>(std::memchr(data, '\n', length));
+  line.length = found ? found - data : length;
+  found = static_cast<const char*>(std::memchr(data, ' ', line.length));
+  line.space = found ? found - data : line.length;
+  found = static_cast<const char*>(std::memchr(data, '\r', line.length));
+  line.carriageReturn = found ? found - data : line.length;
+}
+
+// Run up to one iteration's budget of buffered lines, then hand the rest
+// to the server's backlog for the next iteration. One scan per line finds
+// its end and its first space; only a line with a '\r' before its end
+// takes the slower cleaning path.
+void ClientHandler::runInputBudget() {
+  size_t lineBudget = link ? kLinkLinesPerTick : kLinesPerTick;
+  size_t start = 0;
+  LineBreaks line;
+  for (size_t lines = 0;
+       active && lines < lineBudget && (link || start < kBytesPerTick);
+       ++lines) {
+    scanLine(accumulatedInput.data() + start,
+             accumulatedInput.size() - start, line);
+    if (start + line.length == accumulatedInput.size()) {
+      break;  // No complete line
+    }
+    size_t end = line.length;
+    if (line.carriageReturn + 1 == line.length) {
+      --end;  // "\r\n"
+    }
+    std::string command = accumulatedInput.substr(start, end);
+    start += line.length + 1;
+    std::cout << "Received : " << command << "$" << std::endl;
+    handlingCommand = true;
+    if (line.carriageReturn < end) {
+      processCommand(command);
+    } else {
+      dispatchLine(command, line.space);
+    }
+    handlingCommand = false;
+  }
+  accumulatedInput.erase(0, start);
+  if (active && accumulatedInput.find('\n') != std::string::npos) {
+    backlogged = true;
+    server->deferInput(this);
+  }
+}
+
+// The server's round-robin turn for a client that had lines left over.
+void ClientHandler::resumeInput() {
+  backlogged = false;
+  runInputBudget();
+}
+
+bool ClientHandler::isBacklogged() const { return backlogged; }
+
+#ifdef IRC_TLS
+void ClientHandler::attachTls(SSL* session) { ssl = session; }
+
+// The TLS socket is non-blocking: the handshake is driven a step at a time
+// from poll(), and SSL_read is drained until OpenSSL has no buffered records.
+void ClientHandler::processTlsInput() {
+  if (!SSL_is_init_finished(ssl)) {
+    int result = SSL_do_handshake(ssl);
+    if (result <= 0) {
+      int error = SSL_get_error(ssl, result);
+      if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        std::cerr << "TLS handshake failed." << std::endl;
+        handleDisconnect("TLS handshake failed");
+      }
+      return;
+    }
+    std::cout << "TLS handshake done: " << SSL_get_version(ssl)
+              << (SSL_session_reused(ssl) ? " (resumed)" : "")
+              << (BIO_get_ktls_send(SSL_get_wbio(ssl)) ? " (kTLS)" : "")
+              << std::endl;
+  }
+
+  const size_t bufferSize = 4096;
+  char buffer[bufferSize];
+  while (active) {
+    int bytesRead = SSL_read(ssl, buffer, bufferSize);
+    if (bytesRead > 0) {
+      consumeInput(buffer, bytesRead);
+      continue;
+    }
+    int error = SSL_get_error(ssl, bytesRead);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      if (!wireOutput.empty()) {
+        server->queueFlush(this);  // The write may have waited for this read
+      }
+      return;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN) {
+      std::cout << "Client disconnected." << std::endl;
+      handleDisconnect("Connection closed");
+    } else {
+      std::cerr << "Read error." << std::endl;
+      handleDisconnect("Read error");
+    }
+    return;
+  }
+}
+
+// With partial writes on, SSL_write takes what the socket takes, like
+// send(). A blocked SSL_write must be retried with the same bytes, so they
+// wait in wireOutput and nothing is added behind them until they are gone.
+// WANT_READ (the session needs the peer first) is retried by
+// processTlsInput once the peer's data has come in.
+ClientHandler::WriteResult ClientHandler::writeTls() {
+  while (true) {
+    if (wireOutput.empty()) {
+      if (!hasPendingOutput()) {
+        return kWriteDone;
+      }
+      takePlainOutput(wireOutput);
+    }
+    int sent = SSL_write(ssl, wireOutput.data(), wireOutput.size());
+    if (sent <= 0) {
+      int error = SSL_get_error(ssl, sent);
+      if (error == SSL_ERROR_WANT_WRITE) {
+        return kWriteBlocked;
+      }
+      if (error == SSL_ERROR_WANT_READ) {
+        return kWriteDone;
+      }
+      wireOutput.clear();
+      replyBuffer.clear();
+      outputBuffer.clear();
+      return kWriteFailed;
+    }
+    wireOutput.erase(0, sent);
+  }
+}
+#endif
+
 void ClientHandler::processCommand(const std::string& fullCommand) {
   std::string trimmedCommand = fullCommand;
 
@@ -54,20 +262,33 @@ void ClientHandler::processCommand(const std::string& fullCommand) {
   trimmedCommand.erase(
       std::remove(trimmedCommand.begin(), trimmedCommand.end(), '\n'),
       trimmedCommand.end());
+  LineBreaks line;
+  scanLine(trimmedCommand.data(), trimmedCommand.size(), line);
+  dispatchLine(trimmedCommand, line.space);
+}
 
-  size_t spacePos = trimmedCommand.find(' ');
-
-  std::string command = (spacePos != std::string::npos)
-                            ? trimmedCommand.substr(0, spacePos)
-                            : trimmedCommand;
-  std::string parameters = (spacePos != std::string::npos)
-                               ? trimmedCommand.substr(spacePos + 1)
-                               : "";
-  parseCommand(command, parameters);
+// A clean line (no '\r' or '\n') whose first space is at space, or at its
+// end if it has none.
+void ClientHandler::dispatchLine(const std::string& line, size_t space) {
+  if (link) {
+    server->getLinks().handleLinkLine(this, line);
+    return;
+  }
+  if (space >= line.size()) {
+    parseCommand(line, "");
+  } else {
+    parseCommand(line.substr(0, space), line.substr(space + 1));
+  }
 }
 
 void ClientHandler::parseCommand(const std::string& command,
                                  const std::string& parameters) {
+  ModuleManager& modules = server->getModules();
+  if (modules.hasCommandHooks() &&
+      modules.runCommandHooks(this, command, parameters) ==
+          ModuleManager::kDrop) {
+    return;
+  }
   if (!isPassed || !isWelcomed) {
     if (command == "NICK") {
       handleNickCommand(parameters);
@@ -75,15 +296,17 @@ void ClientHandler::parseCommand(const std::string& command,
       handleUserCommand(parameters);
     } else if (command == "PASS") {
       handlePassCommand(parameters);
+    } else if (command == "CAP") {
+      handleCapCommand(parameters);
+    } else if (command == "AUTHENTICATE") {
+      handleAuthenticateCommand(parameters);
     } else if (command == "JOIN" && parameters == ":") {
       sendMessage(":Server 451 * JOIN :You have not registered.");
+    } else if (command == "SERVER" && nickname.empty()) {
+      server->getLinks().handleServerCommand(this, parameters);
+      return;
     }
-    if (isPassed && !nickname.empty() && !username.empty() &&
-        !hostname.empty()) {
-      sendMessage(":Server 001 " + nickname + " :Welcome to the server, " +
-                  nickname + "!");
-      isWelcomed = true;
-    }
+    completeRegistration();
   } else {
     if (command == "NICK") {
       handleNickCommand(parameters);
@@ -95,12 +318,25 @@ void ClientHandler::parseCommand(const std::string& command,
       handleLeaveCommand(parameters);
     } else if (command == "PRIVMSG") {
       handlePrivMsgCommand(parameters);
+    } else if (command == "NOTICE") {
+      handleNoticeCommand(parameters);
     } else if (command == "MODE") {
       handleModeCommand(parameters);
+    } else if (command == "CHATHISTORY") {
+      handleChatHistoryCommand(parameters);
     } else if (command == "PING") {
       sendMessage(":Server PONG Server :Server");
-    } else if (command == "CAP" || command == "WHOIS" || command == "WHO" ||
-               command == "PASS") {
+    } else if (command == "WHO") {
+      handleWhoCommand(parameters);
+    } else if (command == "WHOIS") {
+      handleWhoisCommand(parameters);
+    } else if (command == "MONITOR") {
+      handleMonitorCommand(parameters);
+    } else if (command == "STATS") {
+      handleStatsCommand(parameters);
+    } else if (command == "CAP") {
+      handleCapCommand(parameters);
+    } else if (command == "PASS") {
       ;
     } else if (command == "KICK") {
       handleKickCommand(parameters);
@@ -109,13 +345,38 @@ void ClientHandler::parseCommand(const std::string& command,
     } else if (command == "TOPIC") {
       handleTopicCommand(parameters);
     } else if (command == "QUIT") {
-      handleDisconnect();
+      handleDisconnect(parameters.empty() || parameters == ":"
+                           ? "Client Quit"
+                           : "Quit: " + (parameters[0] == ':'
+                                             ? parameters.substr(1)
+                                             : parameters));
     } else {
       defaultMessageHandling(command + " " + parameters);
     }
   }
 }
 
+// Welcome the client once it has passed and named itself, unless CAP
+// negotiation, a password check or the hostname lookup is still holding
+// registration.
+void ClientHandler::completeRegistration() {
+  if (isWelcomed || !isPassed || nickname.empty() || username.empty() ||
+      hostname.empty() || capHeld || loginRequest != 0 ||
+      lookupRequest != 0) {
+    return;
+  }
+  sendMessage(":Server 001 " + nickname + " :Welcome to the server, " +
+              nickname + "!");
+  std::ostringstream limit;
+  limit << MonitorIndex::kMaxTargets;
+  sendMessage(":Server 005 " + nickname + " MONITOR=" + limit.str() +
+              " :are supported by this server");
+  isWelcomed = true;
+  server->getUserIndex().add(this);
+  server->getMonitors().userOnline(this, nickname);
+  server->getLinks().introduceUser(this);
+}
+
 void ClientHandler::handleModeCommand(const std::string& parameters) {
   std::string target;
   std::string mode;
@@ -125,8 +386,12 @@ void ClientHandler::handleModeCommand(const std::string& parameters) {
       sendMessage(":Server ERROR :Invalid MODE command format.");
       return;
     }
-    target = nickname;
-    mode = parameters;
+    if (parameters[0] == '#') {
+      target = parameters;  // "MODE #channel" asks for the current modes
+    } else {
+      target = nickname;
+      mode = parameters;
+    }
   } else {
     target = parameters.substr(0, spacePos);
     mode = parameters.substr(spacePos + 1);
@@ -147,26 +412,304 @@ void ClientHandler::handleModeCommand(const std::string& parameters) {
 }
 
 void ClientHandler::handlePrivMsgCommand(const std::string& parameters) {
-  size_t spacePos = std::string::npos;
-  for (size_t i = 0; i < parameters.size(); ++i) {
-    if (parameters[i] == ' ') {
-      spacePos = i;
-      break;
+  handleMessageCommand("PRIVMSG", parameters);
+}
+
+void ClientHandler::handleNoticeCommand(const std::string& parameters) {
+  handleMessageCommand("NOTICE", parameters);
+}
+
+// PRIVMSG/NOTICE <target>{,<target>} :<text>
+// The text is parsed once and the sender prefix formatted once; every
+// recipient gets the line once even if it shares several target channels.
+// Text matching the content filter (-P) goes nowhere. NOTICE never
+// generates error replies.
+void ClientHandler::handleMessageCommand(const std::string& command,
+                                         const std::string& parameters) {
+  bool isNotice = (command == "NOTICE");
+  size_t spacePos = parameters.find(' ');
+  if (spacePos == std::string::npos || spacePos == 0) {
+    if (!isNotice) {
+      sendMessage(":Server ERROR :Invalid " + command + " format.");
     }
+    return;
   }
-  if (spacePos == std::string::npos) {
-    sendMessage(":Server ERROR :Invalid PRIVMSG format.");
+  std::string targets = parameters.substr(0, spacePos);
+  size_t textPos = parameters.find_first_not_of(' ', spacePos);
+  if (textPos != std::string::npos && parameters[textPos] == ':') {
+    ++textPos;
+  }
+  if (textPos == std::string::npos || textPos >= parameters.size()) {
+    if (!isNotice) {
+      sendMessage(":Server 412 " + nickname + " :No text to send");
+    }
+    return;
+  }
+  std::string message = parameters.substr(textPos);
+  if (server->getContentFilter().matches(message)) {
+    if (!isNotice) {
+      sendMessage(":Server 404 " + nickname + " " + targets +
+                  " :Message blocked by content filter");
+    }
+    return;
+  }
+  std::string prefix = getPrefix();
+  std::string head = ":" + prefix + " " + command + " ";
+  char logType = MessageLog::kPrivmsg;
+  if (isNotice) {
+    logType = MessageLog::kNotice;
+  }
+  bool isFileTransfer =
+      !isNotice && message.find(".DCC SEND") != std::string::npos;
+
+  unsigned long epoch = server->nextFanoutEpoch();
+  markFanout(epoch);
+  size_t start = 0;
+  while (start <= targets.size()) {
+    size_t comma = targets.find(',', start);
+    if (comma == std::string::npos) {
+      comma = targets.size();
+    }
+    std::string target = targets.substr(start, comma - start);
+    start = comma + 1;
+    if (target.empty()) {
+      continue;
+    }
+    if (target[0] == '#') {
+      std::cout << "Channel message: " << message << std::endl;
+      Channel* channel = server->findChannel(target);
+      if (channel && channel->isClientMember(this) &&
+          channel->isBanned(this) && !channel->isOperator(this)) {
+        if (!isNotice) {
+          sendMessage(":Server 404 " + nickname + " " + target +
+                      " :Cannot send to channel (+b)");
+        }
+      } else if (channel && channel->isClientMember(this)) {
+        std::string line = head + target + " :" + message;
+        if (channel->droppedByModules(line, this)) {
+          continue;
+        }
+        channel->broadcastUnmarked(line, epoch);
+        server->getLinks().routeToChannel(channel, line, NULL);
+        server->logTraffic(logType, prefix, target, message);
+        server->getHistory().record(channel, line);  // Last: takes line
+      } else if (!isNotice) {
+        sendMessage(":Server ERROR :You are not in channel " + target);
+      }
+    } else if (isFileTransfer) {
+      if (server->findClientHandlerByNickname(target)) {
+        server->logTraffic(logType, prefix, target, message);
+      }
+      handleFileTransferMessage(target, message);
+    } else {
+      ClientHandler* recipient = server->findClientHandlerByNickname(target);
+      if (recipient == NULL) {
+        if (!isNotice) {
+          sendMessage(":Server 401 " + nickname + " " + target +
+                      " :No such nick/channel");
+        }
+      } else if (recipient->markFanout(epoch)) {
+        server->getLinks().routeToUser(recipient,
+                                       head + target + " :" + message);
+        server->logTraffic(logType, prefix, target, message);
+      }
+    }
+  }
+}
+
+// CHATHISTORY LATEST <target> <* | ref> <limit>
+// CHATHISTORY BEFORE|AFTER|AROUND <target> <ref> <limit>
+// CHATHISTORY BETWEEN <target> <ref> <ref> <limit>
+// A ref is msgid=<id> or timestamp=<ISO 8601>. The reply is one batch, queued
+// in full before the next flush so it leaves in as few writes as possible.
+void ClientHandler::handleChatHistoryCommand(const std::string& parameters) {
+  std::vector<std::string> args;
+  std::istringstream paramStream(parameters);
+  std::string arg;
+  while (paramStream >> arg) {
+    args.push_back(arg);
+  }
+  std::string subcommand = args.empty() ? "" : args[0];
+  size_t expected = (subcommand == "BETWEEN") ? 5 : 4;
+  if (args.size() != expected ||
+      (subcommand != "LATEST" && subcommand != "BEFORE" &&
+       subcommand != "AFTER" && subcommand != "AROUND" &&
+       subcommand != "BETWEEN")) {
+    sendMessage(":Server FAIL CHATHISTORY INVALID_PARAMS " + subcommand +
+                " :Invalid parameters");
     return;
   }
-  std::string target = parameters.substr(0, spacePos);
-  std::string message = parameters.substr(spacePos + 2);
-  if (!target.empty() && target[0] == '#') {
-    handleChannelMessage(target, message);
-  } else if (message.find(".DCC SEND") != std::string::npos) {
-    handleFileTransferMessage(target, message);
+  const std::string& target = args[1];
+  Channel* channel = server->findChannel(target);
+  if (channel == NULL || !channel->isClientMember(this)) {
+    sendMessage(":Server FAIL CHATHISTORY INVALID_TARGET " + subcommand + " " +
+                target + " :Messages could not be retrieved");
+    return;
+  }
+  int limit = std::atoi(args[expected - 1].c_str());
+  if (limit <= 0 || limit > 100) {
+    limit = 100;
+  }
+
+  MessageHistory& history = server->getHistory();
+  const std::deque<MessageHistory::Entry>* ring = history.find(channel);
+  size_t size = ring ? ring->size() : 0;
+  size_t first = 0;
+  size_t last = size;  // Entries [first, last) are candidates
+  bool fromEnd = false;  // Take the newest `limit` candidates
+  size_t index = 0;
+  bool exact = false;
+  if (subcommand == "LATEST") {
+    fromEnd = true;
+    if (args[2] != "*") {
+      if (!history.resolve(channel, args[2], index, exact)) {
+        sendMessage(":Server FAIL CHATHISTORY INVALID_PARAMS LATEST :Invalid "
+                    "message reference");
+        return;
+      }
+      first = exact ? index + 1 : index;
+    }
+  } else if (!history.resolve(channel, args[2], index, exact)) {
+    sendMessage(":Server FAIL CHATHISTORY INVALID_PARAMS " + subcommand +
+                " :Invalid message reference");
+    return;
+  } else if (subcommand == "BEFORE") {
+    fromEnd = true;
+    last = index;
+  } else if (subcommand == "AFTER") {
+    first = exact ? index + 1 : index;
+  } else if (subcommand == "AROUND") {
+    first = index > static_cast<size_t>(limit) / 2
+                ? index - static_cast<size_t>(limit) / 2
+                : 0;
   } else {
-    server->sendMessageToUser(nickname, target, message);
+    size_t endIndex = 0;
+    bool endExact = false;
+    if (!history.resolve(channel, args[3], endIndex, endExact)) {
+      sendMessage(":Server FAIL CHATHISTORY INVALID_PARAMS BETWEEN :Invalid "
+                  "message reference");
+      return;
+    }
+    first = exact ? index + 1 : index;
+    last = endIndex;
+  }
+  if (last > size) {
+    last = size;
   }
+  if (first > last) {
+    first = last;
+  }
+  if (last - first > static_cast<size_t>(limit)) {
+    if (fromEnd) {
+      first = last - limit;
+    } else {
+      last = first + limit;
+    }
+  }
+
+  std::ostringstream batchId;
+  batchId << "h" << server->nextFanoutEpoch();
+  sendMessage(":Server BATCH +" + batchId.str() + " chathistory " + target);
+  for (size_t i = first; i < last; ++i) {
+    const MessageHistory::Entry& entry = (*ring)[i];
+    std::ostringstream tags;
+    tags << "@batch=" << batchId.str()
+         << ";time=" << MessageHistory::formatTime(entry.time)
+         << ";msgid=" << entry.msgid << " ";
+    sendMessage(tags.str() + entry.line);
+  }
+  sendMessage(":Server BATCH -" + batchId.str());
+}
+
+// WHO [<mask>]: see UserIndex. Large replies continue over later loop
+// iterations.
+void ClientHandler::handleWhoCommand(const std::string& parameters) {
+  std::istringstream paramStream(parameters);
+  std::string mask;
+  paramStream >> mask;
+  server->getUserIndex().startWho(this, mask);
+}
+
+// MONITOR +|- <nick>{,<nick>}, or MONITOR C|L|S: see MonitorIndex.
+void ClientHandler::handleMonitorCommand(const std::string& parameters) {
+  std::istringstream paramStream(parameters);
+  std::string subcommand;
+  std::string targets;
+  paramStream >> subcommand >> targets;
+  if (!targets.empty() && targets[0] == ':') {
+    targets.erase(0, 1);
+  }
+  MonitorIndex& monitors = server->getMonitors();
+  if (subcommand == "+" && !targets.empty()) {
+    monitors.add(this, targets);
+  } else if (subcommand == "-" && !targets.empty()) {
+    monitors.remove(this, targets);
+  } else if (subcommand == "C" || subcommand == "c") {
+    monitors.clear(this);
+  } else if (subcommand == "L" || subcommand == "l") {
+    monitors.list(this);
+  } else if (subcommand == "S" || subcommand == "s") {
+    monitors.status(this);
+  } else {
+    sendMessage(":Server 461 " + nickname + " MONITOR :Not enough parameters");
+  }
+}
+
+// STATS M: calls and time spent in each module hook. Other queries only
+// get the end line.
+void ClientHandler::handleStatsCommand(const std::string& parameters) {
+  std::string query = parameters.substr(0, parameters.find(' '));
+  if (query == "M" || query == "m") {
+    server->getModules().sendStats(this);
+  }
+  sendMessage(":Server 219 " + nickname + " " + query +
+              " :End of STATS report");
+}
+
+// WHOIS <nick>{,<nick>}
+void ClientHandler::handleWhoisCommand(const std::string& parameters) {
+  std::istringstream paramStream(parameters);
+  std::string targets;
+  paramStream >> targets;
+  if (targets.empty()) {
+    sendMessage(":Server 431 " + nickname + " :No nickname given");
+    return;
+  }
+  std::istringstream targetStream(targets);
+  std::string target;
+  while (std::getline(targetStream, target, ',')) {
+    ClientHandler* user = server->findClientHandlerByNickname(target);
+    if (user == NULL || !user->isRegistered()) {
+      sendMessage(":Server 401 " + nickname + " " + target +
+                  " :No such nick/channel");
+      continue;
+    }
+    std::string channelList;
+    const std::set<Channel*>& joined = user->getChannels();
+    for (std::set<Channel*>::const_iterator it = joined.begin();
+         it != joined.end(); ++it) {
+      channelList += (channelList.empty() ? "" : " ") +
+                     std::string((*it)->isOperator(user) ? "@" : "") +
+                     (*it)->getName();
+    }
+    sendMessage(":Server 311 " + nickname + " " + user->nickname + " " +
+                user->username + " " + user->hostname + " * :" +
+                user->username);
+    if (!channelList.empty()) {
+      sendMessage(":Server 319 " + nickname + " " + user->nickname + " :" +
+                  channelList);
+    }
+    sendMessage(":Server 312 " + nickname + " " + user->nickname + " " +
+                (user->uplink ? user->serverName.str()
+                              : server->getLinks().getName()) +
+                " :IRC server");
+    if (!user->account.empty()) {
+      sendMessage(":Server 330 " + nickname + " " + user->nickname + " " +
+                  user->account + " :is logged in as");
+    }
+  }
+  sendMessage(":Server 318 " + nickname + " " + targets +
+              " :End of /WHOIS list");
 }
 
 void ClientHandler::handleFileTransferMessage(const std::string& target,
@@ -192,10 +735,21 @@ void ClientHandler::handleChannelMessage(const std::string& channelName,
                                          const std::string& message) {
   std::cout << "Channel message: " << message << std::endl;
   Channel* channel = server->findChannel(channelName);
-  if (channel && channel->isClientMember(this)) {
-    channel->broadcastMessage(":" + nickname + "!" + username + "@" + hostname +
-                                  " PRIVMSG " + channelName + " :" + message,
-                              this);
+  if (channel && channel->isClientMember(this) && channel->isBanned(this) &&
+      !channel->isOperator(this)) {
+    sendMessage(":Server 404 " + nickname + " " + channelName +
+                " :Cannot send to channel (+b)");
+  } else if (channel && channel->isClientMember(this)) {
+    std::string line = ":" + nickname + "!" + username + "@" + hostname +
+                       " PRIVMSG " + channelName + " :" + message;
+    if (channel->droppedByModules(line, this)) {
+      return;
+    }
+    channel->broadcastMessage(line, this);
+    server->getLinks().routeToChannel(channel, line, NULL);
+    server->logTraffic(MessageLog::kPrivmsg, getPrefix(), channelName,
+                       message);
+    server->getHistory().record(channel, line);  // Last: takes line
   } else {
     sendMessage(":Server ERROR :You are not in channel " + channelName);
   }
@@ -209,19 +763,34 @@ void ClientHandler::handleNickCommand(const std::string& parameters) {
     sendMessage(":Server 431 * :No nickname given");
     return;
   }
-  if (server->isNicknameAvailable(newNickname)) {
-    if (!nickname.empty() && nickname != newNickname) {
-      server->unregisterNickname(nickname);
-    }
-  } else {
-    while (!server->isNicknameAvailable(newNickname)) {
-      newNickname += "_";
-    }
+  if (nickname == newNickname) {
+    return;
+  }
+  while (!server->isNicknameAvailable(newNickname)) {
+    newNickname += "_";
+  }
+  // The old nick is released whichever name we end up with: nothing may
+  // keep pointing at this handler under it
+  if (!nickname.empty()) {
+    server->unregisterNickname(nickname);
   }
   server->registerNickname(newNickname, this);
+  std::string nickMessage =
+      ":" + (nickname.empty() ? newNickname : nickname.str()) + "!" +
+      username + "@" + hostname + " NICK :" + newNickname;
+  if (isWelcomed) {
+    server->getUserIndex().remove(this);
+  }
   nickname = newNickname;
-  sendMessage(":" + nickname + "!" + username + "@" + hostname +
-              " NICK :" + nickname);
+  if (isWelcomed) {
+    server->getUserIndex().add(this);
+  }
+  forgetBanStatus();
+  server->broadcastToSharedChannels(this, nickMessage);
+  if (isWelcomed) {
+    server->getLinks().propagate(nickMessage, NULL);
+  }
+  sendMessage(nickMessage);
   sendMessage(":Server NOTICE " + nickname + " :Nickname set to " +
               newNickname);
 }
@@ -237,8 +806,17 @@ void ClientHandler::handleUserCommand(const std::string& parameters) {
     sendMessage(":Server ERROR :Invalid USER command format.\r\n");
     return;
   }
+  if (isWelcomed) {
+    server->getUserIndex().remove(this);
+  }
   username = userParams[0];
-  hostname = userParams[2];
+  if (!hostFromLookup) {
+    hostname = userParams[2];
+  }
+  if (isWelcomed) {
+    server->getUserIndex().add(this);
+  }
+  forgetBanStatus();
   sendMessage(":Server 302 " + nickname + " :");
 }
 
@@ -273,7 +851,8 @@ void ClientHandler::handleJoinCommand(const std::string& parameters) {
 }
 
 bool ClientHandler::isAlreadyInChannel(const std::string& channelName) {
-  if (channels.find(channelName) != channels.end()) {
+  Channel* channel = server->findChannel(channelName);
+  if (channel && channels.find(channel) != channels.end()) {
     sendMessage(":Server ERROR :You are already in channel " + channelName +
                 "\r\n");
     return true;
@@ -293,7 +872,11 @@ Channel* ClientHandler::getOrCreateChannel(const std::string& channelName) {
 bool ClientHandler::joinChannel(Channel* channel,
                                 const std::string& channelName,
                                 const std::string& password) {
-  if (channel->isFull()) {
+  if (channel->isBanned(this)) {
+    sendMessage(":Server 474 " + nickname + " " + channelName +
+                " :Cannot join channel (+b)");
+    return false;
+  } else if (channel->isFull()) {
     sendMessage(":Server 471 " + nickname + " " + channelName +
                 " :Cannot join channel (+l) - channel is full");
     return false;
@@ -301,7 +884,7 @@ bool ClientHandler::joinChannel(Channel* channel,
     std::cout << "Checking invitation\n";
     if (channel->checkInvitation((this))) {
       channel->addClient(this);
-      channels.insert(channelName);
+      channels.insert(channel);
       broadcastJoinMessage(channel, channelName);
       return true;
     } else {
@@ -311,7 +894,7 @@ bool ClientHandler::joinChannel(Channel* channel,
     }
   } else if (!channel->hasPassword() || channel->checkPassword(password)) {
     channel->addClient(this);
-    channels.insert(channelName);
+    channels.insert(channel);
     broadcastJoinMessage(channel, channelName);
     return true;
   } else {
@@ -323,15 +906,17 @@ bool ClientHandler::joinChannel(Channel* channel,
 
 void ClientHandler::broadcastJoinMessage(Channel* channel,
                                          const std::string& channelName) {
-  std::string message = ":" + nickname + "!" + username + "@" + hostname +
-                        " JOIN :" + channelName + "\r\n";
-  message += ":Server 353 " + nickname + " = " + channelName + " :" +
-             channel->getClientList() + "\r\n";
-  message +=
-      ":Server 366 " + nickname + " " + channelName + " :End of /NAMES list.";
-  sendMessage(message);
-
-  channel->broadcastMessage(message, this);
+  std::string joinMessage = ":" + nickname + "!" + username + "@" + hostname +
+                            " JOIN :" + channelName;
+  // Only the joiner needs the NAMES list; everyone else just sees the JOIN.
+  channel->broadcastMembershipChange(joinMessage, this);
+  server->getLinks().propagate(joinMessage, NULL);
+  server->logTraffic(MessageLog::kJoin, getPrefix(), channelName, "");
+  sendMessage(joinMessage + "\r\n" + ":Server 353 " + nickname + " = " +
+              channelName + " :" + channel->getClientList(this) + "\r\n" +
+              ":Server 366 " + nickname + " " + channelName +
+              " :End of /NAMES list.");
+
   std::string welcomeMessage =
       "-------------------------- Welcome to " + channelName + ", " + nickname +
       "!" +
@@ -346,18 +931,20 @@ void ClientHandler::broadcastJoinMessage(Channel* channel,
 }
 
 void ClientHandler::handleLeaveCommand(const std::string& parameters) {
-  if (channels.find(parameters) == channels.end()) {
+  Channel* channel = server->findChannel(parameters);
+  if (channel == NULL || channels.find(channel) == channels.end()) {
     sendMessage(":Server ERROR :You are not in channel " + parameters);
     return;
   }
-  Channel* channel = server->findChannel(parameters);
-  if (channel) {
-    channel->removeClient(this);
-    channel->removeInvitation(this);
-    channels.erase(parameters);
-    sendMessage(":" + nickname + "!" + username + "@" + hostname +
-                " PART :" + parameters);
-  }
+  std::string partMessage = ":" + nickname + "!" + username + "@" + hostname +
+                            " PART :" + parameters;
+  channel->broadcastMembershipChange(partMessage, this);
+  server->getLinks().propagate(partMessage, NULL);
+  server->logTraffic(MessageLog::kPart, getPrefix(), parameters, "");
+  channel->removeClient(this);
+  channel->removeInvitation(this);
+  channels.erase(channel);
+  sendMessage(partMessage);
 }
 
 void ClientHandler::handleKickCommand(const std::string& parameters) {
@@ -383,6 +970,9 @@ void ClientHandler::handleKickCommand(const std::string& parameters) {
                           targetName;
     sendMessage(message);
     channel->broadcastMessage(message, this);
+    server->getLinks().propagate(message, NULL);
+    server->logTraffic(MessageLog::kKick, getPrefix(),
+                       channel->getChannelName(), targetName);
     channel->removeClient(target);
     channel->removeInvitation(target);
     target->eraseChannel(channel);
@@ -422,6 +1012,7 @@ void ClientHandler::handleTopicCommand(const std::string& parameters) {
                              " TOPIC " + channelName + " :" + newTopic;
 
   channel->broadcastMessage(topicMessage, NULL);
+  server->getLinks().propagate(topicMessage, NULL);
 }
 
 void ClientHandler::handleInviteCommand(const std::string& parameters) {
@@ -457,55 +1048,569 @@ void ClientHandler::handleInviteCommand(const std::string& parameters) {
   }
 }
 
+// The server password, or "account:password" when accounts are loaded.
+// An account's hash is checked on a worker thread; registration waits for
+// finishLogin.
 void ClientHandler::handlePassCommand(const std::string& parameters) {
   if (parameters.empty()) {
     sendMessage(":Server ERROR :Invalid PASS command format.");
     return;
   }
-  if (server->getPassword() != parameters) {
-    sendMessage(":Server NOTICE " + nickname +
-                " :*** Could not resolve your hostname: Request timed out; "
-                "using your IP address (" +
-                hostname + ") instead. ERROR :Closing link: (" + username +
-                "@" + hostname + ") [Access denied by configuration]");
+  if (server->getPassword() == parameters) {
+    isPassed = true;
+    return;
+  }
+  size_t colon = parameters.find(':');
+  if (server->hasAccounts() && colon != 0 && colon != std::string::npos &&
+      loginRequest == 0) {
+    loginRequest = server->startLogin(this, parameters.substr(0, colon),
+                                      parameters.substr(colon + 1));
+    if (loginRequest != 0) {
+      loginBySasl = false;
+      return;
+    }
+  }
+  denyAccess();
+}
+
+void ClientHandler::denyAccess() {
+  sendMessage(":Server NOTICE " + nickname + " :ERROR :Closing link: (" +
+              username + "@" + hostname +
+              ") [Access denied by configuration]");
+
+  handleDisconnect("Access denied");
+}
+
+// A password check started by PASS or AUTHENTICATE came back.
+void ClientHandler::finishLogin(const std::string& accountName,
+                                bool accepted) {
+  loginRequest = 0;
+  std::string target = nickname.empty() ? "*" : nickname.str();
+  if (!accepted) {
+    if (loginBySasl) {
+      sendMessage(":Server 904 " + target + " :SASL authentication failed");
+    } else {
+      denyAccess();
+    }
+    return;
+  }
+  account = accountName;
+  isPassed = true;
+  if (loginBySasl) {
+    sendMessage(":Server 900 " + target + " " +
+                (nickname.empty() ? "*" : getPrefix()) + " " + account +
+                " :You are now logged in as " + account);
+    sendMessage(":Server 903 " + target + " :SASL authentication successful");
+  }
+  completeRegistration();
+}
+
+// With -R the hostname is the connecting address's verified reverse DNS
+// name, and registration waits for it (request 0: answered from the cache).
+void ClientHandler::awaitHostname(unsigned long request) {
+  hostFromLookup = true;
+  lookupRequest = request;
+  sendMessage(":Server NOTICE * :*** Looking up your hostname...");
+}
 
-    handleDisconnect();
+void ClientHandler::setLookedUpHost(const std::string& host) {
+  lookupRequest = 0;
+  std::string target = nickname.empty() ? "*" : nickname.str();
+  if (host.empty()) {
+    struct in_addr address;
+    address.s_addr = htonl(peerAddress);
+    hostname = inet_ntoa(address);
+    sendMessage(":Server NOTICE " + target +
+                " :*** Couldn't look up your hostname, using your IP "
+                "address instead");
   } else {
-    isPassed = true;
+    hostname = host;
+    sendMessage(":Server NOTICE " + target + " :*** Found your hostname");
   }
+  completeRegistration();
 }
 
-void ClientHandler::handleDisconnect() {
-  std::set<std::string>::iterator it;
-  for (it = channels.begin(); it != channels.end(); ++it) {
-    const std::string& channelName = *it;
-    Channel* channel = server->findChannel(channelName);
-    if (channel) {
-      channel->removeClient(this);
-      channel->removeInvitation(this);
+// zlib level for negotiated compression: most of level 9's ratio on chat
+// traffic for a fraction of its CPU (see README)
+static const int kDeflateLevel = 6;
+
+// CAP LS, LIST, REQ and END. "deflate" makes everything after its ACK a
+// single compressed stream (see DeflateStream). It is not offered over TLS,
+// where compressing secrets next to text an attacker controls would leak
+// them through the record sizes. "sasl" is offered when accounts are
+// loaded. LS or REQ before the welcome holds registration until CAP END.
+void ClientHandler::handleCapCommand(const std::string& parameters) {
+  std::string target = nickname.empty() ? "*" : nickname.str();
+  size_t spacePos = parameters.find(' ');
+  std::string subcommand = parameters.substr(0, spacePos);
+  std::string caps =
+      spacePos != std::string::npos ? parameters.substr(spacePos + 1) : "";
+  if (!caps.empty() && caps[0] == ':') {
+    caps.erase(0, 1);
+  }
+  std::string offered = isTls() ? "" : "deflate";
+  if (server->hasAccounts()) {
+    offered += offered.empty() ? "sasl" : " sasl";
+  }
+  if (subcommand == "LS") {
+    capHeld = !isWelcomed;
+    sendMessage(":Server CAP " + target + " LS :" + offered);
+  } else if (subcommand == "LIST") {
+    std::string enabled = deflate ? "deflate" : "";
+    if (saslEnabled) {
+      enabled += enabled.empty() ? "sasl" : " sasl";
+    }
+    sendMessage(":Server CAP " + target + " LIST :" + enabled);
+  } else if (subcommand == "REQ") {
+    std::istringstream requested(caps);
+    std::vector<std::string> names;
+    std::string name;
+    while (requested >> name) {
+      if ((" " + offered + " ").find(" " + name + " ") == std::string::npos) {
+        sendMessage(":Server CAP " + target + " NAK :" + caps);
+        return;
+      }
+      names.push_back(name);
+    }
+    if (names.empty()) {
+      sendMessage(":Server CAP " + target + " NAK :" + caps);
+      return;
+    }
+    capHeld = !isWelcomed;
+    sendMessage(":Server CAP " + target + " ACK :" + caps);
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == "deflate") {
+        startCompression();
+      } else {
+        saslEnabled = true;
+      }
     }
+  } else if (subcommand == "END") {
+    capHeld = false;
+  } else {
+    sendMessage(":Server 410 " + target + " " + subcommand +
+                " :Invalid CAP command");
+  }
+}
+
+// Base64 without line breaks; '=' padding only at the end.
+static bool decodeBase64(const std::string& text, std::string& out) {
+  static const std::string alphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  if (text.size() % 4 != 0) {
+    return false;
+  }
+  out.clear();
+  unsigned int bits = 0;
+  int count = 0;
+  size_t padding = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == '=' && i + 2 >= text.size()) {
+      ++padding;
+      continue;
+    }
+    size_t value = alphabet.find(text[i]);
+    if (value == std::string::npos || padding > 0) {
+      return false;
+    }
+    bits = (bits << 6) | value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out += static_cast<char>((bits >> count) & 0xff);
+    }
+  }
+  return true;
+}
+
+// Longest AUTHENTICATE argument; a full-length one means more follow
+static const size_t kSaslChunk = 400;
+// PLAIN credentials longer than this are refused
+static const size_t kMaxSaslPayload = 4 * kSaslChunk;
+
+// SASL PLAIN (RFC 4616) once "sasl" is ACKed: "AUTHENTICATE PLAIN", then
+// the base64 of "authzid NUL account NUL password" in 400-byte pieces,
+// ending with a shorter piece or "+". "AUTHENTICATE *" aborts. The password
+// is checked like PASS account:password.
+void ClientHandler::handleAuthenticateCommand(const std::string& parameters) {
+  std::string target = nickname.empty() ? "*" : nickname.str();
+  if (!saslEnabled) {
+    sendMessage(":Server 904 " + target + " :SASL authentication failed");
+    return;
+  }
+  if (!account.empty()) {
+    sendMessage(":Server 907 " + target +
+                " :You have already authenticated using SASL");
+    return;
+  }
+  if (parameters == "*") {
+    if (loginRequest != 0) {
+      server->cancelLogin(loginRequest);
+      loginRequest = 0;
+    }
+    saslStarted = false;
+    saslPayload.clear();
+    sendMessage(":Server 906 " + target + " :SASL authentication aborted");
+    return;
+  }
+  if (loginRequest != 0) {
+    return;  // The answer to the last attempt comes first
+  }
+  if (!saslStarted) {
+    if (parameters != "PLAIN") {
+      sendMessage(":Server 908 " + target +
+                  " PLAIN :are available SASL mechanisms");
+      sendMessage(":Server 904 " + target + " :SASL authentication failed");
+      return;
+    }
+    saslStarted = true;
+    saslPayload.clear();
+    sendMessage("AUTHENTICATE +");
+    return;
+  }
+  if (parameters.size() > kSaslChunk ||
+      saslPayload.size() + parameters.size() > kMaxSaslPayload) {
+    saslStarted = false;
+    saslPayload.clear();
+    sendMessage(":Server 905 " + target + " :SASL message too long");
+    return;
+  }
+  if (parameters != "+") {
+    saslPayload += parameters;
+  }
+  if (parameters.size() == kSaslChunk) {
+    return;
+  }
+  saslStarted = false;
+  std::string plain;
+  bool decoded = decodeBase64(saslPayload, plain);
+  saslPayload.clear();
+  size_t first = plain.find('\0');
+  size_t second =
+      first == std::string::npos ? first : plain.find('\0', first + 1);
+  if (decoded && second != std::string::npos) {
+    std::string authzid = plain.substr(0, first);
+    std::string authcid = plain.substr(first + 1, second - first - 1);
+    if (authzid.empty() || authzid == authcid) {
+      loginRequest =
+          server->startLogin(this, authcid, plain.substr(second + 1));
+    }
+  }
+  std::fill(plain.begin(), plain.end(), '\0');
+  if (loginRequest == 0) {
+    sendMessage(":Server 904 " + target + " :SASL authentication failed");
+    return;
+  }
+  loginBySasl = true;
+}
+
+// The ACK and everything queued before it go out as they are; later output
+// is compressed as it is flushed.
+void ClientHandler::startCompression() {
+  if (deflate) {
+    return;
+  }
+  deflate = new DeflateStream;
+  if (!deflate->start(kDeflateLevel)) {
+    handleDisconnect("Compression error");
+    return;
+  }
+  std::string plain;
+  takePlainOutput(plain);
+  wireOutput += plain;
+}
+
+void ClientHandler::handleDisconnect(const std::string& reason) {
+  if (!active) {
+    return;
   }
   deactivate();
+  if (loginRequest != 0) {
+    server->cancelLogin(loginRequest);
+    loginRequest = 0;
+  }
+  if (lookupRequest != 0) {
+    server->cancelHostLookup(this, lookupRequest);
+    lookupRequest = 0;
+  }
+  server->getUserIndex().remove(this);
+  server->getMonitors().clear(this);
+  if (isWelcomed) {
+    server->getMonitors().userOffline(nickname);
+  }
+  std::string quitMessage = ":" + getPrefix() + " QUIT :" + reason;
+  server->broadcastToSharedChannels(this, quitMessage);
+  if (uplink == NULL && isWelcomed) {
+    server->getLinks().propagate(quitMessage, NULL);
+  } else if (uplink == NULL) {
+    server->getLinks().linkLost(this);
+  }
+  std::set<Channel*>::iterator it;
+  for (it = channels.begin(); it != channels.end(); ++it) {
+    server->logTraffic(MessageLog::kQuit, getPrefix(), (*it)->getName(),
+                       reason);
+    (*it)->removeClient(this);
+    (*it)->removeInvitation(this);
+  }
+  channels.clear();
 }
 
+// Messages are queued and written once per loop iteration by the server,
+// so everything a command produces for this client leaves in one write.
+// Replies to the client's own command (numerics, PONG, its own echoes) are
+// queued apart from traffic caused by others and written first, so a
+// client backed up by a busy channel still gets its answers promptly.
+// Links get everything in order.
 void ClientHandler::sendMessage(const std::string& message) {
+  if (uplink) {
+    return;  // Users on other servers are reached through LinkManager
+  }
   std::cout << "Sending  : " << message << std::endl;
-  std::string fullMessage = message + "\r\n";
-  if (send(clientSocket, fullMessage.c_str(), fullMessage.size(), 0) == -1) {
-    std::cerr << "Failed to send message." << std::endl;
+  std::string& buffer = outputTarget();
+  buffer += message;
+  buffer += "\r\n";
+}
+
+// Queue a line that already ends in CRLF, without logging it. Broadcasts to
+// large channels build the line once and log it once.
+void ClientHandler::queueLine(const std::string& line) {
+  if (uplink) {
+    return;
+  }
+  outputTarget() += line;
+}
+
+std::string& ClientHandler::outputTarget() {
+  if (!hasPendingOutput()) {
+    server->queueFlush(this);
+  }
+  return handlingCommand && !link ? replyBuffer : outputBuffer;
+}
+
+// Write as much queued output as the socket takes without blocking.
+// Returns false if bytes are left over and the caller should wait for POLLOUT.
+bool ClientHandler::flushOutput() {
+#ifdef IRC_TLS
+  WriteResult result = ssl ? writeTls() : writeOutput();
+#else
+  WriteResult result = writeOutput();
+#endif
+  if (result == kWriteFailed) {
+    failWrite();
+  }
+  return result != kWriteBlocked;
+}
+
+// The socket part of flushOutput for plaintext connections. It only touches
+// this connection, so fan-out workers may run it for many clients at once;
+// the loop thread then calls failWrite() for those that failed.
+ClientHandler::WriteResult ClientHandler::writeOutput() {
+  if (deflate) {
+    return writeCompressed();
+  }
+  while (hasPendingOutput()) {
+    // Replies go first, but a half-written line is finished before them
+    bool replies = !replyBuffer.empty() && !outputMidLine;
+    std::string& buffer = replies ? replyBuffer : outputBuffer;
+    size_t length = replies || replyBuffer.empty() ? buffer.size()
+                                                   : buffer.find('\n') + 1;
+    bool more = replies ? !outputBuffer.empty() : !replyBuffer.empty();
+    ssize_t sent =
+        send(clientSocket, buffer.data(), length,
+             MSG_DONTWAIT | (corkFlushes && more ? MSG_MORE : 0));
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return kWriteBlocked;
+      }
+      replyBuffer.clear();
+      outputBuffer.clear();
+      return kWriteFailed;
+    }
+    if (!replies && sent > 0) {
+      outputMidLine = buffer[sent - 1] != '\n';
+    }
+    buffer.erase(0, sent);
+  }
+  return kWriteDone;
+}
+
+// Compressed output is only produced once the socket took the previous
+// batch, so queued lines keep their reply-first order until then and a
+// slow reader holds plain text, not a growing compressed backlog.
+ClientHandler::WriteResult ClientHandler::writeCompressed() {
+  while (true) {
+    if (wireOutput.empty()) {
+      if (!hasPendingOutput()) {
+        return kWriteDone;
+      }
+      std::string plain;
+      takePlainOutput(plain);
+      deflate->compress(plain, wireOutput);
+    }
+    ssize_t sent =
+        send(clientSocket, wireOutput.data(), wireOutput.size(), MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return kWriteBlocked;
+      }
+      wireOutput.clear();
+      replyBuffer.clear();
+      outputBuffer.clear();
+      return kWriteFailed;
+    }
+    wireOutput.erase(0, sent);
+  }
+}
+
+void ClientHandler::failWrite() {
+  std::cerr << "Failed to send message." << std::endl;
+  handleDisconnect("Write error");
+}
+
+bool ClientHandler::hasPendingOutput() const {
+  return !replyBuffer.empty() || !outputBuffer.empty() || !wireOutput.empty();
+}
+
+size_t ClientHandler::getPendingOutputSize() const {
+  return replyBuffer.size() + outputBuffer.size() + wireOutput.size();
+}
+
+// Hand the queued output, replies first and compressed if negotiated, to an
+// asynchronous writer (io_uring backend, TLS).
+void ClientHandler::takePendingOutput(std::string& out) {
+  if (!deflate) {
+    takePlainOutput(out);
+    return;
+  }
+  std::string plain;
+  takePlainOutput(plain);
+  out.clear();
+  out.swap(wireOutput);
+  deflate->compress(plain, out);
+}
+
+void ClientHandler::takePlainOutput(std::string& out) {
+  out.clear();
+  if (outputMidLine) {
+    size_t end = outputBuffer.find('\n') + 1;
+    out.append(outputBuffer, 0, end);
+    outputBuffer.erase(0, end);
+  }
+  out += replyBuffer;
+  if (out.empty()) {
+    out.swap(outputBuffer);
+  } else {
+    out += outputBuffer;
   }
+  replyBuffer.clear();
+  outputBuffer.clear();
+  outputMidLine = false;
 }
 
+// Put back the part of a taken buffer that the writer did not send. It may
+// start mid-line, so it goes out before any new replies.
+void ClientHandler::restorePendingOutput(const std::string& unsent) {
+  if (deflate) {
+    wireOutput.insert(0, unsent);
+    return;
+  }
+  outputBuffer.insert(0, unsent);
+  outputMidLine = true;
+}
+
+bool ClientHandler::isTls() const {
+#ifdef IRC_TLS
+  return ssl != NULL;
+#else
+  return false;
+#endif
+}
+
+bool ClientHandler::isRegistered() const { return isWelcomed; }
+
 void ClientHandler::deactivate() { active = false; }
 
-std::string ClientHandler::getNickname() const { return nickname; }
+int ClientHandler::getSocket() const { return clientSocket; }
+
+void ClientHandler::setPeerAddress(unsigned int address) {
+  peerAddress = address;
+}
 
-std::string ClientHandler::getUsername() const { return username; }
+void ClientHandler::setCorkFlushes(bool enabled) { corkFlushes = enabled; }
+
+unsigned int ClientHandler::getPeerAddress() const { return peerAddress; }
+
+const std::string& ClientHandler::getNickname() const { return nickname; }
+
+const std::string& ClientHandler::getUsername() const { return username; }
+
+const std::string& ClientHandler::getHostname() const { return hostname; }
+
+const std::string& ClientHandler::getAccount() const { return account; }
+
+std::string ClientHandler::getPrefix() const {
+  return nickname + "!" + username + "@" + hostname;
+}
+
+const std::set<Channel*>& ClientHandler::getChannels() const {
+  return channels;
+}
 
-std::string ClientHandler::getHostname() const { return hostname; }
+// Returns true the first time this client is seen in the given fan-out epoch,
+// so a recipient shared through several channels is only sent to once.
+bool ClientHandler::markFanout(unsigned long epoch) {
+  if (fanoutMark == epoch) {
+    return false;
+  }
+  fanoutMark = epoch;
+  return true;
+}
 
 bool ClientHandler::isActive() const { return active; }
 
 void ClientHandler::eraseChannel(Channel* channel) {
-  channels.erase(channel->getName());
-}
\ No newline at end of file
+  channels.erase(channel);
+}
+void ClientHandler::becomeLink(const std::string& peerName) {
+  link = true;
+  serverName = peerName;
+}
+
+// Turn this socketless handler into a user introduced by another server.
+void ClientHandler::makeRemote(ClientHandler* uplink, const std::string& nick,
+                               const std::string& user,
+                               const std::string& host,
+                               const std::string& serverName) {
+  this->uplink = uplink;
+  this->serverName = serverName;
+  nickname = nick;
+  username = user;
+  hostname = host;
+  isPassed = true;
+  isWelcomed = true;
+  server->getUserIndex().add(this);
+}
+
+void ClientHandler::setRemoteNickname(const std::string& newNickname) {
+  server->getUserIndex().remove(this);
+  server->unregisterNickname(nickname);
+  server->registerNickname(newNickname, this);
+  nickname = newNickname;
+  server->getUserIndex().add(this);
+}
+
+void ClientHandler::addChannel(Channel* channel) { channels.insert(channel); }
+
+// Our identity changed: cached +b results in our channels are stale.
+void ClientHandler::forgetBanStatus() {
+  for (std::set<Channel*>::iterator it = channels.begin();
+       it != channels.end(); ++it) {
+    (*it)->forgetBanStatus(this);
+  }
+}
+
+bool ClientHandler::isLink() const { return link; }
+
+ClientHandler* ClientHandler::getUplink() const { return uplink; }
+
+const std::string& ClientHandler::getServerName() const { return serverName; }
@@ -1,16 +1,27 @@
 #ifndef CLIENT_HANDLER_HPP
 #define CLIENT_HANDLER_HPP
 
+#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <cerrno>
+
+#ifdef IRC_TLS
+#include <openssl/ssl.h>
+#endif
+
 #include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <set>
 #include <sstream>
 #include <string>
 
+#include "InternedString.hpp"
+
 class Channel;
+class DeflateStream;
 class IRCServer;
 
 class ClientHandler {
@@ -21,6 +32,9 @@ class ClientHandler {
 
   // Input processing
   void processInput();
+  void consumeInput(const char* data, size_t length);
+  void runInputBudget();
+  void resumeInput();
   void processCommand(const std::string& fullCommand);
 
   // Command handlers
@@ -30,11 +44,21 @@ class ClientHandler {
   void handleJoinCommand(const std::string& parameters);
   void handleLeaveCommand(const std::string& parameters);
   void handlePrivMsgCommand(const std::string& parameters);
+  void handleNoticeCommand(const std::string& parameters);
+  void handleMessageCommand(const std::string& command,
+                            const std::string& parameters);
   void handleModeCommand(const std::string& parameters);
+  void handleChatHistoryCommand(const std::string& parameters);
+  void handleWhoCommand(const std::string& parameters);
+  void handleWhoisCommand(const std::string& parameters);
+  void handleMonitorCommand(const std::string& parameters);
+  void handleStatsCommand(const std::string& parameters);
   void handleKickCommand(const std::string& parameters);
   void handleInviteCommand(const std::string& parameters);
   void handleTopicCommand(const std::string& parameters);
   void handlePassCommand(const std::string& parameters);
+  void handleCapCommand(const std::string& parameters);
+  void handleAuthenticateCommand(const std::string& parameters);
   void defaultMessageHandling(const std::string& message);
   void handleChannelMessage(const std::string& channelName,
                             const std::string& message);
@@ -45,34 +69,109 @@ class ClientHandler {
   bool joinChannel(Channel* channel, const std::string& channelName,
                    const std::string& password);
   void eraseChannel(Channel* channel);
+  void forgetBanStatus();
   void handleFileTransferMessage(const std::string& target,
                                  const std::string& message);
   void broadcastJoinMessage(Channel* channel, const std::string& channelName);
 
   // Connection management
-  void handleDisconnect();
+  void handleDisconnect(const std::string& reason);
+  void finishLogin(const std::string& accountName, bool accepted);
+  void awaitHostname(unsigned long request);
+  void setLookedUpHost(const std::string& host);
   void sendMessage(const std::string& message);
+  void queueLine(const std::string& line);
+  bool flushOutput();
+  // kWriteSkipped: left for the loop thread (TLS), never from writeOutput
+  enum WriteResult { kWriteDone, kWriteBlocked, kWriteFailed, kWriteSkipped };
+  WriteResult writeOutput();
+  void failWrite();
+  bool hasPendingOutput() const;
+  size_t getPendingOutputSize() const;
+  void takePendingOutput(std::string& out);
+  void restorePendingOutput(const std::string& unsent);
+  void setPeerAddress(unsigned int address);
+  void setCorkFlushes(bool enabled);
+#ifdef IRC_TLS
+  void attachTls(SSL* session);
+  void processTlsInput();
+  WriteResult writeTls();
+#endif
+
+  // Server links (see LinkManager)
+  void becomeLink(const std::string& peerName);
+  void makeRemote(ClientHandler* uplink, const std::string& nick,
+                  const std::string& user, const std::string& host,
+                  const std::string& serverName);
+  void setRemoteNickname(const std::string& newNickname);
+  void addChannel(Channel* channel);
+  bool isLink() const;
+  ClientHandler* getUplink() const;
+  const std::string& getServerName() const;
 
   // Status checks
   bool isActive() const;
   void deactivate();
+  bool markFanout(unsigned long epoch);
+  bool isTls() const;
+  bool isRegistered() const;
+  bool isBacklogged() const;
 
   // Getters
-  std::string getNickname() const;
-  std::string getUsername() const;
-  std::string getHostname() const;
+  int getSocket() const;
+  unsigned int getPeerAddress() const;
+  const std::string& getNickname() const;
+  const std::string& getUsername() const;
+  const std::string& getHostname() const;
+  const std::string& getAccount() const;  // Empty unless logged in
+  std::string getPrefix() const;
+  const std::set<Channel*>& getChannels() const;
 
  private:
+  void dispatchLine(const std::string& line, size_t space);
+  void completeRegistration();
+  void denyAccess();
+  std::string& outputTarget();
+  void takePlainOutput(std::string& out);
+  WriteResult writeCompressed();
+  void startCompression();
+
   IRCServer* server;
   int clientSocket;
   bool active;
   bool isPassed;
   bool isWelcomed;
-  std::string nickname;
-  std::string username;
-  std::string hostname;
-  std::string currentChannel;
-  std::set<std::string> channels;
+  InternedString nickname;  // Identity strings are shared between clients
+  InternedString username;
+  InternedString hostname;
+  InternedString currentChannel;
+  std::string accumulatedInput;  // Bytes received but not yet run
+  std::string replyBuffer;       // Replies to our own commands, sent first
+  std::string outputBuffer;      // Other queued lines not yet written
+  std::set<Channel*> channels;
+  unsigned long fanoutMark;   // Last fan-out epoch this client was sent
+  bool link;                  // This connection is a peer server
+  ClientHandler* uplink;      // For users on other servers: their link
+  InternedString serverName;  // Peer name (link) or home server (remote user)
+  unsigned int peerAddress;   // IPv4 counted by AdmissionControl, or 0
+  bool backlogged;            // Complete lines wait for the next iteration
+  bool handlingCommand;       // Inside one of our own commands
+  bool outputMidLine;         // outputBuffer starts with a partly sent line
+  DeflateStream* deflate;     // Set once the client asked for compression
+  std::string wireOutput;     // Compressed, pre-ACK or TLS bytes not yet sent
+  bool corkFlushes;           // MSG_MORE on all but a flush's last send
+  bool hostFromLookup;        // hostname comes from reverse DNS, not USER
+  unsigned long lookupRequest;  // Reverse DNS lookup in flight, or 0
+  std::string account;        // Logged in as, or empty
+  unsigned long loginRequest;  // Password check in flight, or 0
+  bool loginBySasl;           // That check came from AUTHENTICATE, not PASS
+  bool capHeld;               // Registration waits for CAP END
+  bool saslEnabled;           // "sasl" was ACKed
+  bool saslStarted;           // AUTHENTICATE PLAIN accepted
+  std::string saslPayload;    // Base64 received so far
+#ifdef IRC_TLS
+  SSL* ssl;  // NULL for plaintext connections
+#endif
 };
 
 #endif  // CLIENT_HANDLER_HPP
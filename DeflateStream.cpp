@@ -0,0 +1,76 @@
+#include "DeflateStream.hpp"
+
+#include <iostream>
+
+// 4 KB window and 8 KB hash table (zlib's defaults are 32 KB and 64 KB).
+// An IRC line mostly repeats the lines just before it, so the small window
+// costs little ratio.
+static const int kWindowBits = 12;
+static const int kMemLevel = 5;
+
+// Text the server sends, copied from its replies, commonest last: zlib
+// finds the nearest match first and encodes nearby distances in fewer bits.
+static const char kDictionary[] =
+    "FAIL CHATHISTORY INVALID_PARAMS :Invalid 367 368 :End of channel ban"
+    " list 732 733 :End of MONITOR list 730 731 352 315 :End of WHO list 311"
+    " 318 :End of /WHOIS list 324 332 333 482 :You're not channel operator"
+    " 442 :You're not on that channel 403 :No such channel 401 :No such"
+    " nick/channel ERROR :You are not on channel 353 = :@ 366 :End of"
+    " /NAMES list. 001 :Welcome to the server, BATCH + chathistory @batch="
+    ";msgid=;time=20 KICK INVITE TOPIC MODE +o QUIT :Quit: PART NICK :"
+    ":Server NOTICE PONG Server :Server\r\n JOIN #\r\n:Server 0\r\n:"
+    " PRIVMSG #";
+
+DeflateStream::DeflateStream() : started(false) {}
+
+DeflateStream::~DeflateStream() {
+  if (started) {
+    deflateEnd(&stream);
+  }
+}
+
+bool DeflateStream::start(int level) {
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  if (deflateInit2(&stream, level, Z_DEFLATED, kWindowBits, kMemLevel,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    std::cerr << "Cannot start compression." << std::endl;
+    return false;
+  }
+  started = true;
+  const std::string& words = dictionary();
+  deflateSetDictionary(&stream,
+                       reinterpret_cast<const Bytef*>(words.data()),
+                       words.size());
+  return true;
+}
+
+void DeflateStream::compress(const std::string& in, std::string& out) {
+  if (in.empty()) {
+    return;
+  }
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  stream.avail_in = in.size();
+  size_t used = out.size();
+  do {  // The bound is nearly always enough; the loop covers the rest
+    out.resize(used + deflateBound(&stream, stream.avail_in) + 16);
+    stream.next_out = reinterpret_cast<Bytef*>(&out[used]);
+    stream.avail_out = out.size() - used;
+    deflate(&stream, Z_SYNC_FLUSH);
+    used = out.size() - stream.avail_out;
+  } while (stream.avail_out == 0);
+  out.resize(used);
+}
+
+const std::string& DeflateStream::dictionary() {
+  static const std::string words(kDictionary, sizeof(kDictionary) - 1);
+  return words;
+}
+
+// zlib's own estimate: the window twice over, plus the hash chains
+size_t DeflateStream::memoryPerStream() {
+  return (1 << (kWindowBits + 2)) + (1 << (kMemLevel + 9)) +
+         sizeof(z_stream);
+}
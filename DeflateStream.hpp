@@ -0,0 +1,33 @@
+#ifndef DEFLATESTREAM_HPP
+#define DEFLATESTREAM_HPP
+
+#include <zlib.h>
+
+#include <string>
+
+// One connection's compressed output, after a client sent
+// "CAP REQ :deflate". Output is a single zlib stream primed with dictionary()
+// (the client gets Z_NEED_DICT and sets the same bytes), and every batch
+// ends in a sync flush so the client can decode all it has received. The
+// window and hash sizes are cut down from zlib's defaults to keep a stream
+// near memoryPerStream() bytes.
+class DeflateStream {
+ public:
+  DeflateStream();
+  ~DeflateStream();
+
+  bool start(int level);
+  void compress(const std::string& in, std::string& out);  // Appends to out
+
+  static const std::string& dictionary();
+  static size_t memoryPerStream();
+
+ private:
+  DeflateStream(const DeflateStream&);
+  DeflateStream& operator=(const DeflateStream&);
+
+  z_stream stream;
+  bool started;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include "FanoutPool.hpp"
+
+#include <iostream>
+
+FanoutPool::FanoutPool()
+    : round(0), busy(0), stopping(false), count(0), task(NULL), context(NULL) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&wake, NULL);
+  pthread_cond_init(&finished, NULL);
+}
+
+FanoutPool::~FanoutPool() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&mutex);
+  for (size_t i = 0; i < workers.size(); ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  pthread_cond_destroy(&finished);
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool FanoutPool::start(size_t threads) {
+  workers.resize(threads);  // Sized once: workers keep pointers into it
+  for (size_t i = 0; i < threads; ++i) {
+    workers[i].pool = this;
+    workers[i].slice = i;
+    if (pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]) !=
+        0) {
+      std::cerr << "Failed to start fan-out threads." << std::endl;
+      workers.resize(i);
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t FanoutPool::threads() const { return workers.size(); }
+
+void* FanoutPool::workerMain(void* arg) {
+  Worker* worker = static_cast<Worker*>(arg);
+  worker->pool->workerLoop(worker->slice);
+  return NULL;
+}
+
+void FanoutPool::workerLoop(size_t slice) {
+  unsigned long seen = 0;
+  while (true) {
+    pthread_mutex_lock(&mutex);
+    while (round == seen && !stopping) {
+      pthread_cond_wait(&wake, &mutex);
+    }
+    if (stopping) {
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    seen = round;
+    pthread_mutex_unlock(&mutex);
+
+    runSlice(slice);
+
+    pthread_mutex_lock(&mutex);
+    if (--busy == 0) {
+      pthread_cond_signal(&finished);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+// Slice i of threads() + 1 equal parts; the last one is the loop thread's.
+void FanoutPool::runSlice(size_t slice) {
+  size_t parts = workers.size() + 1;
+  size_t end = count * (slice + 1) / parts;
+  for (size_t i = count * slice / parts; i < end; ++i) {
+    task(i, context);
+  }
+}
+
+void FanoutPool::run(size_t count, Task task, void* context) {
+  pthread_mutex_lock(&mutex);
+  this->count = count;
+  this->task = task;
+  this->context = context;
+  busy = workers.size();
+  ++round;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&mutex);
+
+  runSlice(workers.size());
+
+  pthread_mutex_lock(&mutex);
+  while (busy > 0) {
+    pthread_cond_wait(&finished, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,52 @@
+#ifndef FANOUTPOOL_HPP
+#define FANOUTPOOL_HPP
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <vector>
+
+// Worker threads that split one large batch of independent jobs with the
+// event loop thread (ircserv -F <threads>). run() hands each worker a
+// contiguous slice of [0, count), works the last slice itself and returns
+// once every slice is done, so the jobs may touch anything the loop is not
+// touching meanwhile. Used to write out the output of a broadcast to a huge
+// channel, one socket per job.
+class FanoutPool {
+ public:
+  typedef void (*Task)(size_t index, void* context);
+
+  FanoutPool();
+  ~FanoutPool();
+
+  bool start(size_t threads);
+  size_t threads() const;
+  void run(size_t count, Task task, void* context);
+
+ private:
+  FanoutPool(const FanoutPool&);
+  FanoutPool& operator=(const FanoutPool&);
+
+  struct Worker {
+    FanoutPool* pool;
+    size_t slice;
+    pthread_t thread;
+  };
+
+  static void* workerMain(void* arg);
+  void workerLoop(size_t slice);
+  void runSlice(size_t slice);
+
+  std::vector<Worker> workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;      // A new round started, or stopping
+  pthread_cond_t finished;  // The last worker finished its slice
+  unsigned long round;
+  size_t busy;  // Workers still on this round
+  bool stopping;
+  size_t count;
+  Task task;
+  void* context;
+};
+
+#endif
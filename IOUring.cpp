@@ -0,0 +1,204 @@
+#include "IOUring.hpp"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+IOUring::IOUring()
+    : ringFd(-1),
+      sqRing(MAP_FAILED),
+      sqRingSize(0),
+      cqRing(MAP_FAILED),
+      cqRingSize(0),
+      sqeArea(MAP_FAILED),
+      sqeAreaSize(0),
+      sqHead(NULL),
+      sqTail(NULL),
+      sqMask(NULL),
+      sqArray(NULL),
+      sqEntries(0),
+      sqLocalTail(0),
+      cqHead(NULL),
+      cqTail(NULL),
+      cqMask(NULL),
+      cqes(NULL),
+      bufferRing(MAP_FAILED),
+      bufferRingSize(0),
+      bufferPool(NULL),
+      bufferCount(0),
+      bufferSize(0),
+      bufferGroup(0),
+      bufferTail(0) {}
+
+IOUring::~IOUring() {
+  if (bufferRing != MAP_FAILED) {
+    munmap(bufferRing, bufferRingSize);
+  }
+  delete[] bufferPool;
+  if (sqeArea != MAP_FAILED) {
+    munmap(sqeArea, sqeAreaSize);
+  }
+  if (cqRing != MAP_FAILED && cqRing != sqRing) {
+    munmap(cqRing, cqRingSize);
+  }
+  if (sqRing != MAP_FAILED) {
+    munmap(sqRing, sqRingSize);
+  }
+  if (ringFd >= 0) {
+    close(ringFd);
+  }
+}
+
+// Create the ring and map the SQ/CQ rings and the SQE array.
+// Returns false if the kernel has no io_uring (or it is disabled).
+bool IOUring::init(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ringFd < 0) {
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_NODROP)) {
+    return false;
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMmap && cqRingSize > sqRingSize) {
+    sqRingSize = cqRingSize;
+  }
+  sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+  if (sqRing == MAP_FAILED) {
+    return false;
+  }
+  if (singleMmap) {
+    cqRing = sqRing;
+  } else {
+    cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) {
+      return false;
+    }
+  }
+  sqeAreaSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqeArea = mmap(NULL, sqeAreaSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+  if (sqeArea == MAP_FAILED) {
+    return false;
+  }
+
+  char* sq = static_cast<char*>(sqRing);
+  sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sqEntries = params.sq_entries;
+  sqLocalTail = *sqTail;
+
+  char* cq = static_cast<char*>(cqRing);
+  cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes = cq + params.cq_off.cqes;
+  return true;
+}
+
+// Register count buffers of size bytes as provided-buffer group groupId.
+// count must be a power of two. Needs Linux 5.19 or newer.
+bool IOUring::setupBufferRing(unsigned short groupId, unsigned count,
+                              unsigned size) {
+  bufferRingSize = count * sizeof(struct io_uring_buf);
+  bufferRing = mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufferRing == MAP_FAILED) {
+    return false;
+  }
+  memset(bufferRing, 0, bufferRingSize);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<unsigned long>(bufferRing);
+  reg.ring_entries = count;
+  reg.bgid = groupId;
+  if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0) {
+    return false;
+  }
+  bufferPool = new char[static_cast<size_t>(count) * size];
+  bufferCount = count;
+  bufferSize = size;
+  bufferGroup = groupId;
+  for (unsigned i = 0; i < count; ++i) {
+    recycleBuffer(i);
+  }
+  return true;
+}
+
+struct io_uring_sqe* IOUring::getSqe() {
+  if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+    submitAndWait(0);  // Ring full: push what we have to the kernel first
+  }
+  unsigned index = sqLocalTail & *sqMask;
+  struct io_uring_sqe* sqe =
+      static_cast<struct io_uring_sqe*>(sqeArea) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  ++sqLocalTail;
+  return sqe;
+}
+
+// Publish every prepared SQE with one io_uring_enter and wait for at least
+// waitNr completions.
+int IOUring::submitAndWait(unsigned waitNr) {
+  unsigned toSubmit = sqLocalTail - *sqTail;
+  __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+  int result = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitNr,
+                       waitNr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (result < 0 && errno != EINTR && errno != EBUSY) {
+    std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+  }
+  return result;
+}
+
+struct io_uring_cqe* IOUring::peekCqe() {
+  unsigned head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return static_cast<struct io_uring_cqe*>(cqes) + (head & *cqMask);
+}
+
+void IOUring::advanceCq() {
+  __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+char* IOUring::getBuffer(unsigned short bufferId) {
+  return bufferPool + static_cast<size_t>(bufferId) * bufferSize;
+}
+
+// Give a buffer back to the kernel once its data has been consumed.
+// The ring is addressed as a plain io_uring_buf array: the header's
+// flexible-array wrapper lays out differently under C++. The ring tail
+// overlays the resv field of the first entry.
+void IOUring::recycleBuffer(unsigned short bufferId) {
+  struct io_uring_buf* bufs = static_cast<struct io_uring_buf*>(bufferRing);
+  struct io_uring_buf* buf = &bufs[bufferTail & (bufferCount - 1)];
+  buf->addr = reinterpret_cast<unsigned long>(getBuffer(bufferId));
+  buf->len = bufferSize;
+  buf->bid = bufferId;
+  ++bufferTail;
+  __atomic_store_n(&bufs[0].resv, bufferTail, __ATOMIC_RELEASE);
+}
+
+unsigned short IOUring::getBufferGroup() const { return bufferGroup; }
+
+unsigned IOUring::getBufferSize() const { return bufferSize; }
+
+#endif  // __linux__
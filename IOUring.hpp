@@ -0,0 +1,62 @@
+#ifndef IOURING_HPP
+#define IOURING_HPP
+
+#include <cstddef>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+
+// Thin wrapper around a raw io_uring instance (no liburing): the mmapped
+// submission/completion rings plus one provided-buffer ring that multishot
+// recv picks its buffers from.
+class IOUring {
+ public:
+  IOUring();
+  ~IOUring();
+
+  bool init(unsigned entries);
+  bool setupBufferRing(unsigned short groupId, unsigned count, unsigned size);
+
+  struct io_uring_sqe* getSqe();
+  struct io_uring_cqe* peekCqe();
+  void advanceCq();
+  int submitAndWait(unsigned waitNr);
+
+  char* getBuffer(unsigned short bufferId);
+  void recycleBuffer(unsigned short bufferId);
+  unsigned short getBufferGroup() const;
+  unsigned getBufferSize() const;
+
+ private:
+  IOUring(const IOUring&);
+  IOUring& operator=(const IOUring&);
+
+  int ringFd;
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  void* sqeArea;
+  size_t sqeAreaSize;
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  unsigned sqEntries;
+  unsigned sqLocalTail;  // SQEs prepared but not yet published to the kernel
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  void* cqes;
+
+  void* bufferRing;  // struct io_uring_buf_ring shared with the kernel
+  size_t bufferRingSize;
+  char* bufferPool;
+  unsigned bufferCount;
+  unsigned bufferSize;
+  unsigned short bufferGroup;
+  unsigned short bufferTail;
+};
+
+#endif  // __linux__
+#endif
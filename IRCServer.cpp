@@ -1,5 +1,7 @@
 #include "IRCServer.hpp"
 
+#include <algorithm>
+
 #include "Channel.hpp"
 #include "ClientHandler.hpp"
 struct termios IRCServer::orig_termios;
@@ -42,14 +44,38 @@ void IRCServer::sendMessageToUser(const std::string& senderNickname,
 }
 
 IRCServer::IRCServer(const int port, const std::string password)
-    : port(port), password(password), serverSocket(-1) {
+    : port(port),
+      password(password),
+      serverSocket(-1),
+      tlsPort(0),
+      tlsSocket(-1),
+      useIoUring(false),
+      uring(NULL),
+      fanoutEpoch(0),
+      stateStore(NULL),
+      capture(NULL),
+      messageLog(NULL),
+      history(1000, 64 * 1024 * 1024),
+      userIndex(this),
+      links(this),
+      monitors(this),
+      modules(this),
+      loginFd(-1),
+      lookupFd(-1) {
+#ifdef IRC_TLS
+  tlsContext = NULL;
+#endif
   tcgetattr(STDIN_FILENO, &orig_termios);  // Save terminal settings
   signal(SIGTSTP, handleSigtstp);
   signal(SIGCONT, handleSigcont);
+  signal(SIGPIPE, SIG_IGN);  // A dead peer must not kill the server on send
 }
 
 IRCServer::~IRCServer() {
   close(serverSocket);  // Close the server socket
+  if (tlsSocket >= 0) {
+    close(tlsSocket);
+  }
   // Clean up client handlers
   for (std::map<int, ClientHandler*>::iterator it = clientHandlers.begin();
        it != clientHandlers.end(); ++it) {
@@ -60,22 +86,77 @@ IRCServer::~IRCServer() {
        it != channels.end(); ++it) {
     delete it->second;
   }
+  delete stateStore;  // Waits for the journal writer to finish
+  delete capture;     // Writes out the last records
+  delete messageLog;  // Syncs the last records
+#ifdef IRC_TLS
+  // Handlers own their SSL objects, so the context goes last
+  if (tlsContext) {
+    SSL_CTX_free(tlsContext);
+  }
+#endif
 }
 
-bool IRCServer::initializeServerSocket() {
+// Set up the TLS context for a second listener on tlsPort.
+// Session resumption (cache + tickets) lets reconnecting clients skip the
+// full handshake, and kernel TLS is requested so records are encrypted by
+// the kernel when the tls module is available.
+bool IRCServer::enableTls(int tlsPort, const std::string& certFile,
+                          const std::string& keyFile) {
+#ifdef IRC_TLS
+  tlsContext = SSL_CTX_new(TLS_server_method());
+  if (tlsContext == NULL) {
+    std::cerr << "Failed to create TLS context." << std::endl;
+    return false;
+  }
+  SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+  if (SSL_CTX_use_certificate_chain_file(tlsContext, certFile.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(tlsContext, keyFile.c_str(),
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(tlsContext) != 1) {
+    std::cerr << "Failed to load TLS certificate or key." << std::endl;
+    return false;
+  }
+  SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(
+      tlsContext, reinterpret_cast<const unsigned char*>("ircserv"), 7);
+  // Writes behave like send(): partial, and retried from wherever the
+  // unsent bytes have moved to
+  SSL_CTX_set_mode(tlsContext, SSL_MODE_RELEASE_BUFFERS |
+                                   SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                   SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS);
+#endif
+  this->tlsPort = tlsPort;
+  return true;
+#else
+  (void)tlsPort;
+  (void)certFile;
+  (void)keyFile;
+  std::cerr << "TLS support not built in (rebuild with make TLS=1)."
+            << std::endl;
+  return false;
+#endif
+}
+
+// Create a listening socket on listenPort and add it to the poll set.
+// Returns the socket, or -1 on failure.
+int IRCServer::openListener(int listenPort) {
   // Create a socket (like setting up a mailbox for communication)
   // AF_INET: Using IPv4; SOCK_STREAM: TCP socket (reliable connection)
-  serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-  if (serverSocket < 0) {
+  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenSocket < 0) {
     std::cerr << "Failed to create socket." << std::endl;
-    return false;
+    return -1;
   }
 
   // Set the socket options: Allow reusing the address (like quickly reusing a parking spot)
   int opt = 1;
-  if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+  if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
     std::cerr << "Error setting socket options." << std::endl;
-    return false;
+    close(listenSocket);
+    return -1;
   }
 
   // Set up the server address (like setting up the reception desk in an office)
@@ -83,83 +164,492 @@ bool IRCServer::initializeServerSocket() {
   memset(&serverAddr, 0, sizeof(serverAddr));  // Set memory to 0
   serverAddr.sin_family = AF_INET;  // Use IPv4 addresses
   serverAddr.sin_addr.s_addr = INADDR_ANY;  // Listen on all interfaces
-  serverAddr.sin_port = htons(port);  // Set the port number
+  serverAddr.sin_port = htons(listenPort);  // Set the port number
 
   // Bind the socket to the address (like assigning an address to the mailbox)
-  if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-    std::cerr << "Failed to bind to port " << port << "." << std::endl;
-    return false;
+  if (bind(listenSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+    std::cerr << "Failed to bind to port " << listenPort << "." << std::endl;
+    close(listenSocket);
+    return -1;
+  }
+
+  std::map<int, SocketProfile>::const_iterator profile =
+      socketProfiles.find(listenPort);
+  if (profile != socketProfiles.end()) {
+    profile->second.applyToListener(listenSocket);
   }
 
   // Listen: Wait for connections (like a post office waiting for mail)
-  if (listen(serverSocket, 10) < 0) {  // Listen for up to 10 connections
+  // A full backlog drops SYNs, so let the kernel queue as many as it allows;
+  // the listener is non-blocking so acceptNewClient can drain it.
+  if (listen(listenSocket, SOMAXCONN) < 0 ||
+      fcntl(listenSocket, F_SETFL, O_NONBLOCK) < 0) {
     std::cerr << "Failed to listen on socket." << std::endl;
-    return false;
+    close(listenSocket);
+    return -1;
   }
 
   // Add the socket to the list of file descriptors to monitor
   struct pollfd listenFD;
-  listenFD.fd = serverSocket;  // Set the file descriptor to the server socket
+  listenFD.fd = listenSocket;  // Set the file descriptor to the listener
   listenFD.events = POLLIN;  // Monitor for incoming data
   fds.push_back(listenFD);  // Add it to the list of descriptors
+  return listenSocket;
+}
+
+bool IRCServer::initializeServerSocket() {
+  serverSocket = openListener(port);
+  if (serverSocket < 0) {
+    return false;
+  }
+  if (tlsPort > 0) {
+    tlsSocket = openListener(tlsPort);
+    if (tlsSocket < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IRCServer::setEventBackend(const std::string& name) {
+  if (name == "poll") {
+    useIoUring = false;
+  } else if (name == "io_uring") {
+    useIoUring = true;
+  } else {
+    return false;
+  }
   return true;
 }
 
+bool IRCServer::enableFanoutThreads(size_t threads) {
+  return fanout.start(threads);
+}
+
+// Record every connection's input to path for ircreplay.
+bool IRCServer::enableCapture(const std::string& path) {
+  capture = new TrafficCapture;
+  return capture->open(path);
+}
+
+// Archive routed messages and membership changes in directory.
+bool IRCServer::enableMessageLog(const std::string& directory,
+                                 size_t fileBytes) {
+  messageLog = new MessageLog(directory, fileBytes);
+  return messageLog->start();
+}
+
+bool IRCServer::enableContentFilter(const std::string& path) {
+  return contentFilter.load(path);
+}
+
+void IRCServer::setSocketProfile(int listenPort,
+                                 const SocketProfile& profile) {
+  socketProfiles[listenPort] = profile;
+}
+
+// Resolve each client's address through the DNS server at server.
+bool IRCServer::enableResolver(const std::string& server) {
+  if (!resolver.start(server)) {
+    return false;
+  }
+  lookupFd = resolver.getNotifyFd();
+  return true;
+}
+
+// Load the accounts in path and start the threads that check passwords.
+bool IRCServer::enableAccounts(const std::string& path, size_t threads) {
+  if (!accounts.load(path) || !accounts.start(threads)) {
+    return false;
+  }
+  loginFd = accounts.getNotifyFd();
+  return true;
+}
+
+// Restore channels from the snapshot and journal in directory, then keep
+// recording every channel change there.
+bool IRCServer::enableStateStore(const std::string& directory) {
+  struct timeval started;
+  gettimeofday(&started, NULL);
+  stateStore = new StateStore(directory);
+  std::vector<std::string> records;
+  if (!stateStore->load(records)) {
+    return false;
+  }
+  for (size_t i = 0; i < records.size(); ++i) {
+    std::string name;
+    if (!Channel::decodeName(records[i], name)) {
+      continue;
+    }
+    // Snapshot records come in name order, so the end hint makes each
+    // insert constant time
+    Channel*& channel =
+        channels.insert(channels.end(), std::make_pair(name, (Channel*)NULL))
+            ->second;
+    if (channel == NULL) {
+      channel = new Channel(name, stateStore, &modules);
+    }
+    channel->restoreState(records[i]);
+  }
+  struct timeval finished;
+  gettimeofday(&finished, NULL);
+  std::cout << "Restored " << channels.size() << " channels from "
+            << records.size() << " records in "
+            << (finished.tv_sec - started.tv_sec) * 1000 +
+                   (finished.tv_usec - started.tv_usec) / 1000
+            << " ms" << std::endl;
+  if (!stateStore->start()) {
+    return false;
+  }
+  if (records.size() > channels.size()) {
+    compactState();  // Fold the replayed journal into a fresh snapshot
+  }
+  return true;
+}
+
+void IRCServer::compactState() {
+  std::vector<std::string> payloads;
+  payloads.reserve(channels.size());
+  for (std::map<std::string, Channel*>::iterator it = channels.begin();
+       it != channels.end(); ++it) {
+    payloads.push_back(std::string());
+    it->second->encodeState(payloads.back());
+  }
+  stateStore->compact(payloads);
+}
+
 void IRCServer::run() {
   if (!initializeServerSocket()) {  // Set up the server socket
     std::cerr << "Server initialization failed." << std::endl;
     return;
   }
   std::cout << "Server running on port " << port << std::endl;
+  if (tlsPort > 0) {
+    std::cout << "TLS listening on port " << tlsPort << std::endl;
+  }
+  links.connectPeers();
+  int notifyFds[2] = {loginFd, lookupFd};
+  for (int i = 0; i < 2; ++i) {
+    if (notifyFds[i] >= 0) {
+      struct pollfd notifyFD;
+      notifyFD.fd = notifyFds[i];
+      notifyFD.events = POLLIN;
+      notifyFD.revents = 0;
+      fds.push_back(notifyFD);
+    }
+  }
+
+  if (useIoUring) {
+    if (runIoUring()) {
+      return;
+    }
+    std::cerr << "io_uring not available, falling back to poll." << std::endl;
+    useIoUring = false;
+  }
+  runPoll();
+}
 
+void IRCServer::runPoll() {
   while (true) {
     // Poll: Check for events on file descriptors (like a store clerk checking if customers need help)
-    int pollCount = poll(&fds[0], fds.size(), -1);
+    // Don't sleep while a WHO reply still has chunks to send, clients
+    // have lines left over from the last iteration, or output was queued
+    // outside the loop (the SERVER line to a dialled peer)
+    bool busy = userIndex.hasRunnableQueries() || !inputBacklog.empty() ||
+                !flushQueue.empty();
+    int pollCount = poll(&fds[0], fds.size(), busy ? 0 : -1);
     if (pollCount < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
       std::cerr << "Poll error." << std::endl;
       break;
     }
+    runInputBacklog();  // Leftovers first, in the order they were deferred
 
     // Go through each file descriptor and check for incoming data
     for (size_t i = 0; i < fds.size(); i++) {
-      if (fds[i].revents & POLLIN) {  // If there is incoming data
-        if (fds[i].fd == serverSocket) {  // If the server socket is receiving a new connection
-          acceptNewClient();
-        } else {  // If an existing client is sending data
-          ClientHandler* handler = clientHandlers[fds[i].fd];  // Find the handler for that client
-          if (handler) {  // If the handler is found, process the input
-            handler->processInput();
-          }
+      if (fds[i].fd == serverSocket || fds[i].fd == tlsSocket) {  // If a listener is receiving a new connection
+        if (fds[i].revents & POLLIN) {
+          acceptNewClient(fds[i].fd);
         }
+        continue;
+      }
+      if (fds[i].fd == loginFd) {  // Password checks finished
+        if (fds[i].revents & POLLIN) {
+          finishLogins();
+        }
+        continue;
+      }
+      if (fds[i].fd == lookupFd) {  // Hostname lookups finished
+        if (fds[i].revents & POLLIN) {
+          finishHostLookups();
+        }
+        continue;
+      }
+      std::map<int, ClientHandler*>::iterator it = clientHandlers.find(fds[i].fd);  // Find the handler for that client
+      if (it == clientHandlers.end()) {
+        continue;
+      }
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {  // If there is incoming data (or the peer is gone)
+        it->second->processInput();
+      }
+      if ((fds[i].revents & POLLOUT) && it->second->flushOutput()) {  // The socket drained what was left over
+        fds[i].events &= ~POLLOUT;
       }
     }
+    userIndex.runQueries();  // Next chunk of any large WHO reply
+    flushPendingOutput();  // Write everything queued during this round
     cleanUpInactiveHandlers();  // Clean up any inactive client handlers
+    if (capture) {
+      capture->flush();
+    }
+    if (messageLog) {
+      messageLog->flush();
+    }
+    if (stateStore && stateStore->needsCompaction()) {
+      compactState();
+    }
   }
 }
 
-// Accept a new client
-void IRCServer::acceptNewClient() {
-  struct sockaddr_in clientAddr;  // Store client address
-  socklen_t clientAddrLen = sizeof(clientAddr);
+// Accept new clients: everything queued, up to kAcceptBatch per wakeup so a
+// connect flood cannot starve the connected clients.
+void IRCServer::acceptNewClient(int listenSocket) {
+  static const int kAcceptBatch = 256;
+  for (int accepted = 0; accepted < kAcceptBatch; ++accepted) {
+    struct sockaddr_in clientAddr;  // Store client address
+    socklen_t clientAddrLen = sizeof(clientAddr);
 
-  // Accept a new client connection
-  int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
-  if (clientSocket < 0) {  // If accepting the connection fails
-    std::cerr << "Error accepting new connection." << std::endl;
-    return;
+    // Accept a new client connection
+    int clientSocket =
+        accept(listenSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
+    if (clientSocket < 0) {  // Queue drained, or accepting failed
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+        std::cerr << "Error accepting new connection." << std::endl;
+      }
+      return;
+    }
+    if (registerClient(clientSocket, listenSocket) == NULL) {
+      continue;
+    }
+
+    // Set up pollfd to monitor this client's socket for incoming data
+    struct pollfd clientFD;
+    clientFD.fd = clientSocket;  // Set the client's file descriptor
+    clientFD.events = POLLIN;  // Monitor for incoming data
+    clientFD.revents = 0;
+    fds.push_back(clientFD);  // Add this client to the list of descriptors to monitor
   }
+}
+
+// Adopt a socket we connected ourselves (server links). Connections made
+// before the loop starts are armed by runIoUring.
+ClientHandler* IRCServer::addConnection(int clientSocket) {
+  ClientHandler* handler = registerClient(clientSocket, -1);
+  struct pollfd clientFD;
+  clientFD.fd = clientSocket;
+  clientFD.events = POLLIN;
+  clientFD.revents = 0;
+  fds.push_back(clientFD);
+  return handler;
+}
 
+// Create the handler for an accepted socket. Shared by both event backends.
+// Accepted sockets (listenSocket >= 0) first go through admission control;
+// a rejected one is closed here, before anything is allocated for it.
+ClientHandler* IRCServer::registerClient(int clientSocket, int listenSocket) {
+  unsigned int address = 0;
+  if (listenSocket >= 0) {
+    struct sockaddr_in peer;
+    socklen_t peerLength = sizeof(peer);
+    if (getpeername(clientSocket, (struct sockaddr*)&peer, &peerLength) < 0) {
+      close(clientSocket);  // Reset before we got to it
+      return NULL;
+    }
+    if (peer.sin_family == AF_INET) {
+      address = ntohl(peer.sin_addr.s_addr);
+    }
+    if (address != 0 && !admission.admit(address)) {
+      static const char kRejected[] = "ERROR :Too many connections\r\n";
+      send(clientSocket, kRejected, sizeof(kRejected) - 1,
+           MSG_DONTWAIT | MSG_NOSIGNAL);
+      close(clientSocket);
+      return NULL;
+    }
+  }
   // Create a new handler for the client
   ClientHandler* newHandler = new ClientHandler(clientSocket, this);
+  newHandler->setPeerAddress(address);
+  std::map<int, SocketProfile>::const_iterator profile =
+      socketProfiles.find(listenSocket == tlsSocket ? tlsPort : port);
+  if (listenSocket >= 0 && profile != socketProfiles.end()) {
+    profile->second.applyToClient(clientSocket);
+    newHandler->setCorkFlushes(profile->second.corks());
+  }
+  if (lookupFd >= 0 && address != 0) {
+    lookUpHost(newHandler, address);
+  }
+  if (capture && listenSocket >= 0) {
+    capture->recordOpen(newHandler);
+  }
+#ifdef IRC_TLS
+  if (listenSocket >= 0 && listenSocket == tlsSocket) {
+    // The handshake is driven from the event loop, so the socket must not block
+    SSL* ssl = SSL_new(tlsContext);
+    if (ssl == NULL || fcntl(clientSocket, F_SETFL, O_NONBLOCK) < 0) {
+      std::cerr << "Error setting up TLS for new connection." << std::endl;
+      SSL_free(ssl);
+      admission.release(address);
+      delete newHandler;
+      return NULL;
+    }
+    SSL_set_fd(ssl, clientSocket);
+    SSL_set_accept_state(ssl);
+    newHandler->attachTls(ssl);
+  }
+#else
+  (void)listenSocket;
+#endif
   clientHandlers[clientSocket] = newHandler;
+  std::cout << "New client connected: " << clientSocket << std::endl;
+  return newHandler;
+}
 
-  // Set up pollfd to monitor this client's socket for incoming data
-  struct pollfd clientFD;
-  clientFD.fd = clientSocket;  // Set the client's file descriptor
-  clientFD.events = POLLIN;  // Monitor for incoming data
-  fds.push_back(clientFD);  // Add this client to the list of descriptors to monitor
+void IRCServer::queueFlush(ClientHandler* handler) {
+  flushQueue.push_back(handler);
+}
 
-  std::cout << "New client connected: " << clientSocket << std::endl;
+// Clients with output in one iteration before -F threads help write it
+static const size_t kParallelFlush = 1024;
+
+struct ParallelFlush {
+  const std::vector<ClientHandler*>* handlers;
+  std::vector<char>* results;
+};
+
+static void writeQueuedOutput(size_t index, void* context) {
+  ParallelFlush* flush = static_cast<ParallelFlush*>(context);
+  ClientHandler* handler = (*flush->handlers)[index];
+  ClientHandler::WriteResult result = ClientHandler::kWriteSkipped;
+  if (!handler->isTls()) {
+    result = handler->writeOutput();
+  }
+  (*flush->results)[index] = static_cast<char>(result);
+}
+
+// A broadcast to a huge channel leaves one socket write per member. The
+// writes are independent, so the fan-out threads and this thread split
+// them; anything needing the rest of the server (POLLOUT, disconnects, TLS)
+// is done here afterwards. Returns how many queue entries were handled.
+size_t IRCServer::flushInParallel() {
+  // A client drained by POLLOUT earlier in this iteration and refilled
+  // since is queued twice; each must reach exactly one thread
+  std::sort(flushQueue.begin(), flushQueue.end());
+  flushQueue.erase(std::unique(flushQueue.begin(), flushQueue.end()),
+                   flushQueue.end());
+  size_t count = flushQueue.size();
+  std::vector<char> results(count);
+  ParallelFlush flush;
+  flush.handlers = &flushQueue;
+  flush.results = &results;
+  fanout.run(count, writeQueuedOutput, &flush);
+  for (size_t i = 0; i < count; ++i) {
+    ClientHandler* handler = flushQueue[i];  // failWrite() may grow the queue
+    if (results[i] == ClientHandler::kWriteSkipped) {
+      if (!handler->flushOutput()) {
+        setPollEvents(handler->getSocket(), POLLOUT, true);
+      }
+    } else if (results[i] == ClientHandler::kWriteBlocked) {
+      setPollEvents(handler->getSocket(), POLLOUT, true);
+    } else if (results[i] == ClientHandler::kWriteFailed) {
+      handler->failWrite();
+    }
+  }
+  return count;
+}
+
+// Write out every handler that queued output during this loop iteration.
+// Handlers may queue more (e.g. a QUIT after a write error) while we go.
+void IRCServer::flushPendingOutput() {
+  size_t i = 0;
+  if (!useIoUring && fanout.threads() > 0 &&
+      flushQueue.size() >= kParallelFlush) {
+    i = flushInParallel();
+  }
+  for (; i < flushQueue.size(); ++i) {
+    ClientHandler* handler = flushQueue[i];
+    if (useIoUring) {
+      submitIoUringSend(handler);
+      continue;
+    }
+    if (handler->flushOutput()) {
+      continue;
+    }
+    setPollEvents(handler->getSocket(), POLLOUT, true);  // Socket is full: wait for POLLOUT
+  }
+  flushQueue.clear();
+}
+
+void IRCServer::setPollEvents(int fd, short events, bool enable) {
+  for (size_t i = 0; i < fds.size(); ++i) {
+    if (fds[i].fd == fd) {
+      if (enable) {
+        fds[i].events |= events;
+      } else {
+        fds[i].events &= ~events;
+      }
+      return;
+    }
+  }
+}
+
+// Stop or restart reading a client. Poll drops POLLIN; io_uring cancels
+// the multishot recv and arms a new one once the old one has finished.
+void IRCServer::pauseInput(ClientHandler* handler, bool paused) {
+  int fd = handler->getSocket();
+  if (!useIoUring) {
+    setPollEvents(fd, POLLIN, !paused);
+    return;
+  }
+#ifdef __linux__
+  unsigned long long key = ioUringKey(fd);
+  bool armed = armedRecvs.count(key) > 0;
+  if (paused && armed) {
+    struct io_uring_sqe* sqe = uring->getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ((handler->isTls() ? kIoUringPoll : kIoUringRecv) << 56) | key;
+    sqe->user_data = (kIoUringCancel << 56) | key;
+    uring->submitAndWait(0);  // Now, not after this batch of completions
+  } else if (!paused && !armed) {
+    armIoUringRecv(handler, fd);
+  }
+#endif
+}
+
+// A client ran out of its per-iteration line budget with lines to spare.
+// It is not read again until the backlog is worked off, so the kernel's
+// buffer (and TCP flow control) holds the rest.
+void IRCServer::deferInput(ClientHandler* handler) {
+  inputBacklog.push_back(handler);
+  pauseInput(handler, true);
+}
+
+// Give every deferred client one more budget, round-robin.
+void IRCServer::runInputBacklog() {
+  std::vector<ClientHandler*> turn;
+  turn.swap(inputBacklog);
+  for (size_t i = 0; i < turn.size(); ++i) {
+    ClientHandler* handler = turn[i];
+    if (!handler->isActive()) {
+      continue;
+    }
+    handler->resumeInput();
+    if (handler->isActive() && !handler->isBacklogged()) {
+      pauseInput(handler, false);
+    }
+  }
 }
 
 void IRCServer::cleanUpInactiveHandlers() {
@@ -167,8 +657,25 @@ void IRCServer::cleanUpInactiveHandlers() {
   while (it != clientHandlers.end()) {
     if (!it->second->isActive()) {  // If the handler is no longer active
       std::cout << "Cleaning up client handler for socket: " << it->first << std::endl;
-      close(it->first);  // Close the socket
-      delete it->second;  // Delete the handler
+      if (useIoUring) {
+        shutdown(it->first, SHUT_RDWR);  // Ends the armed multishot recv
+      }
+      for (size_t i = 0; i < fds.size(); ++i) {  // Stop polling the socket
+        if (fds[i].fd == it->first) {
+          fds.erase(fds.begin() + i);
+          break;
+        }
+      }
+      inputBacklog.erase(
+          std::remove(inputBacklog.begin(), inputBacklog.end(), it->second),
+          inputBacklog.end());
+      if (it->second->getPeerAddress() != 0) {
+        admission.release(it->second->getPeerAddress());
+      }
+      if (capture) {
+        capture->recordClose(it->second);
+      }
+      delete it->second;  // Delete the handler (closes the socket)
       std::map<int, ClientHandler*>::iterator temp = it;  // Use a temporary iterator
       ++it;  // Move to the next item
       clientHandlers.erase(temp);  // Remove the handler from the map
@@ -178,24 +685,351 @@ void IRCServer::cleanUpInactiveHandlers() {
   }
 }
 
+#ifdef __linux__
+// Provided buffer rings arrived in 5.19 but multishot recv only in 6.0,
+// where 5.19 fails every such recv with -EINVAL. Try one on a socketpair
+// before any client depends on it.
+static bool supportsMultishotRecv(IOUring& ring) {
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+    return false;
+  }
+  if (write(pair[1], "x", 1) != 1) {
+    close(pair[0]);
+    close(pair[1]);
+    return false;
+  }
+  struct io_uring_sqe* sqe = ring.getSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = pair[0];
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = ring.getBufferGroup();
+  sqe->user_data = 0;
+  bool supported = false;
+  bool more = ring.submitAndWait(1) >= 0;
+  while (more) {
+    struct io_uring_cqe* cqe = ring.peekCqe();
+    if (cqe == NULL) {
+      if (ring.submitAndWait(1) < 0 && errno != EINTR) {
+        break;
+      }
+      continue;
+    }
+    if (cqe->res > 0) {
+      supported = true;
+      shutdown(pair[0], SHUT_RDWR);  // Ends the multishot recv
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      ring.recycleBuffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    more = cqe->flags & IORING_CQE_F_MORE;
+    ring.advanceCq();
+  }
+  close(pair[0]);
+  close(pair[1]);
+  return supported;
+}
+
+// The io_uring backend. Listeners use multishot accept, plaintext clients
+// use multishot recv into the provided buffer ring (data arrives without a
+// read() per message), TLS clients use multishot poll and read through
+// OpenSSL, and all sends queued during one iteration go out with the same
+// io_uring_enter that waits for the next completions.
+// Returns false if the kernel lacks the required io_uring features
+// (provided buffer rings and multishot recv, Linux 6.0).
+bool IRCServer::runIoUring() {
+  IOUring ring;
+  if (!ring.init(4096) || !ring.setupBufferRing(1, 1024, 4096) ||
+      !supportsMultishotRecv(ring)) {
+    return false;
+  }
+  uring = &ring;
+  std::cout << "Using io_uring event backend." << std::endl;
+  armIoUringAccept(serverSocket);
+  if (tlsSocket >= 0) {
+    armIoUringAccept(tlsSocket);
+  }
+  if (loginFd >= 0) {
+    armIoUringNotify(loginFd, kIoUringLogins);
+  }
+  if (lookupFd >= 0) {
+    armIoUringNotify(lookupFd, kIoUringLookups);
+  }
+  for (std::map<int, ClientHandler*>::iterator it = clientHandlers.begin();
+       it != clientHandlers.end(); ++it) {
+    armIoUringRecv(it->second, it->first);  // Outgoing server links
+  }
+
+  while (true) {
+    bool busy = userIndex.hasRunnableQueries() || !inputBacklog.empty() ||
+                !flushQueue.empty();
+    if (ring.submitAndWait(busy ? 0 : 1) < 0 && errno != EINTR &&
+        errno != EBUSY) {
+      break;
+    }
+    runInputBacklog();
+    struct io_uring_cqe* cqe;
+    while ((cqe = ring.peekCqe()) != NULL) {
+      struct io_uring_cqe completion = *cqe;
+      ring.advanceCq();
+      handleIoUringCompletion(completion);
+    }
+    userIndex.runQueries();
+    flushPendingOutput();  // Queue one SEND per client with pending output
+    cleanUpInactiveHandlers();
+    if (capture) {
+      capture->flush();
+    }
+    if (messageLog) {
+      messageLog->flush();
+    }
+    if (stateStore && stateStore->needsCompaction()) {
+      compactState();
+    }
+  }
+  uring = NULL;
+  return true;
+}
+
+// user_data layout: top 8 bits operation, next 24 bits connection
+// generation, low 32 bits socket. The generation keeps completions for a
+// closed socket from being applied to a new client reusing the number.
+unsigned long long IRCServer::ioUringKey(int fd) {
+  unsigned long long generation = fdGenerations[fd] & 0xFFFFFF;
+  return (generation << 32) | static_cast<unsigned int>(fd);
+}
+
+ClientHandler* IRCServer::findIoUringClient(unsigned long long key) {
+  int fd = static_cast<int>(key & 0xFFFFFFFF);
+  std::map<int, ClientHandler*>::iterator it = clientHandlers.find(fd);
+  if (it == clientHandlers.end() || ioUringKey(fd) != key) {
+    return NULL;
+  }
+  return it->second;
+}
+
+void IRCServer::armIoUringAccept(int listenSocket) {
+  struct io_uring_sqe* sqe = uring->getSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenSocket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data =
+      (kIoUringAccept << 56) | static_cast<unsigned int>(listenSocket);
+}
+
+// A wakeup pipe from a worker thread (logins, lookups).
+void IRCServer::armIoUringNotify(int fd, unsigned long long operation) {
+  struct io_uring_sqe* sqe = uring->getSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = operation << 56;
+}
+
+void IRCServer::armIoUringRecv(ClientHandler* handler, int fd) {
+  armedRecvs.insert(ioUringKey(fd));
+  struct io_uring_sqe* sqe = uring->getSqe();
+  sqe->fd = fd;
+  if (handler->isTls()) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (kIoUringPoll << 56) | ioUringKey(fd);
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uring->getBufferGroup();
+    sqe->user_data = (kIoUringRecv << 56) | ioUringKey(fd);
+  }
+}
+
+// Only one SEND per client is in flight, so bytes cannot be reordered; the
+// buffer is owned by ioUringSends until the completion arrives, even if the
+// client is gone by then.
+void IRCServer::submitIoUringSend(ClientHandler* handler) {
+  int fd = handler->getSocket();
+  unsigned long long key = ioUringKey(fd);
+  if (handler->isTls()) {
+    // OpenSSL writes the socket itself; when it is full, a one-shot poll
+    // says when to try again
+    if (!handler->flushOutput() && armedWritable.insert(key).second) {
+      struct io_uring_sqe* sqe = uring->getSqe();
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = POLLOUT;
+      sqe->user_data = (kIoUringWritable << 56) | key;
+    }
+    return;
+  }
+  if (ioUringSends.count(key) || !handler->hasPendingOutput()) {
+    return;
+  }
+  if (!handler->isActive()) {
+    // The socket is shut down before this SQE would be submitted
+    handler->flushOutput();
+    return;
+  }
+  std::string& buffer = ioUringSends[key];
+  handler->takePendingOutput(buffer);
+  struct io_uring_sqe* sqe = uring->getSqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<unsigned long>(buffer.data());
+  sqe->len = buffer.size();
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (kIoUringSend << 56) | key;
+}
+
+void IRCServer::handleIoUringCompletion(const struct io_uring_cqe& cqe) {
+  unsigned long long operation = cqe.user_data >> 56;
+  unsigned long long key = cqe.user_data & ((1ULL << 56) - 1);
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  if (operation == kIoUringCancel) {
+    return;  // The cancelled recv reports on its own
+  }
+  if (operation == kIoUringWritable) {
+    armedWritable.erase(key);
+    ClientHandler* handler = findIoUringClient(key);
+    if (handler && handler->hasPendingOutput()) {
+      queueFlush(handler);
+    }
+    return;
+  }
+  if (operation == kIoUringLogins || operation == kIoUringLookups) {
+    if (operation == kIoUringLogins) {
+      finishLogins();
+    } else {
+      finishHostLookups();
+    }
+    if (!more) {
+      armIoUringNotify(operation == kIoUringLogins ? loginFd : lookupFd,
+                       operation);
+    }
+    return;
+  }
+  if (operation == kIoUringAccept) {
+    int listenSocket = static_cast<int>(key);
+    if (cqe.res >= 0) {
+      ++fdGenerations[cqe.res];
+      ClientHandler* handler = registerClient(cqe.res, listenSocket);
+      if (handler) {
+        armIoUringRecv(handler, cqe.res);
+      }
+    } else {
+      std::cerr << "Error accepting new connection." << std::endl;
+    }
+    if (!more) {
+      armIoUringAccept(listenSocket);
+    }
+    return;
+  }
+
+  if (operation == kIoUringSend) {
+    std::map<unsigned long long, std::string>::iterator sent =
+        ioUringSends.find(key);
+    ClientHandler* handler = findIoUringClient(key);
+    if (handler && cqe.res < 0) {
+      std::cerr << "Failed to send message." << std::endl;
+      handler->handleDisconnect("Write error");
+    } else if (handler && sent != ioUringSends.end() &&
+               static_cast<size_t>(cqe.res) < sent->second.size()) {
+      handler->restorePendingOutput(sent->second.substr(cqe.res));
+    }
+    if (sent != ioUringSends.end()) {
+      ioUringSends.erase(sent);
+    }
+    if (handler && handler->hasPendingOutput()) {
+      queueFlush(handler);
+    }
+    return;
+  }
+
+  ClientHandler* handler = findIoUringClient(key);
+  if (operation == kIoUringPoll) {
+    if (handler && cqe.res > 0) {
+      handler->processInput();
+    }
+  } else if (operation == kIoUringRecv) {
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      unsigned short bufferId = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if (handler && cqe.res > 0) {
+        handler->consumeInput(uring->getBuffer(bufferId), cqe.res);
+      }
+      uring->recycleBuffer(bufferId);
+    }
+    if (handler && cqe.res == 0) {
+      std::cout << "Client disconnected." << std::endl;
+      handler->handleDisconnect("Connection closed");
+    } else if (handler && cqe.res < 0 && cqe.res != -ENOBUFS &&
+               cqe.res != -ECANCELED) {  // Not paused by pauseInput
+      std::cerr << "Read error." << std::endl;
+      handler->handleDisconnect("Read error");
+    }
+  }
+  if (!more) {
+    armedRecvs.erase(key);
+    if (handler && handler->isActive() && !handler->isBacklogged()) {
+      armIoUringRecv(handler, static_cast<int>(key & 0xFFFFFFFF));
+    }
+  }
+}
+#else
+bool IRCServer::runIoUring() { return false; }
+
+void IRCServer::submitIoUringSend(ClientHandler* handler) {
+  handler->flushOutput();
+}
+#endif
+
 bool IRCServer::isNicknameAvailable(const std::string& nickname) {
-  return activeNicknames.find(nickname) == activeNicknames.end();
+  InternedString key;
+  if (!InternedString::find(nickname, key)) {
+    return true;
+  }
+  return activeNicknames.find(key) == activeNicknames.end();
 }
 
 void IRCServer::registerNickname(const std::string& nickname,
                                  ClientHandler* handler) {
-  activeNicknames[nickname] = handler;
+  ClientHandler*& owner = activeNicknames[nickname];
+  bool changed = owner != handler;
+  owner = handler;
+  if (changed && handler->isRegistered()) {
+    monitors.userOnline(handler, nickname);
+  }
 }
 
 void IRCServer::unregisterNickname(const std::string& nickname) {
-  activeNicknames.erase(nickname);
+  InternedString key;
+  if (!InternedString::find(nickname, key)) {
+    return;
+  }
+  std::map<InternedString, ClientHandler*>::iterator it =
+      activeNicknames.find(key);
+  if (it == activeNicknames.end()) {
+    return;
+  }
+  // A disconnected user's watchers were told when it quit
+  bool online = it->second->isRegistered() && it->second->isActive();
+  activeNicknames.erase(it);
+  if (online) {
+    monitors.userOffline(nickname);
+  }
 }
 
 ClientHandler* IRCServer::findClientHandlerByNickname(
     const std::string& nickname) {
   // Find the handler for the given nickname
-  std::map<std::string, ClientHandler*>::iterator it =
-      activeNicknames.find(nickname);
+  InternedString key;
+  if (!InternedString::find(nickname, key)) {
+    return NULL;
+  }
+  std::map<InternedString, ClientHandler*>::iterator it =
+      activeNicknames.find(key);
 
   // If the handler exists, return it
   if (it != activeNicknames.end()) {
@@ -209,7 +1043,8 @@ ClientHandler* IRCServer::findClientHandlerByNickname(
 void IRCServer::createChannel(const std::string& name) {
   // If the channel doesn't exist, create a new one
   if (channels.find(name) == channels.end()) {
-    channels[name] = new Channel(name);
+    channels[name] = new Channel(name, stateStore, &modules);
+    channels[name]->saveState();
   }
 }
 
@@ -220,6 +1055,141 @@ Channel* IRCServer::findChannel(const std::string& name) {
   return it != channels.end() ? it->second : NULL;
 }
 
+const std::map<std::string, Channel*>& IRCServer::getChannels() const {
+  return channels;
+}
+
+const std::map<InternedString, ClientHandler*>& IRCServer::getNicknames()
+    const {
+  return activeNicknames;
+}
+
+LinkManager& IRCServer::getLinks() { return links; }
+
+UserIndex& IRCServer::getUserIndex() { return userIndex; }
+
+MonitorIndex& IRCServer::getMonitors() { return monitors; }
+
+ModuleManager& IRCServer::getModules() { return modules; }
+
+AdmissionControl& IRCServer::getAdmission() { return admission; }
+
+TrafficCapture* IRCServer::getCapture() { return capture; }
+
+void IRCServer::logTraffic(char type, const std::string& source,
+                           const std::string& target,
+                           const std::string& text) {
+  if (messageLog) {
+    messageLog->record(type, source, target, text);
+  }
+}
+
+const PatternMatcher& IRCServer::getContentFilter() const {
+  return contentFilter;
+}
+
+bool IRCServer::hasAccounts() const { return loginFd >= 0; }
+
+// Queue a password check for handler. Returns its request number, or 0 if
+// it could not be queued.
+unsigned long IRCServer::startLogin(ClientHandler* handler,
+                                    const std::string& account,
+                                    const std::string& password) {
+  unsigned long request = accounts.submit(account, password);
+  if (request != 0) {
+    pendingLogins[request] = handler;
+  }
+  return request;
+}
+
+// The handler is going away; its result will be dropped.
+void IRCServer::cancelLogin(unsigned long request) {
+  pendingLogins.erase(request);
+}
+
+// A cached answer is used at once; otherwise clients connecting from the
+// same address share one lookup.
+void IRCServer::lookUpHost(ClientHandler* handler, unsigned int address) {
+  std::string hostname;
+  if (resolver.find(address, hostname)) {
+    handler->awaitHostname(0);
+    handler->setLookedUpHost(hostname);
+    return;
+  }
+  unsigned long request = resolver.submit(address);
+  pendingLookups.insert(std::make_pair(request, handler));
+  handler->awaitHostname(request);
+}
+
+void IRCServer::cancelHostLookup(ClientHandler* handler,
+                                 unsigned long request) {
+  std::pair<std::multimap<unsigned long, ClientHandler*>::iterator,
+            std::multimap<unsigned long, ClientHandler*>::iterator>
+      range = pendingLookups.equal_range(request);
+  for (; range.first != range.second; ++range.first) {
+    if (range.first->second == handler) {
+      pendingLookups.erase(range.first);
+      return;
+    }
+  }
+}
+
+void IRCServer::finishHostLookups() {
+  std::vector<Resolver::Result> results;
+  resolver.takeResults(results);
+  for (size_t i = 0; i < results.size(); ++i) {
+    std::pair<std::multimap<unsigned long, ClientHandler*>::iterator,
+              std::multimap<unsigned long, ClientHandler*>::iterator>
+        range = pendingLookups.equal_range(results[i].request);
+    std::vector<ClientHandler*> waiting;
+    for (; range.first != range.second; ++range.first) {
+      waiting.push_back(range.first->second);
+    }
+    pendingLookups.erase(results[i].request);
+    for (size_t j = 0; j < waiting.size(); ++j) {
+      waiting[j]->setLookedUpHost(results[i].hostname);
+    }
+  }
+}
+
+void IRCServer::finishLogins() {
+  std::vector<AccountStore::Result> results;
+  accounts.takeResults(results);
+  for (size_t i = 0; i < results.size(); ++i) {
+    std::map<unsigned long, ClientHandler*>::iterator it =
+        pendingLogins.find(results[i].request);
+    if (it == pendingLogins.end()) {
+      continue;
+    }
+    ClientHandler* handler = it->second;
+    pendingLogins.erase(it);
+    handler->finishLogin(results[i].account, results[i].accepted);
+  }
+}
+
+unsigned long IRCServer::nextFanoutEpoch() { return ++fanoutEpoch; }
+
+// Send a message once to every user sharing at least one channel with source
+// (QUIT, NICK) and allowed to see source there (+u). Each member is marked
+// with the current epoch the first time it is reached, so the walk is
+// linear in the total number of memberships.
+void IRCServer::broadcastToSharedChannels(ClientHandler* source,
+                                          const std::string& message) {
+  unsigned long epoch = nextFanoutEpoch();
+  source->markFanout(epoch);
+  const std::set<Channel*>& shared = source->getChannels();
+  for (std::set<Channel*>::const_iterator ch = shared.begin();
+       ch != shared.end(); ++ch) {
+    (*ch)->broadcastMembershipUnmarked(message, source, epoch);
+  }
+}
+
+MessageHistory& IRCServer::getHistory() { return history; }
+
+void IRCServer::setHistoryBudget(size_t megabytes) {
+  history = MessageHistory(1000, megabytes * 1024 * 1024);
+}
+
 const std::string IRCServer::getPassword() const { return password; }
 
 void IRCServer::handleSigtstp(int signum) {
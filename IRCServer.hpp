@@ -1,20 +1,45 @@
 #ifndef IRCSERVER_HPP
 #define IRCSERVER_HPP
 
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <map>
+#include <set>
 #include <sstream>
 #include <vector>
 
+#ifdef IRC_TLS
+#include <openssl/ssl.h>
+#endif
+
+#include "AccountStore.hpp"
+#include "AdmissionControl.hpp"
+#include "FanoutPool.hpp"
+#include "IOUring.hpp"
+#include "InternedString.hpp"
+#include "LinkManager.hpp"
+#include "MessageHistory.hpp"
+#include "MessageLog.hpp"
+#include "ModuleManager.hpp"
+#include "MonitorIndex.hpp"
+#include "PatternMatcher.hpp"
+#include "Resolver.hpp"
+#include "SocketProfile.hpp"
+#include "StateStore.hpp"
+#include "TrafficCapture.hpp"
+#include "UserIndex.hpp"
+
 class ClientHandler;
 class Channel;
 
@@ -23,18 +48,70 @@ class IRCServer {
   IRCServer(const int port, const std::string password);
   ~IRCServer();
 
+  bool enableTls(int tlsPort, const std::string& certFile,
+                 const std::string& keyFile);
+  int openListener(int listenPort);
   bool initializeServerSocket();
   void cleanUpInactiveHandlers();
+  bool setEventBackend(const std::string& name);
+  bool enableStateStore(const std::string& directory);
+  bool enableCapture(const std::string& path);
+  bool enableMessageLog(const std::string& directory, size_t fileBytes);
+  bool enableFanoutThreads(size_t threads);
+  bool enableContentFilter(const std::string& path);
+  bool enableAccounts(const std::string& path, size_t threads);
+  void setSocketProfile(int listenPort, const SocketProfile& profile);
+  bool enableResolver(const std::string& server);
+  void compactState();
   void run();
-  void acceptNewClient();
+  void runPoll();
+  bool runIoUring();
+  void acceptNewClient(int listenSocket);
+  ClientHandler* registerClient(int clientSocket, int listenSocket);
+  ClientHandler* addConnection(int clientSocket);
+  void queueFlush(ClientHandler* handler);
+  void flushPendingOutput();
+  size_t flushInParallel();
+  void deferInput(ClientHandler* handler);
+  void runInputBacklog();
 
   bool isNicknameAvailable(const std::string& nickname);
   void registerNickname(const std::string& nickname, ClientHandler* handler);
   void unregisterNickname(const std::string& nickname);
   ClientHandler* findClientHandlerByNickname(const std::string& nickname);
+  const std::map<InternedString, ClientHandler*>& getNicknames() const;
+
+  MessageHistory& getHistory();
+  void setHistoryBudget(size_t megabytes);
 
   void createChannel(const std::string& channelName);
   Channel* findChannel(const std::string& channelName);
+  const std::map<std::string, Channel*>& getChannels() const;
+  LinkManager& getLinks();
+  UserIndex& getUserIndex();
+  MonitorIndex& getMonitors();
+  ModuleManager& getModules();
+  AdmissionControl& getAdmission();
+  TrafficCapture* getCapture();
+  // Archive a routed message or membership change (-l); no-op without it
+  void logTraffic(char type, const std::string& source,
+                  const std::string& target, const std::string& text);
+  const PatternMatcher& getContentFilter() const;
+
+  // Account logins (PASS account:password, SASL PLAIN); the handler hears
+  // back through finishLogin on a later loop iteration
+  bool hasAccounts() const;
+  unsigned long startLogin(ClientHandler* handler, const std::string& account,
+                           const std::string& password);
+  void cancelLogin(unsigned long request);
+
+  // Reverse DNS for a new client; it hears back through setLookedUpHost
+  void lookUpHost(ClientHandler* handler, unsigned int address);
+  void cancelHostLookup(ClientHandler* handler, unsigned long request);
+
+  void broadcastToSharedChannels(ClientHandler* source,
+                                 const std::string& message);
+  unsigned long nextFanoutEpoch();
 
   void sendMessageToUser(const std::string& senderNickname,
                          const std::string& recipientNickname,
@@ -48,10 +125,65 @@ class IRCServer {
                    // 6667: 빌딩번호)
   std::string password;  // 사무실 문 앞에 있는 비밀번호
   int serverSocket;      // 서버의 "문" 역할
+  int tlsPort;           // 0 when no TLS listener is configured
+  int tlsSocket;
+#ifdef IRC_TLS
+  SSL_CTX* tlsContext;
+#endif
   std::vector<struct pollfd> fds;
+  std::vector<ClientHandler*> flushQueue;  // Handlers with output to write
+  std::vector<ClientHandler*> inputBacklog;  // Lines left for next iteration
+  void setPollEvents(int fd, short events, bool enable);
+  void pauseInput(ClientHandler* handler, bool paused);
+  void finishLogins();
+  void finishHostLookups();
+  bool useIoUring;
+#ifdef __linux__
+  IOUring* uring;  // Only set while runIoUring is running
+  std::map<int, unsigned int> fdGenerations;
+  std::map<unsigned long long, std::string> ioUringSends;  // In-flight SENDs
+  static const unsigned long long kIoUringAccept = 1;
+  static const unsigned long long kIoUringRecv = 2;
+  static const unsigned long long kIoUringPoll = 3;
+  static const unsigned long long kIoUringSend = 4;
+  static const unsigned long long kIoUringCancel = 5;
+  static const unsigned long long kIoUringLogins = 6;
+  static const unsigned long long kIoUringLookups = 7;
+  static const unsigned long long kIoUringWritable = 8;
+  std::set<unsigned long long> armedRecvs;  // Live multishot recv/poll
+  std::set<unsigned long long> armedWritable;  // TLS clients awaiting POLLOUT
+  unsigned long long ioUringKey(int fd);
+  ClientHandler* findIoUringClient(unsigned long long key);
+  void armIoUringAccept(int listenSocket);
+  void armIoUringRecv(ClientHandler* handler, int fd);
+  void armIoUringNotify(int fd, unsigned long long operation);
+  void handleIoUringCompletion(const struct io_uring_cqe& cqe);
+#else
+  void* uring;
+#endif
+  void submitIoUringSend(ClientHandler* handler);
   std::map<int, ClientHandler*> clientHandlers;
-  std::map<std::string, ClientHandler*> activeNicknames;
+  std::map<InternedString, ClientHandler*> activeNicknames;
   std::map<std::string, Channel*> channels;
+  unsigned long fanoutEpoch;  // Bumped once per deduplicated fan-out
+  StateStore* stateStore;     // NULL unless started with -s <dir>
+  TrafficCapture* capture;    // NULL unless started with -C <file>
+  MessageLog* messageLog;    // NULL unless started with -l <dir>
+  FanoutPool fanout;          // Threads from -F <n> that share big flushes
+  MessageHistory history;     // Recent channel messages for CHATHISTORY
+  UserIndex userIndex;        // WHO lookups by nick, user and host
+  LinkManager links;          // Peer servers and the users behind them
+  AdmissionControl admission;  // Per-address limits on accepted sockets
+  MonitorIndex monitors;      // MONITOR watchers by nick
+  ModuleManager modules;      // Hooks loaded with -M <file.so>
+  PatternMatcher contentFilter;  // Blocked message text from -P <file>
+  AccountStore accounts;         // Hashed credentials from -a <file>
+  int loginFd;                   // Wakes the loop when checks finish, or -1
+  std::map<int, SocketProfile> socketProfiles;  // By listener port (-S)
+  Resolver resolver;             // Reverse DNS through -R <server>
+  int lookupFd;                  // Wakes the loop when lookups finish, or -1
+  std::multimap<unsigned long, ClientHandler*> pendingLookups;  // By request
+  std::map<unsigned long, ClientHandler*> pendingLogins;  // By request
   static struct termios orig_termios;  // 터미널 상태를 저장
 };
 
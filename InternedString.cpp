@@ -0,0 +1,59 @@
+#include "InternedString.hpp"
+
+// Never destroyed, so handles in other static objects stay valid at exit.
+// "" is pinned, so default-constructed handles never touch the pool either.
+InternedString::Pool& InternedString::pool() {
+  static Pool* strings = NULL;
+  if (strings == NULL) {
+    strings = new Pool;
+    strings->insert(std::make_pair(std::string(), 1));
+  }
+  return *strings;
+}
+
+InternedString::Pool::iterator InternedString::acquire(
+    const std::string& text) {
+  Pool::iterator it = pool().insert(std::make_pair(text, 0)).first;
+  ++it->second;
+  return it;
+}
+
+void InternedString::release() {
+  if (--entry->second == 0) {
+    pool().erase(entry);
+  }
+}
+
+InternedString::InternedString() : entry(acquire(std::string())) {}
+
+InternedString::InternedString(const std::string& text)
+    : entry(acquire(text)) {}
+
+InternedString::InternedString(const char* text) : entry(acquire(text)) {}
+
+InternedString::InternedString(const InternedString& other)
+    : entry(other.entry) {
+  ++entry->second;
+}
+
+InternedString& InternedString::operator=(const InternedString& other) {
+  ++other.entry->second;  // First, in case other is this
+  release();
+  entry = other.entry;
+  return *this;
+}
+
+InternedString::~InternedString() { release(); }
+
+bool InternedString::find(const std::string& text, InternedString& handle) {
+  Pool::iterator it = pool().find(text);
+  if (it == pool().end()) {
+    return false;
+  }
+  ++it->second;
+  handle.release();
+  handle.entry = it;
+  return true;
+}
+
+size_t InternedString::poolSize() { return pool().size(); }
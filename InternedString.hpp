@@ -0,0 +1,75 @@
+#ifndef INTERNEDSTRING_HPP
+#define INTERNEDSTRING_HPP
+
+#include <map>
+#include <string>
+
+// An immutable string stored once in a shared pool, no matter how many
+// clients, indexes and channels hold it. A handle is one pointer; the text
+// is freed with its last handle. Handles compare equal by identity, and
+// order by text so they can key sorted indexes. Not thread-safe: handles
+// are only made and dropped on the event loop thread.
+class InternedString {
+ public:
+  InternedString();  // ""
+  InternedString(const std::string& text);
+  InternedString(const char* text);
+  InternedString(const InternedString& other);
+  InternedString& operator=(const InternedString& other);
+  ~InternedString();
+
+  const std::string& str() const { return entry->first; }
+  operator const std::string&() const { return entry->first; }
+  bool empty() const { return entry->first.empty(); }
+  size_t size() const { return entry->first.size(); }
+
+  bool operator==(const InternedString& other) const {
+    return entry == other.entry;
+  }
+  bool operator!=(const InternedString& other) const {
+    return entry != other.entry;
+  }
+  bool operator<(const InternedString& other) const {
+    return entry != other.entry && entry->first < other.entry->first;
+  }
+
+  // Point handle at text's pooled copy if a handle to it is alive. Text
+  // nobody holds equals no handle, so a lookup that fails here needs no
+  // map search, and a lookup never adds to or removes from the pool.
+  static bool find(const std::string& text, InternedString& handle);
+
+  static size_t poolSize();  // Distinct strings alive
+
+ private:
+  typedef std::map<std::string, size_t> Pool;  // Text -> handle count
+
+  static Pool& pool();
+  static Pool::iterator acquire(const std::string& text);
+  void release();
+
+  Pool::iterator entry;
+};
+
+// Building messages out of handles without spelling out .str() each time
+inline std::string operator+(const std::string& left,
+                             const InternedString& right) {
+  return left + right.str();
+}
+inline std::string operator+(const char* left, const InternedString& right) {
+  return left + right.str();
+}
+inline std::string operator+(const InternedString& left,
+                             const std::string& right) {
+  return left.str() + right;
+}
+inline std::string operator+(const InternedString& left, const char* right) {
+  return left.str() + right;
+}
+inline bool operator==(const InternedString& left, const std::string& right) {
+  return left.str() == right;
+}
+inline bool operator!=(const InternedString& left, const std::string& right) {
+  return left.str() != right;
+}
+
+#endif
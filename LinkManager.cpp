@@ -0,0 +1,529 @@
+#include "LinkManager.hpp"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "Channel.hpp"
+#include "ClientHandler.hpp"
+#include "IRCServer.hpp"
+
+static const size_t kBurstLineLength = 400;
+
+// Split ":prefix COMMAND arg ... :trailing" into the prefix and arguments.
+static void splitLine(const std::string& line, std::string& prefix,
+                      std::vector<std::string>& args) {
+  size_t pos = 0;
+  if (!line.empty() && line[0] == ':') {
+    pos = line.find(' ');
+    prefix = line.substr(1, pos == std::string::npos ? pos : pos - 1);
+  }
+  while (pos != std::string::npos) {
+    pos = line.find_first_not_of(' ', pos);
+    if (pos == std::string::npos) {
+      break;
+    }
+    if (line[pos] == ':' && !args.empty()) {
+      args.push_back(line.substr(pos + 1));
+      break;
+    }
+    size_t end = line.find(' ', pos);
+    args.push_back(line.substr(pos, end == std::string::npos ? end
+                                                             : end - pos));
+    pos = end;
+  }
+}
+
+LinkManager::LinkManager(IRCServer* server)
+    : server(server), name("irc.local") {}
+
+LinkManager::~LinkManager() {
+  for (std::set<ClientHandler*>::iterator it = remoteUsers.begin();
+       it != remoteUsers.end(); ++it) {
+    delete *it;
+  }
+}
+
+void LinkManager::setName(const std::string& name) { this->name = name; }
+
+const std::string& LinkManager::getName() const { return name; }
+
+void LinkManager::setPassword(const std::string& password) {
+  this->password = password;
+}
+
+// The host's addresses are resolved once, here, so an inbound link can be
+// checked without a lookup on the event loop.
+bool LinkManager::addPeer(const std::string& spec) {
+  Peer peer;
+  size_t at = spec.find('@');
+  if (at == 0 || at == std::string::npos) {
+    return false;
+  }
+  peer.name = spec.substr(0, at);
+  peer.host = spec.substr(at + 1);
+  size_t colon = peer.host.rfind(':');
+  if (colon != std::string::npos) {
+    peer.port = peer.host.substr(colon + 1);
+    peer.host.erase(colon);
+  }
+  struct addrinfo hints;
+  struct addrinfo* result = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (peer.host.empty() ||
+      getaddrinfo(peer.host.c_str(), NULL, &hints, &result) != 0) {
+    std::cerr << "Cannot resolve peer " << spec << "." << std::endl;
+    return false;
+  }
+  for (struct addrinfo* it = result; it != NULL; it = it->ai_next) {
+    const struct sockaddr_in* address =
+        reinterpret_cast<const struct sockaddr_in*>(it->ai_addr);
+    peer.addresses.push_back(ntohl(address->sin_addr.s_addr));
+  }
+  freeaddrinfo(result);
+  peers.push_back(peer);
+  return true;
+}
+
+const LinkManager::Peer* LinkManager::findPeer(
+    const std::string& peerName) const {
+  for (size_t i = 0; i < peers.size(); ++i) {
+    if (peers[i].name == peerName) {
+      return &peers[i];
+    }
+  }
+  return NULL;
+}
+
+// Connect to every configured peer that has a port and start the
+// handshake. A peer that is down is skipped; it can link to us later
+// instead.
+void LinkManager::connectPeers() {
+  for (size_t i = 0; i < peers.size(); ++i) {
+    if (peers[i].port.empty()) {
+      continue;
+    }
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int fd = -1;
+    if (getaddrinfo(peers[i].host.c_str(), peers[i].port.c_str(), &hints,
+                    &result) == 0) {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+      }
+      freeaddrinfo(result);
+    }
+    if (fd < 0) {
+      std::cerr << "Failed to link to " << peers[i].name << "."
+                << std::endl;
+      continue;
+    }
+    ClientHandler* link = server->addConnection(fd);
+    outbound[link] = peers[i].name;
+    link->sendMessage("SERVER " + name + " " + password);
+  }
+}
+
+// SERVER <name> <password>. Accepted only from a configured peer: the one
+// we dialled under that name, or a connection from that peer's address.
+// The accepting side answers with its own SERVER line only after the
+// check; both sides then send their burst.
+void LinkManager::handleServerCommand(ClientHandler* link,
+                                      const std::string& parameters) {
+  std::string prefix;
+  std::vector<std::string> args;
+  splitLine("SERVER " + parameters, prefix, args);
+  const Peer* configured = args.size() < 3 ? NULL : findPeer(args[1]);
+  std::map<ClientHandler*, std::string>::iterator dialled =
+      outbound.find(link);
+  bool trusted = configured && !password.empty() && args[2] == password;
+  if (trusted && dialled != outbound.end()) {
+    trusted = dialled->second == configured->name;
+  } else if (trusted) {
+    trusted = std::find(configured->addresses.begin(),
+                        configured->addresses.end(),
+                        link->getPeerAddress()) != configured->addresses.end();
+  }
+  if (!trusted) {
+    link->sendMessage("ERROR :Link refused");
+    link->handleDisconnect("Link refused");
+    return;
+  }
+  const std::string& peer = args[1];
+  if (peer == name || servers.count(peer)) {
+    link->sendMessage("ERROR :Server " + peer + " already exists");
+    link->handleDisconnect("Server already exists");
+    return;
+  }
+  if (dialled == outbound.end()) {
+    link->sendMessage("SERVER " + name + " " + password);
+  } else {
+    outbound.erase(dialled);
+  }
+  link->becomeLink(peer);
+  links.push_back(link);
+  servers[peer] = link;
+  propagate("SERVER " + peer, link);
+  Burst& burst = bursts[link];
+  gettimeofday(&burst.started, NULL);
+  burst.users = 0;
+  burst.channelLines = 0;
+  std::cout << "Linked with " << peer << std::endl;
+  sendBurst(link);
+}
+
+// Everything the peer does not know yet: servers, users and channel
+// memberships behind us, built as one buffer so it leaves in as few writes
+// as the socket allows.
+void LinkManager::sendBurst(ClientHandler* link) {
+  std::string burst;
+  for (std::map<std::string, ClientHandler*>::iterator it = servers.begin();
+       it != servers.end(); ++it) {
+    if (it->second != link) {
+      burst += "SERVER " + it->first + "\r\n";
+    }
+  }
+  const std::map<InternedString, ClientHandler*>& nicknames =
+      server->getNicknames();
+  for (std::map<InternedString, ClientHandler*>::const_iterator it =
+           nicknames.begin();
+       it != nicknames.end(); ++it) {
+    ClientHandler* user = it->second;
+    if (user->getUplink() == link || !user->isRegistered()) {
+      continue;
+    }
+    burst += "NICK " + it->first + " " + user->getUsername() + " " +
+             user->getHostname() + " " +
+             (user->getUplink() ? user->getServerName() : name) + "\r\n";
+  }
+  const std::map<std::string, Channel*>& channels = server->getChannels();
+  for (std::map<std::string, Channel*>::const_iterator ch = channels.begin();
+       ch != channels.end(); ++ch) {
+    std::string head = "SJOIN " + ch->first + " :";
+    std::string line = head;
+    const std::map<ClientHandler*, bool>& members = ch->second->getClients();
+    for (std::map<ClientHandler*, bool>::const_iterator it = members.begin();
+         it != members.end(); ++it) {
+      if (it->first->getUplink() == link) {
+        continue;
+      }
+      if (line.size() > kBurstLineLength) {
+        burst += line + "\r\n";
+        line = head;
+      }
+      line += (line.size() == head.size() ? "" : " ") +
+              it->first->getNickname();
+    }
+    if (line.size() > head.size()) {
+      burst += line + "\r\n";
+    }
+  }
+  link->sendMessage(burst + "EOB");
+}
+
+void LinkManager::handleLinkLine(ClientHandler* link,
+                                 const std::string& line) {
+  std::string prefix;
+  std::vector<std::string> args;
+  splitLine(line, prefix, args);
+  if (args.empty()) {
+    return;
+  }
+  if (prefix.empty()) {
+    handleServerLine(link, line, args);
+    return;
+  }
+  ClientHandler* source = findRemote(link, prefix);
+  if (source == NULL || args.size() < 2) {
+    return;  // Crossed with a QUIT or KILL on this side
+  }
+  const std::string& command = args[0];
+  if (command == "QUIT") {
+    propagate(line, link);
+    removeRemote(source, args[1]);
+    return;
+  }
+  if (command == "NICK") {
+    if (!server->isNicknameAvailable(args[1])) {
+      link->sendMessage("KILL " + source->getNickname() + " :Nick collision");
+      propagate(":" + source->getPrefix() + " QUIT :Nick collision", link);
+      removeRemote(source, "Nick collision");
+      return;
+    }
+    server->broadcastToSharedChannels(source, line);
+    source->setRemoteNickname(args[1]);
+    propagate(line, link);
+    return;
+  }
+  if (command == "PRIVMSG" || command == "NOTICE") {
+    char logType = MessageLog::kPrivmsg;
+    if (command == "NOTICE") {
+      logType = MessageLog::kNotice;
+    }
+    std::string text = args.size() > 2 ? args[2] : "";
+    if (args[1].compare(0, 1, "#") == 0) {
+      Channel* channel = server->findChannel(args[1]);
+      if (channel && !channel->droppedByModules(line, source)) {
+        channel->broadcastMessage(line, source);
+        routeToChannel(channel, line, link);
+        server->logTraffic(logType, prefix, args[1], text);
+        std::string entry(line);
+        server->getHistory().record(channel, entry);
+      }
+    } else {
+      ClientHandler* recipient = server->findClientHandlerByNickname(args[1]);
+      if (recipient && recipient->getUplink() != link) {
+        routeToUser(recipient, line);
+        server->logTraffic(logType, prefix, args[1], text);
+      }
+    }
+    return;
+  }
+
+  Channel* channel = command == "JOIN" ? getOrCreateChannel(args[1])
+                                       : server->findChannel(args[1]);
+  if (channel == NULL) {
+    return;
+  }
+  if (command == "JOIN") {
+    if (!channel->isClientMember(source)) {
+      joinRemote(source, channel);
+    }
+  } else if (command == "PART") {
+    if (channel->isClientMember(source)) {
+      server->logTraffic(MessageLog::kPart, prefix, args[1], "");
+      channel->broadcastMembershipChange(line, source);
+      channel->removeClient(source);
+      source->eraseChannel(channel);
+    }
+  } else if (command == "TOPIC" && args.size() > 2) {
+    channel->setTopic(args[2], source->getNickname());
+    channel->broadcastMessage(line, NULL);
+  } else if (command == "KICK" && args.size() > 2) {
+    ClientHandler* target = server->findClientHandlerByNickname(args[2]);
+    if (target && channel->isClientMember(target)) {
+      server->logTraffic(MessageLog::kKick, prefix, args[1], args[2]);
+      channel->broadcastMessage(line, NULL);
+      channel->removeClient(target);
+      channel->removeInvitation(target);
+      target->eraseChannel(channel);
+    }
+  } else {
+    return;
+  }
+  propagate(line, link);
+}
+
+// Lines without a prefix come from the peer server itself.
+void LinkManager::handleServerLine(ClientHandler* link,
+                                   const std::string& line,
+                                   const std::vector<std::string>& args) {
+  const std::string& command = args[0];
+  if (command == "NICK" && args.size() >= 5) {
+    if (!server->isNicknameAvailable(args[1])) {
+      link->sendMessage("KILL " + args[1] + " :Nick collision");
+      return;
+    }
+    ClientHandler* user = new ClientHandler(-1, server);
+    user->makeRemote(link, args[1], args[2], args[3], args[4]);
+    server->registerNickname(args[1], user);
+    remoteUsers.insert(user);
+    if (bursts.count(link)) {
+      ++bursts[link].users;
+    }
+    propagate(line, link);
+  } else if (command == "SJOIN" && args.size() >= 3) {
+    Channel* channel = getOrCreateChannel(args[1]);
+    std::string prefix;
+    std::vector<std::string> nicks;
+    splitLine("SJOIN " + args[2], prefix, nicks);
+    for (size_t i = 1; i < nicks.size(); ++i) {
+      ClientHandler* user = findRemote(link, nicks[i]);
+      if (user && !channel->isClientMember(user)) {
+        joinRemote(user, channel);
+      }
+    }
+    if (bursts.count(link)) {
+      ++bursts[link].channelLines;
+    }
+    propagate(line, link);
+  } else if (command == "SERVER" && args.size() >= 2) {
+    if (args[1] == name || servers.count(args[1])) {
+      link->sendMessage("ERROR :Loop detected at " + args[1]);
+      link->handleDisconnect("Loop detected");
+      return;
+    }
+    servers[args[1]] = link;
+    propagate(line, link);
+  } else if (command == "SQUIT" && args.size() >= 2) {
+    std::map<std::string, ClientHandler*>::iterator it =
+        servers.find(args[1]);
+    if (it != servers.end() && it->second == link) {
+      servers.erase(it);
+      dropServer(args[1], "*.net *.split");
+      propagate(line, link);
+    }
+  } else if (command == "KILL" && args.size() >= 2) {
+    ClientHandler* user = server->findClientHandlerByNickname(args[1]);
+    std::string reason = args.size() > 2 ? args[2] : "Killed";
+    if (user == NULL || user->getUplink() == link) {
+      return;
+    }
+    if (user->getUplink() == NULL) {
+      user->sendMessage("ERROR :Closing link (" + reason + ")");
+      user->handleDisconnect("Killed (" + reason + ")");  // Sends the QUIT
+    } else {
+      routeToUser(user, line);
+      propagate(":" + user->getPrefix() + " QUIT :Killed (" + reason + ")",
+                user->getUplink());
+      removeRemote(user, "Killed (" + reason + ")");
+    }
+  } else if (command == "EOB") {
+    std::map<ClientHandler*, Burst>::iterator it = bursts.find(link);
+    if (it != bursts.end()) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      std::cout << "Burst from " << link->getServerName() << ": "
+                << it->second.users << " users, " << it->second.channelLines
+                << " channel lines in "
+                << (now.tv_sec - it->second.started.tv_sec) * 1000 +
+                       (now.tv_usec - it->second.started.tv_usec) / 1000
+                << " ms" << std::endl;
+      bursts.erase(it);
+    }
+  } else if (command == "PING") {
+    link->sendMessage("PONG " + (args.size() > 1 ? args[1] : name));
+  } else if (command == "ERROR") {
+    std::cerr << "Link " << link->getServerName() << ": " << line
+              << std::endl;
+  }
+}
+
+// Tear down everything learned through a link that closed.
+void LinkManager::linkLost(ClientHandler* link) {
+  outbound.erase(link);
+  bursts.erase(link);
+  std::vector<ClientHandler*>::iterator found =
+      std::find(links.begin(), links.end(), link);
+  if (found == links.end()) {
+    return;
+  }
+  links.erase(found);
+  std::cout << "Lost link with " << link->getServerName() << std::endl;
+  std::string reason = name + " " + link->getServerName();
+  std::map<std::string, ClientHandler*>::iterator it = servers.begin();
+  while (it != servers.end()) {
+    if (it->second == link) {
+      propagate("SQUIT " + it->first, link);
+      servers.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  std::vector<ClientHandler*> gone;
+  for (std::set<ClientHandler*>::iterator user = remoteUsers.begin();
+       user != remoteUsers.end(); ++user) {
+    if ((*user)->getUplink() == link) {
+      gone.push_back(*user);
+    }
+  }
+  for (size_t i = 0; i < gone.size(); ++i) {
+    removeRemote(gone[i], reason);
+  }
+}
+
+void LinkManager::introduceUser(ClientHandler* user) {
+  propagate("NICK " + user->getNickname() + " " + user->getUsername() + " " +
+                user->getHostname() + " " + name,
+            NULL);
+}
+
+// Send a line to every link except the one it came from.
+void LinkManager::propagate(const std::string& line, ClientHandler* fromLink) {
+  for (size_t i = 0; i < links.size(); ++i) {
+    if (links[i] != fromLink) {
+      links[i]->sendMessage(line);
+    }
+  }
+}
+
+// Send a channel line once over each link that has members of the channel
+// behind it, however many of them there are.
+void LinkManager::routeToChannel(Channel* channel, const std::string& line,
+                                 ClientHandler* fromLink) {
+  if (links.empty()) {
+    return;
+  }
+  unsigned long epoch = server->nextFanoutEpoch();
+  const std::map<ClientHandler*, bool>& members = channel->getClients();
+  for (std::map<ClientHandler*, bool>::const_iterator it = members.begin();
+       it != members.end(); ++it) {
+    ClientHandler* uplink = it->first->getUplink();
+    if (uplink && uplink != fromLink && uplink->markFanout(epoch)) {
+      uplink->sendMessage(line);
+    }
+  }
+}
+
+void LinkManager::routeToUser(ClientHandler* user, const std::string& line) {
+  if (user->getUplink()) {
+    user->getUplink()->sendMessage(line);
+  } else {
+    user->sendMessage(line);
+  }
+}
+
+// prefix is nick!user@host or a bare nick; only users introduced through
+// this link may speak on it.
+ClientHandler* LinkManager::findRemote(ClientHandler* link,
+                                       const std::string& prefix) {
+  ClientHandler* user =
+      server->findClientHandlerByNickname(prefix.substr(0, prefix.find('!')));
+  return user && user->getUplink() == link ? user : NULL;
+}
+
+Channel* LinkManager::getOrCreateChannel(const std::string& name) {
+  server->createChannel(name);
+  return server->findChannel(name);
+}
+
+void LinkManager::joinRemote(ClientHandler* user, Channel* channel) {
+  channel->addRemoteClient(user);
+  user->addChannel(channel);
+  channel->broadcastMembershipChange(
+      ":" + user->getPrefix() + " JOIN :" + channel->getName(), user);
+  server->logTraffic(MessageLog::kJoin, user->getPrefix(), channel->getName(),
+                     "");
+}
+
+void LinkManager::removeRemote(ClientHandler* user,
+                               const std::string& reason) {
+  user->handleDisconnect(reason);  // QUIT to local members
+  remoteUsers.erase(user);
+  delete user;
+}
+
+void LinkManager::dropServer(const std::string& serverName,
+                             const std::string& reason) {
+  std::vector<ClientHandler*> gone;
+  for (std::set<ClientHandler*>::iterator user = remoteUsers.begin();
+       user != remoteUsers.end(); ++user) {
+    if ((*user)->getServerName() == serverName) {
+      gone.push_back(*user);
+    }
+  }
+  for (size_t i = 0; i < gone.size(); ++i) {
+    removeRemote(gone[i], reason);
+  }
+}
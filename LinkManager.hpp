@@ -0,0 +1,96 @@
+#ifndef LINKMANAGER_HPP
+#define LINKMANAGER_HPP
+
+#include <sys/time.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class Channel;
+class ClientHandler;
+class IRCServer;
+
+// Server-to-server links. Servers form a spanning tree: a server name that
+// is already known through another link is refused, so there are no cycles
+// and every line has exactly one path.
+//
+// Only the peers configured with -L may link, each under its own name and,
+// when it connects to us, from its host's address. Both sides prove the
+// link password (-p), which is separate from the client password.
+//
+// Protocol (one line each, same framing as clients):
+//   SERVER <name> <password>            handshake, sent by both sides
+//   SERVER <name>                       a server further down a link
+//   SQUIT <name>                        that server is gone
+//   NICK <nick> <user> <host> <server>  a user is introduced
+//   SJOIN <channel> :<nick> <nick> ...  users already in a channel (burst)
+//   EOB                                 end of burst
+//   KILL <nick> :<reason>               nick collision
+//   :<nick>!<user>@<host> JOIN|PART|NICK|QUIT|PRIVMSG|NOTICE|TOPIC|KICK ...
+//                                       user events, exactly as clients see
+//                                       them, so they are relayed verbatim.
+// Users on other servers are ClientHandlers without a socket whose uplink is
+// the link they were introduced through.
+class LinkManager {
+ public:
+  LinkManager(IRCServer* server);
+  ~LinkManager();
+
+  void setName(const std::string& name);
+  const std::string& getName() const;
+  void setPassword(const std::string& password);
+  bool addPeer(const std::string& spec);  // "name@host[:port]"
+  void connectPeers();
+
+  // Handshake line from an unregistered connection
+  void handleServerCommand(ClientHandler* link, const std::string& parameters);
+  void handleLinkLine(ClientHandler* link, const std::string& line);
+  void linkLost(ClientHandler* link);
+
+  // Local events that the rest of the network needs to see
+  void introduceUser(ClientHandler* user);
+  void propagate(const std::string& line, ClientHandler* fromLink);
+  void routeToChannel(Channel* channel, const std::string& line,
+                      ClientHandler* fromLink);
+  void routeToUser(ClientHandler* user, const std::string& line);
+
+ private:
+  LinkManager(const LinkManager&);
+  LinkManager& operator=(const LinkManager&);
+
+  struct Peer {
+    std::string name;
+    std::string host;
+    std::string port;                     // Empty: accepted, never dialled
+    std::vector<unsigned int> addresses;  // host, resolved at startup
+  };
+  struct Burst {
+    struct timeval started;
+    size_t users;
+    size_t channelLines;
+  };
+
+  const Peer* findPeer(const std::string& peerName) const;
+  void handleServerLine(ClientHandler* link, const std::string& line,
+                        const std::vector<std::string>& args);
+  void sendBurst(ClientHandler* link);
+  ClientHandler* findRemote(ClientHandler* link, const std::string& prefix);
+  Channel* getOrCreateChannel(const std::string& name);
+  void joinRemote(ClientHandler* user, Channel* channel);
+  void removeRemote(ClientHandler* user, const std::string& reason);
+  void dropServer(const std::string& serverName, const std::string& reason);
+
+  IRCServer* server;
+  std::string name;
+  std::string password;                         // Links only; empty: none
+  std::vector<Peer> peers;                      // From -L
+  std::map<ClientHandler*, std::string> outbound;  // Dialled peer, no reply
+  std::vector<ClientHandler*> links;            // Established links
+  std::map<std::string, ClientHandler*> servers;  // Name -> next hop
+  std::set<ClientHandler*> remoteUsers;
+  std::map<ClientHandler*, Burst> bursts;  // Links still sending their burst
+};
+
+#endif
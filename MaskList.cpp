@@ -0,0 +1,132 @@
+#include "MaskList.hpp"
+
+#include <algorithm>
+
+MaskList::MaskList() : hostTrie(1), nickTrie(1) {}
+
+std::string MaskList::normalize(const std::string& mask) {
+  size_t bang = mask.find('!');
+  size_t at = mask.find('@');
+  if (bang == std::string::npos && at == std::string::npos) {
+    return mask + "!*@*";
+  }
+  if (bang == std::string::npos) {
+    return "*!" + mask;
+  }
+  if (at == std::string::npos) {
+    return mask + "@*";
+  }
+  return mask;
+}
+
+bool MaskList::add(const std::string& mask) {
+  if (!folded.insert(WildcardMask::fold(mask)).second) {
+    return false;
+  }
+  masks.push_back(mask);
+  compiled.push_back(WildcardMask(mask));
+  insert(masks.size() - 1);
+  return true;
+}
+
+// Removal is rare next to lookups, so the trie is simply rebuilt.
+bool MaskList::remove(const std::string& mask) {
+  std::string key = WildcardMask::fold(mask);
+  if (folded.erase(key) == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < masks.size(); ++i) {
+    if (WildcardMask::fold(masks[i]) == key) {
+      masks.erase(masks.begin() + i);
+      compiled.erase(compiled.begin() + i);
+      rebuild();
+      return true;
+    }
+  }
+  return false;
+}
+
+void MaskList::insert(size_t index) {
+  const std::string& mask = masks[index];
+  size_t at = mask.rfind('@');
+  std::string hostSuffix =
+      at == std::string::npos
+          ? std::string()
+          : WildcardMask(mask.substr(at + 1)).getSuffix();
+  if (!hostSuffix.empty()) {
+    std::reverse(hostSuffix.begin(), hostSuffix.end());
+    insertPath(hostTrie, hostSuffix, index);
+    return;
+  }
+  std::string nickPrefix =
+      WildcardMask(mask.substr(0, mask.find('!'))).getPrefix();
+  if (!nickPrefix.empty()) {
+    insertPath(nickTrie, nickPrefix, index);
+  } else {
+    unanchored.push_back(index);
+  }
+}
+
+void MaskList::insertPath(std::vector<Node>& trie, const std::string& path,
+                          size_t index) {
+  size_t node = 0;
+  for (size_t i = 0; i < path.size(); ++i) {
+    std::map<char, size_t>::iterator child = trie[node].children.find(path[i]);
+    if (child == trie[node].children.end()) {
+      trie.push_back(Node());
+      child = trie[node].children.insert(
+          std::make_pair(path[i], trie.size() - 1)).first;
+    }
+    node = child->second;
+  }
+  trie[node].entries.push_back(index);
+}
+
+void MaskList::rebuild() {
+  hostTrie.assign(1, Node());
+  nickTrie.assign(1, Node());
+  unanchored.clear();
+  for (size_t i = 0; i < masks.size(); ++i) {
+    insert(i);
+  }
+}
+
+// Walk text (backwards if reversed) and try the masks filed on the way.
+bool MaskList::matchPath(const std::vector<Node>& trie,
+                         const std::string& text, bool reversed,
+                         const std::string& full) const {
+  size_t node = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    char c = text[reversed ? text.size() - 1 - i : i];
+    std::map<char, size_t>::const_iterator child = trie[node].children.find(c);
+    if (child == trie[node].children.end()) {
+      return false;
+    }
+    node = child->second;
+    const std::vector<size_t>& entries = trie[node].entries;
+    for (size_t j = 0; j < entries.size(); ++j) {
+      if (compiled[entries[j]].matchesFolded(full)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool MaskList::matches(const std::string& nick, const std::string& user,
+                       const std::string& host) const {
+  if (masks.empty()) {
+    return false;
+  }
+  std::string full = WildcardMask::fold(nick + "!" + user + "@" + host);
+  for (size_t i = 0; i < unanchored.size(); ++i) {
+    if (compiled[unanchored[i]].matchesFolded(full)) {
+      return true;
+    }
+  }
+  size_t at = full.size() - host.size();  // Folding keeps the length
+  return matchPath(hostTrie, full.substr(at), true, full) ||
+         matchPath(nickTrie, full.substr(0, nick.size()), false, full);
+}
+
+const std::vector<std::string>& MaskList::getMasks() const { return masks; }
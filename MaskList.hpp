@@ -0,0 +1,52 @@
+#ifndef MASKLIST_HPP
+#define MASKLIST_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "WildcardMask.hpp"
+
+// A channel ban (+b) or exception (+e) list of nick!user@host masks.
+// Most masks pin the host ("*!*@*.isp.example", "*!*@10.0.0.1"), so masks
+// are filed in a trie under the literal end of their host part, reversed;
+// masks that leave the host open but pin the start of the nick ("spam*")
+// go in a second trie under that prefix. A lookup walks the user's reversed
+// host and nick once and only fully matches the masks found on those paths,
+// plus the few masks with neither anchor.
+class MaskList {
+ public:
+  MaskList();
+
+  bool add(const std::string& mask);  // false if already listed
+  bool remove(const std::string& mask);
+  bool matches(const std::string& nick, const std::string& user,
+               const std::string& host) const;
+  const std::vector<std::string>& getMasks() const;
+
+  // "nick" -> "nick!*@*", "user@host" -> "*!user@host"
+  static std::string normalize(const std::string& mask);
+
+ private:
+  struct Node {
+    std::map<char, size_t> children;
+    std::vector<size_t> entries;  // Indexes into compiled
+  };
+
+  void insert(size_t index);
+  static void insertPath(std::vector<Node>& trie, const std::string& path,
+                         size_t index);
+  bool matchPath(const std::vector<Node>& trie, const std::string& text,
+                 bool reversed, const std::string& full) const;
+  void rebuild();
+
+  std::vector<std::string> masks;  // In the order they were set
+  std::set<std::string> folded;    // Lowercase copies, for duplicates
+  std::vector<WildcardMask> compiled;
+  std::vector<Node> hostTrie;      // Reversed host suffixes; [0] is the root
+  std::vector<Node> nickTrie;      // Nick prefixes; [0] is the root
+  std::vector<size_t> unanchored;  // Masks with neither
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "MessageHistory.hpp"
+
+#include <sys/time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+static const size_t kEntryOverhead = sizeof(MessageHistory::Entry);
+
+MessageHistory::MessageHistory(size_t perChannelLimit, size_t budgetBytes)
+    : perChannelLimit(perChannelLimit),
+      budgetBytes(budgetBytes),
+      usedBytes(0),
+      entryCount(0),
+      nextMsgid(1),
+      lastTime(0) {}
+
+void MessageHistory::record(Channel* channel, std::string& line) {
+  if (perChannelLimit == 0 || budgetBytes == 0) {
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  unsigned long long time =
+      static_cast<unsigned long long>(now.tv_sec) * 1000 + now.tv_usec / 1000;
+  if (time < lastTime) {
+    time = lastTime;  // Keep timestamps sorted even if the clock steps back
+  }
+  lastTime = time;
+
+  std::deque<Entry>& ring = channels[channel];
+  if (ring.size() >= perChannelLimit) {
+    usedBytes -= ring.front().line.size() + kEntryOverhead;
+    --entryCount;
+    ring.pop_front();
+  }
+  ring.push_back(Entry());
+  ring.back().msgid = nextMsgid++;
+  ring.back().time = time;
+  ring.back().line.swap(line);
+  usedBytes += ring.back().line.size() + kEntryOverhead;
+  ++entryCount;
+  order.push_back(std::make_pair(channel, ring.back().msgid));
+
+  while (usedBytes > budgetBytes && !order.empty()) {
+    evictOldest();
+  }
+  if (order.size() > 2 * entryCount + 1024) {
+    compactOrder();
+  }
+}
+
+// Drop the globally oldest entry. order may still name entries that a
+// channel already pushed out on its own; those are skipped.
+void MessageHistory::evictOldest() {
+  std::pair<Channel*, unsigned long long> oldest = order.front();
+  order.pop_front();
+  std::map<Channel*, std::deque<Entry> >::iterator it =
+      channels.find(oldest.first);
+  if (it == channels.end() || it->second.empty() ||
+      it->second.front().msgid != oldest.second) {
+    return;
+  }
+  usedBytes -= it->second.front().line.size() + kEntryOverhead;
+  --entryCount;
+  it->second.pop_front();
+  if (it->second.empty()) {
+    channels.erase(it);
+  }
+}
+
+// Remove order entries whose message is already gone, so order stays
+// proportional to the number of live entries.
+void MessageHistory::compactOrder() {
+  std::deque<std::pair<Channel*, unsigned long long> > live;
+  for (size_t i = 0; i < order.size(); ++i) {
+    std::map<Channel*, std::deque<Entry> >::iterator it =
+        channels.find(order[i].first);
+    if (it != channels.end() && !it->second.empty() &&
+        it->second.front().msgid <= order[i].second) {
+      live.push_back(order[i]);
+    }
+  }
+  order.swap(live);
+}
+
+const std::deque<MessageHistory::Entry>* MessageHistory::find(
+    Channel* channel) const {
+  std::map<Channel*, std::deque<Entry> >::const_iterator it =
+      channels.find(channel);
+  return it == channels.end() ? NULL : &it->second;
+}
+
+// Accepts msgid=<id> and timestamp=YYYY-MM-DDThh:mm:ss[.sss]Z.
+bool MessageHistory::resolve(Channel* channel, const std::string& reference,
+                             size_t& index, bool& exact) const {
+  bool byMsgid;
+  unsigned long long key = 0;
+  if (reference.compare(0, 6, "msgid=") == 0) {
+    byMsgid = true;
+    char* end = NULL;
+    key = strtoull(reference.c_str() + 6, &end, 10);
+    if (end == reference.c_str() + 6 || *end != '\0') {
+      return false;
+    }
+  } else if (reference.compare(0, 10, "timestamp=") == 0) {
+    byMsgid = false;
+    struct tm parts;
+    int consumed = 0;
+    std::memset(&parts, 0, sizeof(parts));
+    if (sscanf(reference.c_str() + 10, "%4d-%2d-%2dT%2d:%2d:%2d%n",
+               &parts.tm_year, &parts.tm_mon, &parts.tm_mday, &parts.tm_hour,
+               &parts.tm_min, &parts.tm_sec, &consumed) < 6) {
+      return false;
+    }
+    // The fraction is digits after the point, so ".5" is 500 ms and
+    // ".05" 50 ms; digits past the millisecond are ignored.
+    const char* fraction = reference.c_str() + 10 + consumed;
+    unsigned long long millis = 0;
+    if (*fraction == '.') {
+      int scale = 100;
+      for (++fraction; *fraction >= '0' && *fraction <= '9'; ++fraction) {
+        millis += (*fraction - '0') * scale;
+        scale /= 10;
+      }
+    }
+    parts.tm_year -= 1900;
+    parts.tm_mon -= 1;
+    key = static_cast<unsigned long long>(timegm(&parts)) * 1000 + millis;
+  } else {
+    return false;
+  }
+
+  index = 0;
+  exact = false;
+  const std::deque<Entry>* ring = find(channel);
+  if (ring == NULL) {
+    return true;
+  }
+  size_t low = 0;
+  size_t high = ring->size();
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    unsigned long long value =
+        byMsgid ? (*ring)[middle].msgid : (*ring)[middle].time;
+    if (value < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  index = low;
+  exact = low < ring->size() &&
+          (byMsgid ? (*ring)[low].msgid : (*ring)[low].time) == key;
+  return true;
+}
+
+std::string MessageHistory::formatTime(unsigned long long time) {
+  time_t seconds = time / 1000;
+  struct tm parts;
+  gmtime_r(&seconds, &parts);
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+           parts.tm_year + 1900, parts.tm_mon + 1, parts.tm_mday,
+           parts.tm_hour, parts.tm_min, parts.tm_sec,
+           static_cast<int>(time % 1000));
+  return buffer;
+}
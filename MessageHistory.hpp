@@ -0,0 +1,53 @@
+#ifndef MESSAGEHISTORY_HPP
+#define MESSAGEHISTORY_HPP
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Channel;
+
+// Recent channel messages for CHATHISTORY playback.
+// Each channel keeps at most perChannelLimit entries, and all channels share
+// one byte budget: when it is exceeded the globally oldest entries are
+// evicted first. msgids and timestamps only grow, so lookups are binary
+// searches.
+class MessageHistory {
+ public:
+  struct Entry {
+    unsigned long long msgid;
+    unsigned long long time;  // Milliseconds since the epoch
+    std::string line;         // The line as it was broadcast
+  };
+
+  MessageHistory(size_t perChannelLimit, size_t budgetBytes);
+
+  // Takes line's buffer by swapping, leaving line empty: the broadcast
+  // line is kept as built, not copied.
+  void record(Channel* channel, std::string& line);
+
+  // Resolve a "msgid=..." or "timestamp=..." reference to a position in the
+  // channel's history: the index of the first entry at or after it.
+  bool resolve(Channel* channel, const std::string& reference, size_t& index,
+               bool& exact) const;
+  const std::deque<Entry>* find(Channel* channel) const;
+
+  static std::string formatTime(unsigned long long time);
+
+ private:
+  std::map<Channel*, std::deque<Entry> > channels;
+  std::deque<std::pair<Channel*, unsigned long long> > order;  // Oldest first
+  size_t perChannelLimit;
+  size_t budgetBytes;
+  size_t usedBytes;
+  size_t entryCount;
+  unsigned long long nextMsgid;
+  unsigned long long lastTime;
+
+  void evictOldest();
+  void compactOrder();
+};
+
+#endif
@@ -0,0 +1,374 @@
+#include "MessageLog.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+
+#include "StateStore.hpp"
+
+// Each file starts with the magic; records follow StateStore's framing
+// (4-byte length, 4-byte checksum, payload).
+static const char kMagic[8] = {'I', 'R', 'C', 'M', 'L', 'O', 'G', '1'};
+
+static void storeU32(char* out, unsigned int value) {
+  out[0] = value & 0xFF;
+  out[1] = (value >> 8) & 0xFF;
+  out[2] = (value >> 16) & 0xFF;
+  out[3] = (value >> 24) & 0xFF;
+}
+
+static char* putField(char* out, const std::string& value) {
+  storeU32(out, value.size());
+  std::memcpy(out + 4, value.data(), value.size());
+  return out + 4 + value.size();
+}
+
+// Sized once and filled in place; the checksum is left zero for the writer
+// thread to fill in (seal).
+static void putRecord(std::string& out, char type, unsigned long long time,
+                      const std::string& source, const std::string& target,
+                      const std::string& text) {
+  size_t length = 21 + source.size() + target.size() + text.size();
+  size_t start = out.size();
+  out.resize(start + 8 + length);
+  char* next = &out[start];
+  storeU32(next, length);
+  storeU32(next + 4, 0);
+  next[8] = type;
+  storeU32(next + 9, time & 0xFFFFFFFFu);
+  storeU32(next + 13, time >> 32);
+  next = putField(next + 17, source);
+  next = putField(next, target);
+  putField(next, text);
+}
+
+static unsigned long long currentTime() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return static_cast<unsigned long long>(now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+static unsigned long long monotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<unsigned long long>(now.tv_sec) * 1000000 +
+         now.tv_nsec / 1000;
+}
+
+static void putGap(std::string& out, unsigned long count) {
+  std::ostringstream text;
+  text << count;
+  putRecord(out, MessageLog::kGap, currentTime(), "", "", text.str());
+}
+
+static bool getField(const char*& data, const char* end,
+                     MessageLog::Field& field) {
+  unsigned int length;
+  if (!StateStore::getU32(data, end, length) ||
+      static_cast<size_t>(end - data) < length) {
+    return false;
+  }
+  field.data = data;
+  field.size = length;
+  data += length;
+  return true;
+}
+
+static std::string fileName(const std::string& directory,
+                            unsigned int number) {
+  char name[32];
+  snprintf(name, sizeof(name), "/messages.%06u.log", number);
+  return directory + name;
+}
+
+MessageLog::MessageLog(const std::string& directory, size_t fileBytes)
+    : directory(directory),
+      fileBytes(fileBytes),
+      pendingRecords(0),
+      dropped(0),
+      fd(-1),
+      fileNumber(0),
+      written(0),
+      torn(false),
+      lost(0),
+      writerStarted(false),
+      stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&ready, NULL);
+}
+
+MessageLog::~MessageLog() {
+  if (writerStarted) {
+    flush();
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(writer, NULL);  // The writer drains the queue first
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  pthread_cond_destroy(&ready);
+  pthread_mutex_destroy(&mutex);
+}
+
+// Numbering continues after the newest file already in the directory, so
+// a restart never appends to a file that may end in a torn record.
+bool MessageLog::start() {
+  DIR* listing = opendir(directory.c_str());
+  if (listing == NULL) {
+    std::cerr << "Cannot open message log directory " << directory << "."
+              << std::endl;
+    return false;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(listing)) != NULL) {
+    unsigned int number;
+    if (sscanf(entry->d_name, "messages.%6u.log", &number) == 1 &&
+        fileName("", number) == std::string("/") + entry->d_name &&
+        number > fileNumber) {
+      fileNumber = number;
+    }
+  }
+  closedir(listing);
+  if (!openNextFile()) {
+    return false;
+  }
+  if (pthread_create(&writer, NULL, writerMain, this) != 0) {
+    std::cerr << "Failed to start message log writer." << std::endl;
+    return false;
+  }
+  writerStarted = true;
+  std::cout << "Logging messages to " << fileName(directory, fileNumber)
+            << std::endl;
+  return true;
+}
+
+// Called from the event loop for every routed message: only appends to a
+// buffer that the loop alone touches.
+void MessageLog::record(char type, const std::string& source,
+                        const std::string& target, const std::string& text) {
+  putRecord(pending, type, currentTime(), source, target, text);
+  ++pendingRecords;
+}
+
+// One lock per loop iteration. If the writer has fallen kMaxQueued behind,
+// this round's records are dropped and a gap record counts them once it
+// catches up, so the archive says what it is missing.
+void MessageLog::flush() {
+  if (pending.empty() && dropped == 0) {
+    return;
+  }
+  std::string gap;
+  if (dropped != 0) {
+    putGap(gap, dropped);
+  }
+  pthread_mutex_lock(&mutex);
+  if (queued.size() >= kMaxQueued) {
+    pthread_mutex_unlock(&mutex);
+    dropped += pendingRecords;
+  } else {
+    bool wasEmpty = queued.empty();
+    if (!gap.empty()) {
+      queued += gap;
+      dropped = 0;
+    }
+    if (queued.empty()) {
+      queued.swap(pending);  // The writer's old buffer comes back
+    } else {
+      queued += pending;
+    }
+    if (wasEmpty) {
+      pthread_cond_signal(&ready);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+  pending.clear();
+  pendingRecords = 0;
+}
+
+void* MessageLog::writerMain(void* arg) {
+  static_cast<MessageLog*>(arg)->writerLoop();
+  return NULL;
+}
+
+// Take everything queued since the last round, write it, then sync once.
+// While the writer waits on the disk, and for the rest of kCommitInterval
+// after a round starts, the loop queues the next round: a busy server gets
+// at most one sync per interval instead of one per loop iteration, while
+// the first record after a quiet spell is written at once.
+void MessageLog::writerLoop() {
+  std::string batch;
+  unsigned long long roundStart = 0;
+  while (true) {
+    unsigned long long sinceRound = monotonicMicros() - roundStart;
+    if (sinceRound < kCommitInterval) {
+      usleep(kCommitInterval - sinceRound);
+    }
+    pthread_mutex_lock(&mutex);
+    while (queued.empty() && !stopping) {
+      pthread_cond_wait(&ready, &mutex);
+    }
+    if (queued.empty() && stopping) {
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    batch.swap(queued);
+    pthread_mutex_unlock(&mutex);
+    roundStart = monotonicMicros();
+
+    if ((written >= fileBytes || torn) && !openNextFile()) {
+      std::cerr << "Message log rotation failed; keeping the old file."
+                << std::endl;
+    }
+    bool gap = lost != 0 && !torn;
+    if (gap) {
+      std::string record;
+      putGap(record, lost);
+      batch.insert(0, record);
+    }
+    size_t records = seal(batch) - (gap ? 1 : 0);
+    if (torn) {
+      lost += records;  // Nowhere whole to write them
+    } else if (writeAll(batch)) {
+      written += batch.size();
+      lost = 0;
+    } else {
+      // Later rounds must not land behind a partial record, where scan
+      // stops: cut it off, or move to a new file next round
+      lost += records;
+      torn = ftruncate(fd, written) != 0;
+    }
+    fdatasync(fd);
+    batch.clear();
+  }
+}
+
+// Checksums are computed here rather than on the loop thread. Returns the
+// number of records.
+size_t MessageLog::seal(std::string& data) {
+  size_t offset = 0;
+  size_t records = 0;
+  while (offset + 8 <= data.size()) {
+    unsigned int length;
+    const char* field = data.data() + offset;
+    StateStore::getU32(field, data.data() + data.size(), length);
+    storeU32(&data[offset + 4],
+             StateStore::checksum(data.data() + offset + 8, length));
+    offset += 8 + length;
+    ++records;
+  }
+  return records;
+}
+
+// The new file and its directory entry are synced before any record goes
+// in, so a crash cannot lose a whole file of synced records.
+bool MessageLog::openNextFile() {
+  std::string path = fileName(directory, fileNumber + 1);
+  int next = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+  if (next < 0) {
+    std::cerr << "Cannot create message log " << path << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  fd = next;
+  ++fileNumber;
+  written = 0;
+  torn = !writeAll(std::string(kMagic, sizeof(kMagic)));
+  if (!torn) {
+    written = sizeof(kMagic);
+  }
+  fdatasync(fd);
+  int directoryFd = open(directory.c_str(), O_RDONLY);
+  if (directoryFd >= 0) {
+    fsync(directoryFd);
+    close(directoryFd);
+  }
+  return true;
+}
+
+bool MessageLog::writeAll(const std::string& data) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t result = write(fd, data.data() + offset, data.size() - offset);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Message log write failed: " << strerror(errno)
+                << std::endl;
+      return false;
+    }
+    offset += result;
+  }
+  return true;
+}
+
+bool MessageLog::scan(const std::string& path, Visitor visit,
+                      void* context) {
+  int input = open(path.c_str(), O_RDONLY);
+  if (input < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(input, &info) < 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(kMagic)) {
+    close(input);
+    return false;
+  }
+  size_t size = info.st_size;
+  void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input, 0);
+  close(input);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  madvise(mapped, size, MADV_SEQUENTIAL);
+  const char* data = static_cast<const char*>(mapped);
+  const char* end = data + size;
+  bool intact = memcmp(data, kMagic, sizeof(kMagic)) == 0;
+  const char* next = data + sizeof(kMagic);
+  while (intact && next < end) {
+    unsigned int length;
+    unsigned int sum;
+    const char* payload = next;
+    if (!StateStore::getU32(payload, end, length) ||
+        !StateStore::getU32(payload, end, sum) ||
+        static_cast<size_t>(end - payload) < length ||
+        StateStore::checksum(payload, length) != sum || length < 9) {
+      intact = false;
+      break;
+    }
+    const char* recordEnd = payload + length;
+    Record record;
+    unsigned int low;
+    unsigned int high;
+    record.type = *payload++;
+    if (!StateStore::getU32(payload, recordEnd, low) ||
+        !StateStore::getU32(payload, recordEnd, high) ||
+        !getField(payload, recordEnd, record.source) ||
+        !getField(payload, recordEnd, record.target) ||
+        !getField(payload, recordEnd, record.text) || payload != recordEnd) {
+      intact = false;
+      break;
+    }
+    record.time = (static_cast<unsigned long long>(high) << 32) | low;
+    visit(record, context);
+    next = recordEnd;
+  }
+  munmap(mapped, size);
+  return intact;
+}
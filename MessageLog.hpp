@@ -0,0 +1,93 @@
+#ifndef MESSAGELOG_HPP
+#define MESSAGELOG_HPP
+
+#include <pthread.h>
+
+#include <string>
+
+// Compliance archive of routed traffic (ircserv -l <dir>[:MB]). Every
+// PRIVMSG and NOTICE the server delivers, and every JOIN, PART, KICK and
+// QUIT, becomes one record: a type byte, the time in microseconds, then the
+// source prefix, target and text as length-prefixed strings, framed with a
+// length and checksum as in StateStore. The loop appends records to a
+// buffer without locking and hands it to a writer thread once per
+// iteration; the writer writes whatever has queued up and calls fdatasync
+// once per round, at most one round per kCommitInterval (group commit).
+// Files are <dir>/messages.NNNNNN.log; once one passes the size limit the
+// next round starts a new one. A round whose write fails (ENOSPC, EIO) is
+// cut off the file again, or the file is abandoned for a new one, and a gap
+// record counts its records. irclog maps the files to search them.
+class MessageLog {
+ public:
+  static const char kPrivmsg = 'P';
+  static const char kNotice = 'N';
+  static const char kJoin = 'J';
+  static const char kPart = 'L';
+  static const char kKick = 'K';   // Text is the nick kicked
+  static const char kQuit = 'Q';   // One per channel the user was in
+  static const char kGap = 'G';    // Text is the number of records dropped
+  static const size_t kDefaultFileBytes = 64 * 1024 * 1024;
+  static const size_t kMaxQueued = 64 * 1024 * 1024;  // Then records drop
+  static const unsigned kCommitInterval = 1000;  // Microseconds per round
+
+  // A record inside a mapped file; the fields point into the mapping.
+  struct Field {
+    const char* data;
+    size_t size;
+  };
+  struct Record {
+    char type;
+    unsigned long long time;  // Microseconds since the epoch
+    Field source;
+    Field target;
+    Field text;
+  };
+  typedef void (*Visitor)(const Record& record, void* context);
+
+  MessageLog(const std::string& directory, size_t fileBytes);
+  ~MessageLog();
+
+  bool start();
+  void record(char type, const std::string& source, const std::string& target,
+              const std::string& text);
+  void flush();  // Once per loop iteration
+
+  // Map the file at path and call visit for each record in order. Returns
+  // false if it is not a message log or ends in a torn or corrupt record
+  // (everything before it is still visited).
+  static bool scan(const std::string& path, Visitor visit, void* context);
+
+ private:
+  MessageLog(const MessageLog&);
+  MessageLog& operator=(const MessageLog&);
+
+  static void* writerMain(void* arg);
+  void writerLoop();
+  bool openNextFile();
+  bool writeAll(const std::string& data);
+  static size_t seal(std::string& data);
+
+  std::string directory;
+  size_t fileBytes;  // Rotate once a file holds this much
+
+  // Loop thread
+  std::string pending;     // Records since the last flush, unsealed
+  size_t pendingRecords;
+  unsigned long dropped;   // Records lost while the writer was behind
+
+  // Writer thread
+  int fd;
+  unsigned int fileNumber;
+  size_t written;  // Bytes in the current file
+  bool torn;       // The file ends in a partial write that could not be cut
+  unsigned long lost;  // Records in rounds that failed to write
+
+  pthread_t writer;
+  bool writerStarted;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+  std::string queued;  // Guarded by mutex
+  bool stopping;       // Guarded by mutex
+};
+
+#endif
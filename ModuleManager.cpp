@@ -0,0 +1,154 @@
+#include "ModuleManager.hpp"
+
+#include <dlfcn.h>
+#include <time.h>
+
+#include <iostream>
+#include <sstream>
+
+#include "ClientHandler.hpp"
+
+typedef bool (*ModuleInit)(ModuleManager& modules);
+
+static unsigned long long monotonicNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+ModuleManager::ModuleManager(IRCServer* server) : server(server) {}
+
+ModuleManager::~ModuleManager() {
+  for (size_t i = 0; i < handles.size(); ++i) {
+    dlclose(handles[i]);
+  }
+}
+
+// Open path and run its ircModuleInit. Hooks it registers are named after
+// the file, without directory or ".so".
+bool ModuleManager::load(const std::string& path) {
+  void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    std::cerr << "Cannot load module: " << dlerror() << std::endl;
+    return false;
+  }
+  ModuleInit init =
+      reinterpret_cast<ModuleInit>(dlsym(handle, "ircModuleInit"));
+  if (init == NULL) {
+    std::cerr << "No ircModuleInit in " << path << std::endl;
+    dlclose(handle);
+    return false;
+  }
+  handles.push_back(handle);
+  loading = path.substr(path.rfind('/') + 1);
+  if (loading.size() > 3 &&
+      loading.compare(loading.size() - 3, 3, ".so") == 0) {
+    loading.erase(loading.size() - 3);
+  }
+  bool started = init(*this);
+  if (started) {
+    std::cout << "Loaded module " << loading << std::endl;
+  } else {
+    std::cerr << "Module " << loading << " failed to start." << std::endl;
+  }
+  loading.clear();
+  return started;
+}
+
+IRCServer* ModuleManager::getServer() { return server; }
+
+void ModuleManager::addCommandHook(const std::string& command,
+                                   CommandHook hook, void* context) {
+  addHook(command, context).command = hook;
+  commandHooks[command].push_back(hooks.size() - 1);
+}
+
+void ModuleManager::addChannelHook(ChannelHook hook, void* context) {
+  addHook("channel", context).channel = hook;
+  channelHooks.push_back(hooks.size() - 1);
+}
+
+// Hooks for this command first, then the "*" hooks, in registration order.
+// The first kDrop ends the run.
+ModuleManager::Verdict ModuleManager::runCommandHooks(
+    ClientHandler* client, const std::string& command,
+    const std::string& parameters) {
+  const char* targets[2] = {command.c_str(), "*"};
+  for (int t = 0; t < 2; ++t) {
+    std::map<std::string, std::vector<size_t> >::iterator it =
+        commandHooks.find(targets[t]);
+    if (it == commandHooks.end()) {
+      continue;
+    }
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      Hook& hook = hooks[it->second[i]];
+      unsigned long long started = monotonicNanoseconds();
+      Verdict verdict =
+          hook.command(client, command, parameters, hook.context);
+      account(hook, started, verdict);
+      if (verdict == kDrop) {
+        return kDrop;
+      }
+    }
+  }
+  return kPass;
+}
+
+ModuleManager::Verdict ModuleManager::runChannelHooks(Channel* channel,
+                                                      const std::string& line,
+                                                      ClientHandler* sender) {
+  for (size_t i = 0; i < channelHooks.size(); ++i) {
+    Hook& hook = hooks[channelHooks[i]];
+    unsigned long long started = monotonicNanoseconds();
+    Verdict verdict = hook.channel(channel, line, sender, hook.context);
+    account(hook, started, verdict);
+    if (verdict == kDrop) {
+      return kDrop;
+    }
+  }
+  return kPass;
+}
+
+// One 249 line per hook: calls, drops, total and worst time.
+void ModuleManager::sendStats(ClientHandler* client) const {
+  for (size_t i = 0; i < hooks.size(); ++i) {
+    const Hook& hook = hooks[i];
+    std::ostringstream line;
+    line << ":Server 249 " << client->getNickname() << " M :"
+         << hook.module << " " << hook.target << " calls " << hook.calls
+         << " dropped " << hook.drops << " total "
+         << hook.nanoseconds / 1000 << "us avg "
+         << (hook.calls ? hook.nanoseconds / hook.calls : 0) << "ns max "
+         << hook.slowest / 1000 << "us";
+    client->sendMessage(line.str());
+  }
+}
+
+ModuleManager::Hook& ModuleManager::addHook(const std::string& target,
+                                            void* context) {
+  Hook hook;
+  hook.module = loading;
+  hook.target = target;
+  hook.command = NULL;
+  hook.channel = NULL;
+  hook.context = context;
+  hook.calls = 0;
+  hook.drops = 0;
+  hook.nanoseconds = 0;
+  hook.slowest = 0;
+  hooks.push_back(hook);
+  return hooks.back();
+}
+
+void ModuleManager::account(Hook& hook, unsigned long long started,
+                            Verdict verdict) {
+  unsigned long long spent = monotonicNanoseconds() - started;
+  ++hook.calls;
+  hook.nanoseconds += spent;
+  if (spent > hook.slowest) {
+    hook.slowest = spent;
+  }
+  if (verdict == kDrop) {
+    ++hook.drops;
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef MODULEMANAGER_HPP
+#define MODULEMANAGER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+class Channel;
+class ClientHandler;
+class IRCServer;
+
+// In-process extensions loaded from shared objects (ircserv -M <file.so>).
+// A module exports
+//   extern "C" bool ircModuleInit(ModuleManager& modules);
+// and registers its hooks from there. A command hook sees a client's command
+// and parameters as parseCommand splits them, before the server acts on
+// them; a channel hook sees each PRIVMSG and NOTICE line a channel is about
+// to queue for the members. Returning kDrop stops the command or the
+// message. With no hooks of a kind registered, the server only tests an
+// empty container. Calls and time are counted per hook for STATS M.
+// Modules are built against these headers with the server's compiler,
+// call back into the server directly, and stay loaded until it exits.
+class ModuleManager {
+ public:
+  enum Verdict { kPass, kDrop };
+  typedef Verdict (*CommandHook)(ClientHandler* client,
+                                 const std::string& command,
+                                 const std::string& parameters,
+                                 void* context);
+  typedef Verdict (*ChannelHook)(Channel* channel, const std::string& line,
+                                 ClientHandler* sender, void* context);
+
+  ModuleManager(IRCServer* server);
+  ~ModuleManager();
+
+  bool load(const std::string& path);
+  IRCServer* getServer();
+
+  // For ircModuleInit. command "*" sees every command.
+  void addCommandHook(const std::string& command, CommandHook hook,
+                      void* context);
+  void addChannelHook(ChannelHook hook, void* context);
+
+  bool hasCommandHooks() const { return !commandHooks.empty(); }
+  bool hasChannelHooks() const { return !channelHooks.empty(); }
+  Verdict runCommandHooks(ClientHandler* client, const std::string& command,
+                          const std::string& parameters);
+  Verdict runChannelHooks(Channel* channel, const std::string& line,
+                          ClientHandler* sender);
+
+  void sendStats(ClientHandler* client) const;  // STATS M
+
+ private:
+  ModuleManager(const ModuleManager&);
+  ModuleManager& operator=(const ModuleManager&);
+
+  struct Hook {
+    std::string module;
+    std::string target;  // Command name, or "channel"
+    CommandHook command;
+    ChannelHook channel;
+    void* context;
+    unsigned long calls;
+    unsigned long drops;
+    unsigned long long nanoseconds;
+    unsigned long long slowest;
+  };
+
+  Hook& addHook(const std::string& target, void* context);
+  static void account(Hook& hook, unsigned long long started,
+                      Verdict verdict);
+
+  IRCServer* server;
+  std::vector<void*> handles;  // dlopen handles, closed on exit
+  std::string loading;         // Module whose ircModuleInit is running
+  std::vector<Hook> hooks;     // Registration order
+  std::map<std::string, std::vector<size_t> > commandHooks;
+  std::vector<size_t> channelHooks;
+};
+
+#endif
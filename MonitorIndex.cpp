@@ -0,0 +1,211 @@
+#include "MonitorIndex.hpp"
+
+#include <sstream>
+
+#include "ClientHandler.hpp"
+#include "IRCServer.hpp"
+#include "WildcardMask.hpp"
+
+// Longest list of nicks or masks in one 730-732 reply line
+static const size_t kReplyLength = 400;
+
+MonitorIndex::MonitorIndex(IRCServer* server) : server(server) {}
+
+// MONITOR + nick{,nick}: replies with which of the new targets are online.
+// Targets past the limit are refused with 734 and not added.
+void MonitorIndex::add(ClientHandler* watcher, const std::string& targets) {
+  WatchList& watches = watching[watcher];
+  std::vector<std::string> online;
+  std::vector<std::string> offline;
+  std::istringstream targetStream(targets);
+  std::string target;
+  while (std::getline(targetStream, target, ',')) {
+    if (target.empty()) {
+      continue;
+    }
+    InternedString folded = WildcardMask::fold(target);
+    bool watched = false;
+    for (size_t i = 0; i < watches.size() && !watched; ++i) {
+      watched = watches[i].target == folded;
+    }
+    if (watched) {
+      continue;
+    }
+    if (watches.size() >= kMaxTargets) {
+      std::string rest = target;
+      std::string next;
+      while (std::getline(targetStream, next, ',')) {
+        rest += "," + next;
+      }
+      std::ostringstream limit;
+      limit << kMaxTargets;
+      watcher->sendMessage(":Server 734 " + watcher->getNickname() + " " +
+                           limit.str() + " " + rest +
+                           " :Monitor list is full.");
+      break;
+    }
+    std::vector<ClientHandler*>& list = watchers[folded];
+    Watch watch;
+    watch.target = folded;
+    watch.slot = list.size();
+    list.push_back(watcher);
+    watches.push_back(watch);
+    ClientHandler* user = server->getUserIndex().findNick(target);
+    if (user) {
+      online.push_back(user->getPrefix());
+    } else {
+      offline.push_back(target);
+    }
+  }
+  if (watches.empty()) {
+    watching.erase(watcher);
+  }
+  reply(watcher, "730", online);
+  reply(watcher, "731", offline);
+}
+
+void MonitorIndex::remove(ClientHandler* watcher, const std::string& targets) {
+  std::map<ClientHandler*, WatchList>::iterator it = watching.find(watcher);
+  if (it == watching.end()) {
+    return;
+  }
+  std::istringstream targetStream(targets);
+  std::string target;
+  while (std::getline(targetStream, target, ',')) {
+    std::string folded = WildcardMask::fold(target);
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      if (it->second[i].target == folded) {
+        unwatch(watcher, it->second, i);
+        break;
+      }
+    }
+  }
+  if (it->second.empty()) {
+    watching.erase(it);
+  }
+}
+
+void MonitorIndex::clear(ClientHandler* watcher) {
+  std::map<ClientHandler*, WatchList>::iterator it = watching.find(watcher);
+  if (it == watching.end()) {
+    return;
+  }
+  while (!it->second.empty()) {
+    unwatch(watcher, it->second, it->second.size() - 1);
+  }
+  watching.erase(it);
+}
+
+void MonitorIndex::list(ClientHandler* watcher) {
+  std::vector<std::string> targets;
+  std::map<ClientHandler*, WatchList>::iterator it = watching.find(watcher);
+  if (it != watching.end()) {
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      targets.push_back(it->second[i].target);
+    }
+  }
+  reply(watcher, "732", targets);
+  watcher->sendMessage(":Server 733 " + watcher->getNickname() +
+                       " :End of MONITOR list");
+}
+
+void MonitorIndex::status(ClientHandler* watcher) {
+  std::vector<std::string> online;
+  std::vector<std::string> offline;
+  std::map<ClientHandler*, WatchList>::iterator it = watching.find(watcher);
+  if (it != watching.end()) {
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      ClientHandler* user =
+          server->getUserIndex().findNick(it->second[i].target);
+      if (user) {
+        online.push_back(user->getPrefix());
+      } else {
+        offline.push_back(it->second[i].target);
+      }
+    }
+  }
+  reply(watcher, "730", online);
+  reply(watcher, "731", offline);
+}
+
+// user is now registered under nick (its nickname field may still hold the
+// old one during a NICK change).
+void MonitorIndex::userOnline(ClientHandler* user, const std::string& nick) {
+  InternedString folded;
+  if (!InternedString::find(WildcardMask::fold(nick), folded)) {
+    return;
+  }
+  Watchers::iterator it = watchers.find(folded);
+  if (it == watchers.end()) {
+    return;
+  }
+  std::string mask = " :" + nick + "!" + user->getUsername() + "@" +
+                     user->getHostname();
+  for (size_t i = 0; i < it->second.size(); ++i) {
+    ClientHandler* watcher = it->second[i];
+    watcher->sendMessage(":Server 730 " + watcher->getNickname() + mask);
+  }
+}
+
+void MonitorIndex::userOffline(const std::string& nick) {
+  InternedString folded;
+  if (!InternedString::find(WildcardMask::fold(nick), folded)) {
+    return;
+  }
+  Watchers::iterator it = watchers.find(folded);
+  if (it == watchers.end()) {
+    return;
+  }
+  for (size_t i = 0; i < it->second.size(); ++i) {
+    ClientHandler* watcher = it->second[i];
+    watcher->sendMessage(":Server 731 " + watcher->getNickname() + " :" +
+                         nick);
+  }
+}
+
+// Drop watches[index]. The nick's last watcher moves into the freed slot,
+// and its own record of that slot is updated.
+void MonitorIndex::unwatch(ClientHandler* watcher, WatchList& watches,
+                           size_t index) {
+  Watch& watch = watches[index];
+  Watchers::iterator it = watchers.find(watch.target);
+  std::vector<ClientHandler*>& list = it->second;
+  ClientHandler* moved = list.back();
+  list[watch.slot] = moved;
+  list.pop_back();
+  if (moved != watcher) {
+    WatchList& movedWatches = watching[moved];
+    for (size_t i = 0; i < movedWatches.size(); ++i) {
+      if (movedWatches[i].target == watch.target) {
+        movedWatches[i].slot = watch.slot;
+        break;
+      }
+    }
+  }
+  if (list.empty()) {
+    watchers.erase(it);
+  } else if (list.size() * 4 < list.capacity()) {
+    std::vector<ClientHandler*>(list).swap(list);  // Give back spare room
+  }
+  watches[index] = watches.back();
+  watches.pop_back();
+}
+
+// One or more "<numeric> <nick> :a,b,c" lines, each list kept short enough
+// for the 512-byte line limit.
+void MonitorIndex::reply(ClientHandler* watcher, const std::string& numeric,
+                         const std::vector<std::string>& items) {
+  std::string line;
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (!line.empty() && line.size() + items[i].size() >= kReplyLength) {
+      watcher->sendMessage(":Server " + numeric + " " +
+                           watcher->getNickname() + " :" + line);
+      line.clear();
+    }
+    line += (line.empty() ? "" : ",") + items[i];
+  }
+  if (!line.empty()) {
+    watcher->sendMessage(":Server " + numeric + " " + watcher->getNickname() +
+                         " :" + line);
+  }
+}
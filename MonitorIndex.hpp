@@ -0,0 +1,52 @@
+#ifndef MONITORINDEX_HPP
+#define MONITORINDEX_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "InternedString.hpp"
+
+class ClientHandler;
+class IRCServer;
+
+// IRCv3 MONITOR: a client watches up to kMaxTargets nicks and is told when
+// one comes online (730) or goes offline (731). Each watched nick maps to
+// the clients watching it, so a nick change reaches exactly those clients.
+// Targets are case-folded and interned. One watch costs an entry on each
+// side: the target handle plus its slot in the nick's watcher list, and
+// the watcher pointer in that list. Removing one swaps the last watcher
+// into the slot, so it costs O(kMaxTargets) however popular the nick is.
+class MonitorIndex {
+ public:
+  static const size_t kMaxTargets = 100;
+
+  MonitorIndex(IRCServer* server);
+
+  void add(ClientHandler* watcher, const std::string& targets);     // +
+  void remove(ClientHandler* watcher, const std::string& targets);  // -
+  void clear(ClientHandler* watcher);  // C, and when the watcher leaves
+  void list(ClientHandler* watcher);   // L
+  void status(ClientHandler* watcher);  // S
+
+  void userOnline(ClientHandler* user, const std::string& nick);
+  void userOffline(const std::string& nick);
+
+ private:
+  struct Watch {
+    InternedString target;
+    size_t slot;  // Position in watchers[target]
+  };
+  typedef std::vector<Watch> WatchList;
+  typedef std::map<InternedString, std::vector<ClientHandler*> > Watchers;
+
+  void unwatch(ClientHandler* watcher, WatchList& watches, size_t index);
+  void reply(ClientHandler* watcher, const std::string& numeric,
+             const std::vector<std::string>& items);
+
+  IRCServer* server;
+  std::map<ClientHandler*, WatchList> watching;
+  Watchers watchers;
+};
+
+#endif
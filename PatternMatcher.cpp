@@ -0,0 +1,260 @@
+#include "PatternMatcher.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <queue>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PATTERNMATCHER_X86 1
+#endif
+
+// A transition is the next state's row offset (state * classes), with the
+// top bit set when a pattern ends there.
+static const unsigned kAccept = 0x80000000u;
+
+// A skip shorter than kSkipWorthwhile bytes did not pay for itself (most
+// letters start some pattern in a long list), so the automaton walks the
+// next kSkipPause bytes before trying again.
+static const size_t kSkipWorthwhile = 16;
+static const size_t kSkipPause = 256;
+
+typedef size_t (*SkipFunction)(const unsigned char* startBits,
+                               const char* text, size_t position,
+                               size_t length);
+
+static bool isStart(const unsigned char* startBits, unsigned char byte) {
+  return byte < 128 && (startBits[byte & 15] >> (byte >> 4) & 1);
+}
+
+static size_t skipScalar(const unsigned char* startBits, const char* text,
+                         size_t position, size_t length) {
+  while (position < length &&
+         !isStart(startBits, static_cast<unsigned char>(text[position]))) {
+    ++position;
+  }
+  return position;
+}
+
+#ifdef PATTERNMATCHER_X86
+// Each byte's low nibble picks a row of high nibbles that start a pattern,
+// and its high nibble picks the bit to test in that row (none for 8-15,
+// which are the non-ASCII bytes).
+__attribute__((target("ssse3"))) static size_t skipSsse3(
+    const unsigned char* startBits, const char* text, size_t position,
+    size_t length) {
+  const __m128i rows =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(startBits));
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0,
+                                     0, 0, 0, 0, 0);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i zero = _mm_setzero_si128();
+  for (; position + 16 <= length; position += 16) {
+    __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + position));
+    __m128i row = _mm_shuffle_epi8(rows, _mm_and_si128(block, nibble));
+    __m128i bit = _mm_shuffle_epi8(
+        bits, _mm_and_si128(_mm_srli_epi16(block, 4), nibble));
+    unsigned misses = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_and_si128(row, bit), zero));
+    if (misses != 0xffff) {
+      return position + __builtin_ctz(~misses);
+    }
+  }
+  return skipScalar(startBits, text, position, length);
+}
+
+__attribute__((target("avx2"))) static size_t skipAvx2(
+    const unsigned char* startBits, const char* text, size_t position,
+    size_t length) {
+  const __m256i rows = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(startBits)));
+  const __m256i bits = _mm256_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16,
+      32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  for (; position + 32 <= length; position += 32) {
+    __m256i block = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(text + position));
+    __m256i row = _mm256_shuffle_epi8(rows, _mm256_and_si256(block, nibble));
+    __m256i bit = _mm256_shuffle_epi8(
+        bits, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+    unsigned misses = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), zero));
+    if (misses != 0xffffffffu) {
+      return position + __builtin_ctz(~misses);
+    }
+  }
+  return skipScalar(startBits, text, position, length);
+}
+#endif
+
+static SkipFunction chooseSkip() {
+#ifdef PATTERNMATCHER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return skipAvx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return skipSsse3;
+  }
+#endif
+  return skipScalar;
+}
+
+static const SkipFunction chosenSkip = chooseSkip();
+
+static unsigned char lower(unsigned char byte) {
+  return byte >= 'A' && byte <= 'Z' ? byte + ('a' - 'A') : byte;
+}
+
+PatternMatcher::PatternMatcher() : classes(1), canSkip(true) {
+  std::memset(byteClass, 0, sizeof(byteClass));
+  std::memset(startBits, 0, sizeof(startBits));
+}
+
+// Add each non-empty line of path, then compile.
+bool PatternMatcher::load(const std::string& path) {
+  std::ifstream file(path.c_str());
+  if (!file) {
+    std::cerr << "Cannot read patterns from " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    add(line);
+  }
+  compile();
+  std::cout << "Loaded " << patterns.size() << " content filter patterns"
+            << std::endl;
+  return true;
+}
+
+void PatternMatcher::add(const std::string& pattern) {
+  if (pattern.empty()) {
+    return;
+  }
+  std::string folded(pattern);
+  for (size_t i = 0; i < folded.size(); ++i) {
+    folded[i] = lower(folded[i]);
+  }
+  patterns.push_back(folded);
+}
+
+// Byte classes first (case pairs share one), then the trie, then failure
+// links breadth first, filling in every missing transition on the way.
+void PatternMatcher::compile() {
+  std::memset(byteClass, 0, sizeof(byteClass));
+  std::memset(startBits, 0, sizeof(startBits));
+  classes = 1;
+  canSkip = true;
+  for (size_t p = 0; p < patterns.size(); ++p) {
+    for (size_t i = 0; i < patterns[p].size(); ++i) {
+      unsigned char byte = patterns[p][i];
+      if (byteClass[byte] == 0) {
+        byteClass[byte] = classes;
+        if (byte >= 'a' && byte <= 'z') {
+          byteClass[byte - ('a' - 'A')] = classes;
+        }
+        ++classes;
+      }
+    }
+    unsigned char first = patterns[p][0];
+    unsigned char cases[2] = {first, first};
+    if (first >= 'a' && first <= 'z') {
+      cases[1] = first - ('a' - 'A');
+    }
+    for (int c = 0; c < 2; ++c) {
+      if (cases[c] >= 128) {
+        canSkip = false;
+      } else {
+        startBits[cases[c] & 15] |= 1 << (cases[c] >> 4);
+      }
+    }
+  }
+
+  next.assign(classes, 0);
+  std::vector<bool> ends(1, false);
+  for (size_t p = 0; p < patterns.size(); ++p) {
+    size_t state = 0;
+    for (size_t i = 0; i < patterns[p].size(); ++i) {
+      unsigned& edge = next[state * classes +
+                            byteClass[static_cast<unsigned char>(
+                                patterns[p][i])]];
+      if (edge == 0) {
+        edge = ends.size();
+        ends.push_back(false);
+        next.resize(ends.size() * classes, 0);
+      }
+      state = next[state * classes +
+                   byteClass[static_cast<unsigned char>(patterns[p][i])]];
+    }
+    ends[state] = true;
+  }
+
+  std::vector<unsigned> fail(ends.size(), 0);
+  std::queue<unsigned> pending;
+  for (size_t c = 0; c < classes; ++c) {
+    if (next[c] != 0) {
+      pending.push(next[c]);
+    }
+  }
+  while (!pending.empty()) {
+    unsigned state = pending.front();
+    pending.pop();
+    ends[state] = ends[state] || ends[fail[state]];
+    for (size_t c = 0; c < classes; ++c) {
+      unsigned& edge = next[state * classes + c];
+      unsigned fallback = next[fail[state] * classes + c];
+      if (edge != 0) {
+        fail[edge] = fallback;
+        pending.push(edge);
+      } else {
+        edge = fallback;
+      }
+    }
+  }
+  for (size_t i = 0; i < next.size(); ++i) {
+    next[i] = next[i] * classes | (ends[next[i]] ? kAccept : 0);
+  }
+}
+
+bool PatternMatcher::empty() const { return patterns.empty(); }
+
+size_t PatternMatcher::size() const { return patterns.size(); }
+
+bool PatternMatcher::matches(const char* text, size_t length) const {
+  if (patterns.empty()) {
+    return false;
+  }
+  size_t row = 0;
+  size_t skipFrom = canSkip ? 0 : length;
+  for (size_t i = 0; i < length; ++i) {
+    if (i >= skipFrom && row == 0) {
+      size_t start = chosenSkip(startBits, text, i, length);
+      if (start == length) {
+        return false;
+      }
+      if (start - i < kSkipWorthwhile) {
+        skipFrom = start + kSkipPause;  // Start bytes are common here
+      }
+      i = start;
+    }
+    unsigned edge =
+        next[row + byteClass[static_cast<unsigned char>(text[i])]];
+    if (edge & kAccept) {
+      return true;
+    }
+    row = edge;
+  }
+  return false;
+}
+
+bool PatternMatcher::matches(const std::string& text) const {
+  return matches(text.data(), text.size());
+}
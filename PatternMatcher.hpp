@@ -0,0 +1,37 @@
+#ifndef PATTERNMATCHER_HPP
+#define PATTERNMATCHER_HPP
+
+#include <string>
+#include <vector>
+
+// Finds any of a list of literal patterns in a text, ignoring ASCII case
+// (ircserv -P <file>, checked against every PRIVMSG and NOTICE). The
+// patterns are compiled into an Aho-Corasick automaton stored as a full
+// transition table over byte classes, so each byte of text costs one table
+// lookup however many patterns there are. While the automaton is back at
+// its start, a 16- or 32-byte shuffle test skips to the next byte that
+// begins some pattern.
+class PatternMatcher {
+ public:
+  PatternMatcher();
+
+  bool load(const std::string& path);  // One pattern per line
+  void add(const std::string& pattern);
+  void compile();  // After the last add
+
+  bool empty() const;
+  size_t size() const;
+  bool matches(const char* text, size_t length) const;
+  bool matches(const std::string& text) const;
+
+ private:
+  std::vector<std::string> patterns;  // Lowercase
+  unsigned char byteClass[256];       // 0 for bytes in no pattern
+  size_t classes;
+  std::vector<unsigned> next;         // state * classes + class -> state
+  unsigned char startBits[16];  // Low nibble -> high nibbles (0-7) that
+                                // start a pattern
+  bool canSkip;                 // Every pattern starts with an ASCII byte
+};
+
+#endif
@@ -0,0 +1,486 @@
+#include "Resolver.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+static const unsigned short kTypeA = 1;
+static const unsigned short kTypePtr = 12;
+static const unsigned short kClassIn = 1;
+static const size_t kMaxHostname = 63;  // What fits in a WHO reply's host
+
+static unsigned long long monotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+static void putU16(std::string& out, unsigned value) {
+  out += static_cast<char>(value >> 8);
+  out += static_cast<char>(value & 0xff);
+}
+
+static unsigned getU16(const unsigned char* data) {
+  return data[0] << 8 | data[1];
+}
+
+// Labels of name, each behind its length, then the root label.
+static bool putName(std::string& out, const std::string& name) {
+  std::istringstream labels(name);
+  std::string label;
+  while (std::getline(labels, label, '.')) {
+    if (label.empty() || label.size() > 63) {
+      return false;
+    }
+    out += static_cast<char>(label.size());
+    out += label;
+  }
+  out += '\0';
+  return true;
+}
+
+// The name at offset, following compression pointers (a bounded number of
+// them, so a pointer loop cannot hang the thread). offset moves past the
+// name as it appears at that spot.
+static bool readName(const unsigned char* packet, size_t length,
+                     size_t& offset, std::string& name) {
+  name.clear();
+  size_t position = offset;
+  bool jumped = false;
+  for (int hops = 0; hops < 32; ++hops) {
+    if (position >= length) {
+      return false;
+    }
+    unsigned labelLength = packet[position];
+    if ((labelLength & 0xc0) == 0xc0) {
+      if (position + 1 >= length) {
+        return false;
+      }
+      if (!jumped) {
+        offset = position + 2;
+        jumped = true;
+      }
+      position = (labelLength & 0x3f) << 8 | packet[position + 1];
+      continue;
+    }
+    if (labelLength == 0) {
+      if (!jumped) {
+        offset = position + 1;
+      }
+      return true;
+    }
+    if ((labelLength & 0xc0) != 0 || position + 1 + labelLength > length) {
+      return false;
+    }
+    if (!name.empty()) {
+      name += '.';
+    }
+    name.append(reinterpret_cast<const char*>(packet + position + 1),
+                labelLength);
+    position += 1 + labelLength;
+  }
+  return false;
+}
+
+static bool sameName(const std::string& a, const std::string& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Letters, digits, '-' and '.', as a hostname may hold: anything else
+// would end up inside protocol lines.
+static bool isValidHostname(const std::string& name) {
+  if (name.empty() || name.size() > kMaxHostname || name[0] == '.' ||
+      name[0] == '-') {
+    return false;
+  }
+  for (size_t i = 0; i < name.size(); ++i) {
+    unsigned char c = name[i];
+    if (!std::isalnum(c) && c != '-' && c != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::string reverseName(unsigned int address) {
+  std::ostringstream name;
+  name << (address & 0xff) << "." << (address >> 8 & 0xff) << "."
+       << (address >> 16 & 0xff) << "." << (address >> 24) << ".in-addr.arpa";
+  return name.str();
+}
+
+static void wake(int fd) {
+  char byte = 0;
+  ssize_t written = write(fd, &byte, 1);
+  (void)written;  // A full pipe already has a wakeup pending
+}
+
+static void drain(int fd) {
+  char buffer[64];
+  while (read(fd, buffer, sizeof(buffer)) > 0) {
+  }
+}
+
+static bool openPipe(int fds[2]) {
+  return pipe(fds) == 0 && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0 &&
+         fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0;
+}
+
+Resolver::Resolver()
+    : lastRequest(0),
+      udpSocket(-1),
+      seed(0),
+      threadStarted(false),
+      stopping(false) {
+  std::memset(&serverAddress, 0, sizeof(serverAddress));
+  wakePipe[0] = wakePipe[1] = -1;
+  notifyPipe[0] = notifyPipe[1] = -1;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Resolver::~Resolver() {
+  if (threadStarted) {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_mutex_unlock(&mutex);
+    wake(wakePipe[1]);
+    pthread_join(thread, NULL);
+  }
+  int fds[5] = {udpSocket, wakePipe[0], wakePipe[1], notifyPipe[0],
+                notifyPipe[1]};
+  for (int i = 0; i < 5; ++i) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  pthread_mutex_destroy(&mutex);
+}
+
+bool Resolver::start(const std::string& server) {
+  size_t colon = server.find(':');
+  std::string host = server.substr(0, colon);
+  int port = 53;
+  if (colon != std::string::npos) {
+    std::istringstream iss(server.substr(colon + 1));
+    iss >> port;
+    if (iss.fail() || !iss.eof() || port <= 0 || port > 65535) {
+      std::cerr << "Bad DNS server port: " << server << std::endl;
+      return false;
+    }
+  }
+  serverAddress.sin_family = AF_INET;
+  serverAddress.sin_port = htons(port);
+  if (inet_pton(AF_INET, host.c_str(), &serverAddress.sin_addr) != 1) {
+    std::cerr << "Bad DNS server address: " << server << std::endl;
+    return false;
+  }
+  // connect() makes the kernel drop datagrams from anyone but the server,
+  // and the ephemeral source port makes answers harder to forge
+  udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (udpSocket < 0 ||
+      connect(udpSocket, reinterpret_cast<struct sockaddr*>(&serverAddress),
+              sizeof(serverAddress)) < 0 ||
+      fcntl(udpSocket, F_SETFL, O_NONBLOCK) < 0 || !openPipe(wakePipe) ||
+      !openPipe(notifyPipe)) {
+    std::cerr << "Failed to set up the resolver socket." << std::endl;
+    return false;
+  }
+  seed = time(NULL) ^ getpid();
+  if (pthread_create(&thread, NULL, resolverMain, this) != 0) {
+    std::cerr << "Failed to start the resolver thread." << std::endl;
+    return false;
+  }
+  threadStarted = true;
+  return true;
+}
+
+bool Resolver::isRunning() const { return threadStarted; }
+
+int Resolver::getNotifyFd() const { return notifyPipe[0]; }
+
+bool Resolver::find(unsigned int address, std::string& hostname) {
+  std::map<unsigned int, CacheEntry>::iterator it = cache.find(address);
+  if (it == cache.end()) {
+    return false;
+  }
+  if (it->second.expires <= monotonicMs()) {
+    cache.erase(it);
+    return false;
+  }
+  hostname = it->second.hostname;
+  return true;
+}
+
+unsigned long Resolver::submit(unsigned int address) {
+  std::map<unsigned int, unsigned long>::iterator it = inFlight.find(address);
+  if (it != inFlight.end()) {
+    return it->second;
+  }
+  Query query;
+  query.request = ++lastRequest;
+  query.address = address;
+  query.forward = false;
+  query.ttl = kMaxTtl;
+  query.attempts = 0;
+  query.deadline = 0;
+  inFlight[address] = query.request;
+  pthread_mutex_lock(&mutex);
+  bool wasEmpty = lookups.empty();
+  lookups.push_back(query);
+  pthread_mutex_unlock(&mutex);
+  if (wasEmpty) {
+    wake(wakePipe[1]);
+  }
+  return query.request;
+}
+
+// Empty the pipe before taking the answers: one queued after the swap
+// finds the list empty again and writes a new byte.
+void Resolver::takeResults(std::vector<Result>& results) {
+  drain(notifyPipe[0]);
+  std::vector<Answer> taken;
+  pthread_mutex_lock(&mutex);
+  taken.swap(answers);
+  pthread_mutex_unlock(&mutex);
+
+  unsigned long long now = monotonicMs();
+  for (size_t i = 0; i < taken.size(); ++i) {
+    if (cache.size() >= kMaxCached) {
+      std::map<unsigned int, CacheEntry>::iterator it = cache.begin();
+      while (it != cache.end()) {
+        if (it->second.expires <= now) {
+          cache.erase(it++);
+        } else {
+          ++it;
+        }
+      }
+      if (cache.size() >= kMaxCached) {
+        cache.erase(cache.begin());
+      }
+    }
+    CacheEntry& entry = cache[taken[i].address];
+    entry.hostname = taken[i].hostname;
+    entry.expires = now + taken[i].ttl * 1000ULL;
+    inFlight.erase(taken[i].address);
+
+    Result result;
+    result.request = taken[i].request;
+    result.address = taken[i].address;
+    result.hostname = taken[i].hostname;
+    results.push_back(result);
+  }
+}
+
+void* Resolver::resolverMain(void* arg) {
+  static_cast<Resolver*>(arg)->resolverLoop();
+  return NULL;
+}
+
+// Sleep until a lookup is queued, an answer arrives or the earliest query
+// times out; a query that timed out kAttempts times fails.
+void Resolver::resolverLoop() {
+  while (true) {
+    int timeout = -1;
+    unsigned long long now = monotonicMs();
+    for (std::map<unsigned short, Query>::iterator it = queries.begin();
+         it != queries.end(); ++it) {
+      int left = it->second.deadline > now ? it->second.deadline - now : 0;
+      if (timeout < 0 || left < timeout) {
+        timeout = left;
+      }
+    }
+    struct pollfd fds[2];
+    fds[0].fd = wakePipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = udpSocket;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Resolver poll error." << std::endl;
+      return;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      drain(wakePipe[0]);
+      std::vector<Query> taken;
+      pthread_mutex_lock(&mutex);
+      bool stop = stopping;
+      taken.swap(lookups);
+      pthread_mutex_unlock(&mutex);
+      if (stop) {
+        return;
+      }
+      for (size_t i = 0; i < taken.size(); ++i) {
+        unsigned short id;
+        do {
+          id = rand_r(&seed) & 0xffff;
+        } while (queries.count(id));
+        sendQuery(id, queries[id] = taken[i]);
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      unsigned char packet[1500];
+      ssize_t received;
+      while ((received = recv(udpSocket, packet, sizeof(packet), 0)) > 0) {
+        handleResponse(packet, received);
+      }
+    }
+
+    now = monotonicMs();
+    std::map<unsigned short, Query>::iterator it = queries.begin();
+    while (it != queries.end()) {
+      Query& query = it->second;
+      if (query.deadline > now) {
+        ++it;
+      } else if (query.attempts < kAttempts) {
+        sendQuery(it->first, query);
+        ++it;
+      } else {
+        finish(query, "");
+        queries.erase(it++);
+      }
+    }
+  }
+}
+
+void Resolver::sendQuery(unsigned short id, Query& query) {
+  std::string packet;
+  putU16(packet, id);
+  putU16(packet, 0x0100);  // Recursion desired
+  putU16(packet, 1);       // One question
+  putU16(packet, 0);
+  putU16(packet, 0);
+  putU16(packet, 0);
+  putName(packet, query.forward ? query.hostname : reverseName(query.address));
+  putU16(packet, query.forward ? kTypeA : kTypePtr);
+  putU16(packet, kClassIn);
+  if (send(udpSocket, packet.data(), packet.size(), 0) < 0) {
+    std::cerr << "Resolver send failed." << std::endl;
+  }
+  ++query.attempts;
+  query.deadline = monotonicMs() + kTimeoutMs;
+}
+
+// Match the answer to its query by id and question, then move the query on:
+// a PTR answer starts the A query for the name, an A answer decides.
+void Resolver::handleResponse(const unsigned char* packet, size_t length) {
+  if (length < 12) {
+    return;
+  }
+  std::map<unsigned short, Query>::iterator it =
+      queries.find(getU16(packet));
+  unsigned flags = getU16(packet + 2);
+  if (it == queries.end() || !(flags & 0x8000) || getU16(packet + 4) != 1) {
+    return;
+  }
+  Query& query = it->second;
+  std::string expected =
+      query.forward ? query.hostname : reverseName(query.address);
+  size_t offset = 12;
+  std::string name;
+  if (!readName(packet, length, offset, name) || !sameName(name, expected) ||
+      offset + 4 > length ||
+      getU16(packet + offset) != (query.forward ? kTypeA : kTypePtr)) {
+    return;  // Not an answer to this question
+  }
+  offset += 4;
+
+  std::string found;
+  bool confirmed = false;
+  unsigned answers = (flags & 0x000f) == 0 ? getU16(packet + 6) : 0;
+  for (unsigned i = 0; i < answers; ++i) {
+    if (!readName(packet, length, offset, name) || offset + 10 > length) {
+      break;
+    }
+    unsigned type = getU16(packet + offset);
+    unsigned ttl = getU16(packet + offset + 4) << 16 |
+                   getU16(packet + offset + 6);
+    size_t dataLength = getU16(packet + offset + 8);
+    offset += 10;
+    if (offset + dataLength > length) {
+      break;
+    }
+    if (type == kTypePtr && !query.forward && found.empty()) {
+      size_t dataOffset = offset;
+      if (readName(packet, length, dataOffset, found) && ttl < query.ttl) {
+        query.ttl = ttl;
+      }
+    } else if (type == kTypeA && query.forward && dataLength == 4) {
+      unsigned int address = getU16(packet + offset) << 16 |
+                             getU16(packet + offset + 2);
+      if (address == query.address) {
+        confirmed = true;
+        if (ttl < query.ttl) {
+          query.ttl = ttl;
+        }
+      }
+    }
+    offset += dataLength;
+  }
+
+  if (query.forward) {
+    finish(query, confirmed ? query.hostname : "");
+    queries.erase(it);
+    return;
+  }
+  if (!isValidHostname(found)) {
+    finish(query, "");
+    queries.erase(it);
+    return;
+  }
+  Query next = query;
+  queries.erase(it);
+  next.forward = true;
+  next.hostname = found;
+  next.attempts = 0;
+  unsigned short id;
+  do {
+    id = rand_r(&seed) & 0xffff;
+  } while (queries.count(id));
+  sendQuery(id, queries[id] = next);
+}
+
+// Hand the outcome to the loop thread; the caller forgets the query.
+void Resolver::finish(Query& query, const std::string& hostname) {
+  Answer answer;
+  answer.request = query.request;
+  answer.address = query.address;
+  answer.hostname = hostname;
+  answer.ttl = query.ttl;
+  if (hostname.empty()) {
+    answer.ttl = kNegativeTtl;
+  } else if (answer.ttl < kMinTtl) {
+    answer.ttl = kMinTtl;
+  } else if (answer.ttl > kMaxTtl) {
+    answer.ttl = kMaxTtl;
+  }
+  pthread_mutex_lock(&mutex);
+  bool wasEmpty = answers.empty();
+  answers.push_back(answer);
+  pthread_mutex_unlock(&mutex);
+  if (wasEmpty) {
+    wake(notifyPipe[1]);
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Reverse DNS for connecting clients (ircserv -R <dns-server>[:port]).
+// A resolver thread owns one UDP socket and keeps every query in flight at
+// once: it sends the PTR query, then an A query for the name it got, and
+// only reports the name if that lists the client's address again, so a
+// PTR record alone cannot claim someone else's name. Lookups and answers
+// cross between the threads through queues with a wakeup pipe each way,
+// as AccountStore does. Answers are cached on the loop thread for their
+// TTL (clamped), and failures for kNegativeTtl, so a reconnecting client
+// costs no query at all.
+class Resolver {
+ public:
+  struct Result {
+    unsigned long request;
+    unsigned int address;  // Host byte order
+    std::string hostname;  // Empty if the lookup failed
+  };
+
+  static const unsigned kMinTtl = 30;        // Seconds
+  static const unsigned kMaxTtl = 86400;
+  static const unsigned kNegativeTtl = 60;   // No name, or no answer
+  static const size_t kMaxCached = 65536;
+  static const unsigned kTimeoutMs = 1000;   // Per attempt
+  static const unsigned kAttempts = 2;
+
+  Resolver();
+  ~Resolver();
+
+  bool start(const std::string& server);  // "ip" or "ip:port"
+  bool isRunning() const;
+  int getNotifyFd() const;  // -1 until started
+
+  // A fresh cache entry, positive or negative; hostname is empty for a
+  // cached failure.
+  bool find(unsigned int address, std::string& hostname);
+  // Lookups for an address already in flight share its request number.
+  unsigned long submit(unsigned int address);
+  void takeResults(std::vector<Result>& results);  // Also fills the cache
+
+ private:
+  Resolver(const Resolver&);
+  Resolver& operator=(const Resolver&);
+
+  struct Answer {
+    unsigned long request;
+    unsigned int address;
+    std::string hostname;
+    unsigned ttl;
+  };
+  struct Query {
+    unsigned long request;
+    unsigned int address;
+    bool forward;          // Asking for the A records of hostname
+    std::string hostname;  // From the PTR answer
+    unsigned ttl;          // Smallest TTL seen so far
+    unsigned attempts;
+    unsigned long long deadline;  // ms, CLOCK_MONOTONIC
+  };
+  struct CacheEntry {
+    std::string hostname;
+    unsigned long long expires;  // ms
+  };
+
+  static void* resolverMain(void* arg);
+  void resolverLoop();
+  void sendQuery(unsigned short id, Query& query);
+  void handleResponse(const unsigned char* packet, size_t length);
+  void finish(Query& query, const std::string& hostname);
+
+  // Loop thread
+  std::map<unsigned int, CacheEntry> cache;
+  std::map<unsigned int, unsigned long> inFlight;  // Address -> request
+  unsigned long lastRequest;
+
+  // Resolver thread
+  int udpSocket;
+  struct sockaddr_in serverAddress;
+  std::map<unsigned short, Query> queries;  // By DNS transaction id
+  unsigned int seed;  // rand_r state for transaction ids
+
+  pthread_t thread;
+  bool threadStarted;
+  int wakePipe[2];    // Loop -> resolver: lookups queued, or stopping
+  int notifyPipe[2];  // Resolver -> loop: answers queued
+  pthread_mutex_t mutex;
+  std::vector<Query> lookups;   // Guarded by mutex
+  std::vector<Answer> answers;  // Guarded by mutex
+  bool stopping;                // Guarded by mutex
+};
+
+#endif
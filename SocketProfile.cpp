@@ -0,0 +1,110 @@
+#include "SocketProfile.hpp"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <iostream>
+#include <sstream>
+
+// One "name=value" number, at least minimum.
+static bool parseNumber(const std::string& text, int minimum, int& value) {
+  std::istringstream iss(text);
+  iss >> value;
+  return !iss.fail() && iss.eof() && value >= minimum;
+}
+
+static void setOption(int fd, int level, int name, int value,
+                      const char* label) {
+  if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+    std::cerr << "Cannot set " << label << " on socket " << fd << "."
+              << std::endl;
+  }
+}
+
+SocketProfile::SocketProfile()
+    : noDelay(false),
+      cork(false),
+      sendBuffer(0),
+      receiveBuffer(0),
+      deferAccept(0),
+      busyPoll(0),
+      keepIdle(0),
+      keepInterval(0),
+      keepCount(0) {}
+
+bool SocketProfile::parse(const std::string& options) {
+  std::istringstream list(options);
+  std::string option;
+  while (std::getline(list, option, ',')) {
+    size_t equals = option.find('=');
+    std::string name = option.substr(0, equals);
+    std::string value =
+        equals == std::string::npos ? "" : option.substr(equals + 1);
+    bool valid = true;
+    if (name == "nodelay" && value.empty()) {
+      noDelay = true;
+    } else if (name == "cork" && value.empty()) {
+      cork = true;
+    } else if (name == "sndbuf") {
+      valid = parseNumber(value, 1, sendBuffer);
+    } else if (name == "rcvbuf") {
+      valid = parseNumber(value, 1, receiveBuffer);
+    } else if (name == "defer") {
+      valid = parseNumber(value, 1, deferAccept);
+    } else if (name == "busypoll") {
+      valid = parseNumber(value, 1, busyPoll);
+    } else if (name == "keepalive") {
+      std::istringstream iss(value);
+      char slash1 = 0, slash2 = 0;
+      iss >> keepIdle >> slash1 >> keepInterval >> slash2 >> keepCount;
+      valid = !iss.fail() && iss.eof() && slash1 == '/' && slash2 == '/' &&
+              keepIdle > 0 && keepInterval > 0 && keepCount > 0;
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      std::cerr << "Bad socket option: " << option << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void SocketProfile::applyToListener(int fd) const {
+  if (sendBuffer) {
+    setOption(fd, SOL_SOCKET, SO_SNDBUF, sendBuffer, "SO_SNDBUF");
+  }
+  if (receiveBuffer) {
+    setOption(fd, SOL_SOCKET, SO_RCVBUF, receiveBuffer, "SO_RCVBUF");
+  }
+#ifdef TCP_DEFER_ACCEPT
+  if (deferAccept) {
+    setOption(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, deferAccept,
+              "TCP_DEFER_ACCEPT");
+  }
+#endif
+}
+
+// Buffer sizes (and the lock that stops the kernel auto-tuning them) come
+// with the socket from the listener.
+void SocketProfile::applyToClient(int fd) const {
+  if (noDelay) {
+    setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  }
+#ifdef SO_BUSY_POLL
+  if (busyPoll) {
+    setOption(fd, SOL_SOCKET, SO_BUSY_POLL, busyPoll, "SO_BUSY_POLL");
+  }
+#endif
+  if (keepIdle) {
+    setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+    setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, keepIdle, "TCP_KEEPIDLE");
+    setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, keepInterval, "TCP_KEEPINTVL");
+    setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, keepCount, "TCP_KEEPCNT");
+#endif
+  }
+}
+
+bool SocketProfile::corks() const { return cork; }
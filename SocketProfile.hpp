@@ -0,0 +1,42 @@
+#ifndef SOCKETPROFILE_HPP
+#define SOCKETPROFILE_HPP
+
+#include <string>
+
+// Socket options for one listener and the connections it accepts
+// (ircserv -S <port>:<options>). Options are comma separated:
+//   nodelay            TCP_NODELAY: small lines leave without waiting for
+//                      the previous segment's ACK
+//   cork               a flush that takes more than one send() marks all
+//                      but the last with MSG_MORE, so they share segments
+//   sndbuf=N rcvbuf=N  SO_SNDBUF / SO_RCVBUF in bytes; set on the listener
+//                      too, so the window scale offered in the SYN-ACK fits
+//   defer=S            TCP_DEFER_ACCEPT: accept() only once the client has
+//                      sent something, or S seconds have passed
+//   busypoll=US        SO_BUSY_POLL: spin on the device queue for US
+//                      microseconds before sleeping in a read
+//   keepalive=I/N/C    probe after I idle seconds, every N seconds, drop
+//                      after C unanswered probes
+// Anything not listed keeps the kernel's default.
+class SocketProfile {
+ public:
+  SocketProfile();
+
+  bool parse(const std::string& options);
+  void applyToListener(int fd) const;  // Before listen()
+  void applyToClient(int fd) const;    // Right after accept()
+  bool corks() const;
+
+ private:
+  bool noDelay;
+  bool cork;
+  int sendBuffer;     // 0: kernel default
+  int receiveBuffer;  // 0: kernel default
+  int deferAccept;    // Seconds; 0: off
+  int busyPoll;       // Microseconds; 0: off
+  int keepIdle;       // Seconds; 0: no keepalive
+  int keepInterval;
+  int keepCount;
+};
+
+#endif
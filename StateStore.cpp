@@ -0,0 +1,294 @@
+#include "StateStore.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// Record framing: 4-byte length, 4-byte FNV-1a checksum, payload.
+// A torn record at the end of the journal fails the checks and is dropped.
+static const char kSnapshotMagic[8] = {'I', 'R', 'C', 'S', 'N', 'A', 'P', '1'};
+static const size_t kCompactThreshold = 16 * 1024 * 1024;
+
+unsigned int StateStore::checksum(const char* data, size_t size) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+static unsigned int readU32(const char* data) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+         (static_cast<unsigned int>(bytes[3]) << 24);
+}
+
+void StateStore::putU32(std::string& out, unsigned int value) {
+  char bytes[4];
+  bytes[0] = value & 0xFF;
+  bytes[1] = (value >> 8) & 0xFF;
+  bytes[2] = (value >> 16) & 0xFF;
+  bytes[3] = (value >> 24) & 0xFF;
+  out.append(bytes, 4);
+}
+
+void StateStore::putString(std::string& out, const std::string& value) {
+  putU32(out, value.size());
+  out += value;
+}
+
+bool StateStore::getU32(const char*& data, const char* end,
+                        unsigned int& value) {
+  if (end - data < 4) {
+    return false;
+  }
+  value = readU32(data);
+  data += 4;
+  return true;
+}
+
+bool StateStore::getString(const char*& data, const char* end,
+                           std::string& value) {
+  unsigned int length;
+  if (!getU32(data, end, length) ||
+      static_cast<size_t>(end - data) < length) {
+    return false;
+  }
+  value.assign(data, length);
+  data += length;
+  return true;
+}
+
+StateStore::StateStore(const std::string& directory)
+    : journalPath(directory + "/channels.journal"),
+      snapshotPath(directory + "/channels.snapshot"),
+      journalFd(-1),
+      journalBytes(0),
+      writerStarted(false),
+      stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&ready, NULL);
+}
+
+StateStore::~StateStore() {
+  if (writerStarted) {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(writer, NULL);  // The writer drains the queue first
+  }
+  if (journalFd >= 0) {
+    close(journalFd);
+  }
+  pthread_cond_destroy(&ready);
+  pthread_mutex_destroy(&mutex);
+}
+
+void StateStore::frame(std::string& out, const std::string& payload) {
+  putU32(out, payload.size());
+  putU32(out, checksum(payload.data(), payload.size()));
+  out += payload;
+}
+
+// valid is set to the length of the intact records at the front.
+bool StateStore::readRecords(const char* data, size_t size,
+                             std::vector<std::string>& records,
+                             size_t& valid) {
+  size_t offset = 0;
+  valid = 0;
+  while (offset + 8 <= size) {
+    unsigned int length = readU32(data + offset);
+    if (length > size - offset - 8 ||
+        checksum(data + offset + 8, length) != readU32(data + offset + 4)) {
+      return false;
+    }
+    records.push_back(std::string(data + offset + 8, length));
+    offset += 8 + length;
+    valid = offset;
+  }
+  return offset == size;
+}
+
+bool StateStore::load(std::vector<std::string>& records) {
+  int snapshotFd = open(snapshotPath.c_str(), O_RDONLY);
+  if (snapshotFd >= 0) {
+    struct stat info;
+    if (fstat(snapshotFd, &info) == 0 &&
+        static_cast<size_t>(info.st_size) >= sizeof(kSnapshotMagic)) {
+      void* mapped =
+          mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, snapshotFd, 0);
+      if (mapped != MAP_FAILED) {
+        const char* data = static_cast<const char*>(mapped);
+        size_t valid;
+        if (memcmp(data, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+            !readRecords(data + sizeof(kSnapshotMagic),
+                         info.st_size - sizeof(kSnapshotMagic), records,
+                         valid)) {
+          std::cerr << "Snapshot " << snapshotPath << " is corrupt."
+                    << std::endl;
+        }
+        munmap(mapped, info.st_size);
+      }
+    }
+    close(snapshotFd);
+  }
+
+  journalFd = open(journalPath.c_str(), O_RDWR | O_CREAT, 0644);
+  if (journalFd < 0) {
+    std::cerr << "Failed to open journal " << journalPath << "." << std::endl;
+    return false;
+  }
+  // A torn tail is cut off before anything is appended; records written
+  // after it would be unreadable on the next start.
+  struct stat info;
+  if (fstat(journalFd, &info) == 0 && info.st_size > 0) {
+    void* mapped =
+        mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, journalFd, 0);
+    if (mapped == MAP_FAILED) {
+      std::cerr << "Failed to read journal " << journalPath << "."
+                << std::endl;
+      return false;
+    }
+    size_t valid;
+    bool intact = readRecords(static_cast<const char*>(mapped), info.st_size,
+                              records, valid);
+    munmap(mapped, info.st_size);
+    if (!intact) {
+      std::cerr << "Journal has a torn tail; dropping its last "
+                << info.st_size - valid << " bytes." << std::endl;
+      if (ftruncate(journalFd, valid) != 0 || fdatasync(journalFd) != 0) {
+        std::cerr << "Failed to truncate journal." << std::endl;
+        return false;
+      }
+    }
+    journalBytes = valid;
+  }
+  lseek(journalFd, 0, SEEK_END);
+  return true;
+}
+
+bool StateStore::start() {
+  if (pthread_create(&writer, NULL, writerMain, this) != 0) {
+    std::cerr << "Failed to start journal writer." << std::endl;
+    return false;
+  }
+  writerStarted = true;
+  return true;
+}
+
+// Called from the event loop: only copies the record into the queue.
+void StateStore::append(const std::string& payload) {
+  pthread_mutex_lock(&mutex);
+  if (queue.empty() || queue.back().isSnapshot) {
+    queue.push_back(Batch());
+    queue.back().isSnapshot = false;
+  }
+  frame(queue.back().data, payload);
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&mutex);
+  journalBytes += payload.size() + 8;
+}
+
+bool StateStore::needsCompaction() const {
+  return journalBytes >= kCompactThreshold;
+}
+
+// Queue a full dump of the current state. Records appended before this
+// call are covered by the snapshot; later ones go to the fresh journal.
+void StateStore::compact(const std::vector<std::string>& payloads) {
+  std::string data(kSnapshotMagic, sizeof(kSnapshotMagic));
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    frame(data, payloads[i]);
+  }
+  pthread_mutex_lock(&mutex);
+  queue.push_back(Batch());
+  queue.back().isSnapshot = true;
+  queue.back().data.swap(data);
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&mutex);
+  journalBytes = 0;
+}
+
+void* StateStore::writerMain(void* arg) {
+  static_cast<StateStore*>(arg)->writerLoop();
+  return NULL;
+}
+
+// Take everything queued since the last round, write it, then sync once.
+void StateStore::writerLoop() {
+  std::vector<Batch> batches;
+  while (true) {
+    pthread_mutex_lock(&mutex);
+    while (queue.empty() && !stopping) {
+      pthread_cond_wait(&ready, &mutex);
+    }
+    if (queue.empty() && stopping) {
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    batches.swap(queue);
+    pthread_mutex_unlock(&mutex);
+
+    bool journalDirty = false;
+    for (size_t i = 0; i < batches.size(); ++i) {
+      if (batches[i].isSnapshot) {
+        if (journalDirty) {
+          fdatasync(journalFd);
+          journalDirty = false;
+        }
+        writeSnapshot(batches[i].data);
+      } else if (writeAll(journalFd, batches[i].data)) {
+        journalDirty = true;
+      }
+    }
+    if (journalDirty) {
+      fdatasync(journalFd);
+    }
+    batches.clear();
+  }
+}
+
+bool StateStore::writeAll(int fd, const std::string& data) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t written = write(fd, data.data() + offset, data.size() - offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Journal write failed: " << strerror(errno) << std::endl;
+      return false;
+    }
+    offset += written;
+  }
+  return true;
+}
+
+// Write the dump beside the old snapshot, swap it in atomically, and only
+// then drop the journal records it replaces.
+void StateStore::writeSnapshot(const std::string& data) {
+  std::string temporaryPath = snapshotPath + ".tmp";
+  int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to create snapshot." << std::endl;
+    return;
+  }
+  bool written = writeAll(fd, data) && fsync(fd) == 0;
+  close(fd);
+  if (!written || rename(temporaryPath.c_str(), snapshotPath.c_str()) != 0) {
+    std::cerr << "Failed to write snapshot." << std::endl;
+    unlink(temporaryPath.c_str());
+    return;
+  }
+  if (ftruncate(journalFd, 0) == 0) {
+    lseek(journalFd, 0, SEEK_SET);
+    fdatasync(journalFd);
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef STATESTORE_HPP
+#define STATESTORE_HPP
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+// Persists channel state across restarts.
+// Every change appends a record to <dir>/channels.journal; a background
+// thread writes batches and calls fdatasync once per batch (group commit), so
+// the event loop only copies bytes into a queue. When the journal grows past
+// a threshold the server hands over a full dump, which the writer stores as
+// <dir>/channels.snapshot and then truncates the journal.
+// Startup maps the snapshot and replays the journal on top of it.
+class StateStore {
+ public:
+  StateStore(const std::string& directory);
+  ~StateStore();
+
+  // Read the snapshot and journal; each record payload is appended to
+  // records in order (later records for a channel replace earlier ones).
+  bool load(std::vector<std::string>& records);
+  bool start();
+
+  void append(const std::string& payload);
+  bool needsCompaction() const;
+  void compact(const std::vector<std::string>& payloads);
+
+  // Little-endian field encoding shared by the record payloads
+  static void putU32(std::string& out, unsigned int value);
+  static void putString(std::string& out, const std::string& value);
+  static bool getU32(const char*& data, const char* end, unsigned int& value);
+  static bool getString(const char*& data, const char* end,
+                        std::string& value);
+  // FNV-1a over a record payload, stored in its frame
+  static unsigned int checksum(const char* data, size_t size);
+
+ private:
+  StateStore(const StateStore&);
+  StateStore& operator=(const StateStore&);
+
+  struct Batch {
+    bool isSnapshot;
+    std::string data;  // Framed records
+  };
+
+  static void* writerMain(void* arg);
+  void writerLoop();
+  bool writeAll(int fd, const std::string& data);
+  void writeSnapshot(const std::string& data);
+  static void frame(std::string& out, const std::string& payload);
+  static bool readRecords(const char* data, size_t size,
+                          std::vector<std::string>& records, size_t& valid);
+
+  std::string journalPath;
+  std::string snapshotPath;
+  int journalFd;
+  size_t journalBytes;  // Appended since the last snapshot (loop thread)
+
+  pthread_t writer;
+  bool writerStarted;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+  std::vector<Batch> queue;  // Guarded by mutex
+  bool stopping;             // Guarded by mutex
+};
+
+#endif
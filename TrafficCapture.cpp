@@ -0,0 +1,226 @@
+#include "TrafficCapture.hpp"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "StateStore.hpp"
+
+static const char kMagic[] = "IRCTRACE";
+static const unsigned int kVersion = 1;
+static const size_t kFlushSize = 1024 * 1024;  // Write early past this
+
+// Commands whose arguments are passwords
+static const char* const kSecretCommands[] = {"PASS", "AUTHENTICATE", "OPER",
+                                               "SERVER"};
+
+const char* const TrafficCapture::kRedacted = "<redacted>";
+
+static bool isSecretCommand(const char* command, size_t length) {
+  for (size_t i = 0; i < sizeof(kSecretCommands) / sizeof(*kSecretCommands);
+       ++i) {
+    if (std::strlen(kSecretCommands[i]) == length &&
+        strncasecmp(command, kSecretCommands[i], length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Replace the arguments of secret commands among the lines in
+// text[0, length) with kRedacted, in place. Returns the new length.
+static size_t redactSecrets(std::string& text, size_t length) {
+  size_t start = 0;
+  while (start < length) {
+    size_t end = text.find('\n', start);
+    if (end == std::string::npos || end > length) {
+      end = length;
+    }
+    size_t command = start;
+    if (text[command] == ':') {  // Skip a prefix
+      command = text.find(' ', command);
+      command = command < end ? command + 1 : end;
+    }
+    size_t space = text.find(' ', command);
+    if (space < end && isSecretCommand(text.data() + command,
+                                       space - command)) {
+      size_t argumentsEnd = end;
+      if (argumentsEnd > space + 1 && text[argumentsEnd - 1] == '\r') {
+        --argumentsEnd;
+      }
+      size_t redacted = std::strlen(TrafficCapture::kRedacted);
+      text.replace(space + 1, argumentsEnd - space - 1,
+                   TrafficCapture::kRedacted);
+      size_t removed = argumentsEnd - space - 1;
+      length = length + redacted - removed;
+      end = end + redacted - removed;
+    }
+    start = end + 1;
+  }
+  return length;
+}
+
+TrafficCapture::TrafficCapture() : fd(-1), nextConnection(1) {
+  gettimeofday(&last, NULL);
+}
+
+TrafficCapture::~TrafficCapture() {
+  flush();
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool TrafficCapture::open(const std::string& path) {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    std::cerr << "Cannot open capture file " << path << "." << std::endl;
+    return false;
+  }
+  buffer.append(kMagic, sizeof(kMagic) - 1);
+  StateStore::putU32(buffer, kVersion);
+  gettimeofday(&last, NULL);
+  std::cout << "Capturing client traffic to " << path << std::endl;
+  return true;
+}
+
+// Gaps longer than a 32-bit count of microseconds (about 71 minutes) are
+// recorded as that maximum.
+void TrafficCapture::putHeader(char type, unsigned int connection) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  long long delta = (now.tv_sec - last.tv_sec) * 1000000LL +
+                    (now.tv_usec - last.tv_usec);
+  last = now;
+  if (delta < 0) {
+    delta = 0;
+  } else if (delta > 0xFFFFFFFFLL) {
+    delta = 0xFFFFFFFFLL;
+  }
+  buffer += type;
+  StateStore::putU32(buffer, connection);
+  StateStore::putU32(buffer, static_cast<unsigned int>(delta));
+}
+
+TrafficCapture::Connection& TrafficCapture::connectionFor(
+    ClientHandler* client) {
+  std::map<ClientHandler*, Connection>::iterator it =
+      connections.find(client);
+  if (it != connections.end()) {
+    return it->second;
+  }
+  Connection& connection = connections[client];
+  connection.number = nextConnection++;
+  putHeader(kOpen, connection.number);
+  return connection;
+}
+
+void TrafficCapture::recordOpen(ClientHandler* client) {
+  connectionFor(client);
+}
+
+// Everything up to the last newline is recorded now; an unfinished line
+// waits for the data that completes it, since its first part could be a
+// password split across reads.
+void TrafficCapture::recordData(ClientHandler* client, const char* data,
+                                size_t length) {
+  Connection& connection = connectionFor(client);
+  connection.tail.append(data, length);
+  size_t end = connection.tail.rfind('\n');
+  if (end != std::string::npos) {
+    putData(connection.number, connection.tail, end + 1);
+  }
+}
+
+void TrafficCapture::recordClose(ClientHandler* client) {
+  std::map<ClientHandler*, Connection>::iterator it =
+      connections.find(client);
+  if (it == connections.end()) {
+    return;
+  }
+  if (!it->second.tail.empty()) {
+    putData(it->second.number, it->second.tail, it->second.tail.size());
+  }
+  putHeader(kClose, it->second.number);
+  connections.erase(it);
+}
+
+// Record lines[0, length), redacted, and drop it from lines.
+void TrafficCapture::putData(unsigned int connection, std::string& lines,
+                             size_t length) {
+  length = redactSecrets(lines, length);
+  putHeader(kData, connection);
+  if (length == lines.size()) {
+    StateStore::putString(buffer, lines);
+    lines.clear();
+  } else {
+    StateStore::putString(buffer, lines.substr(0, length));
+    lines.erase(0, length);
+  }
+  if (buffer.size() >= kFlushSize) {
+    flush();
+  }
+}
+
+void TrafficCapture::flush() {
+  size_t written = 0;
+  while (fd >= 0 && written < buffer.size()) {
+    ssize_t result =
+        write(fd, buffer.data() + written, buffer.size() - written);
+    if (result < 0) {
+      std::cerr << "Capture write failed; capture stopped." << std::endl;
+      close(fd);
+      fd = -1;
+      break;
+    }
+    written += result;
+  }
+  buffer.clear();
+}
+
+// Read a whole trace. Returns false if the file is missing, not a trace,
+// or cut short (the records before the cut are still returned).
+bool TrafficCapture::load(const std::string& path,
+                          std::vector<Record>& records) {
+  int input = ::open(path.c_str(), O_RDONLY);
+  if (input < 0) {
+    return false;
+  }
+  std::string contents;
+  char chunk[65536];
+  ssize_t got;
+  while ((got = read(input, chunk, sizeof(chunk))) > 0) {
+    contents.append(chunk, got);
+  }
+  close(input);
+  size_t magicLength = sizeof(kMagic) - 1;
+  if (contents.size() < magicLength + 4 ||
+      contents.compare(0, magicLength, kMagic) != 0) {
+    return false;
+  }
+  const char* data = contents.data() + magicLength;
+  const char* end = contents.data() + contents.size();
+  unsigned int version;
+  if (!StateStore::getU32(data, end, version) || version != kVersion) {
+    return false;
+  }
+  unsigned long long time = 0;
+  while (data < end) {
+    Record record;
+    unsigned int delta;
+    record.type = *data++;
+    if (!StateStore::getU32(data, end, record.connection) ||
+        !StateStore::getU32(data, end, delta) ||
+        (record.type == kData &&
+         !StateStore::getString(data, end, record.data))) {
+      return false;
+    }
+    time += delta;
+    record.time = time;
+    records.push_back(record);
+  }
+  return true;
+}
@@ -0,0 +1,68 @@
+#ifndef TRAFFICCAPTURE_HPP
+#define TRAFFICCAPTURE_HPP
+
+#include <sys/time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class ClientHandler;
+
+// Records everything connections send us (ircserv -C <file>), so real
+// traffic can be fed back into a test server with ircreplay.
+//
+// The trace is "IRCTRACE", a version, then one record per event: a type
+// byte (open, data or close), the connection number, the microseconds
+// since the previous record and, for data, the bytes as they arrived.
+// Fields use StateStore's little-endian encoding. Records are buffered and
+// written once per loop iteration. The arguments of PASS, AUTHENTICATE,
+// OPER and SERVER are replaced with kRedacted, so a data record is only
+// written once its lines are complete; the rest of what clients send is
+// kept as is, so the file is still created readable by the owner only.
+class TrafficCapture {
+ public:
+  static const char kOpen = 'O';
+  static const char kData = 'D';
+  static const char kClose = 'C';
+  static const char* const kRedacted;  // Stands in for secret arguments
+
+  struct Record {
+    char type;
+    unsigned int connection;
+    unsigned long long time;  // Microseconds since the first record
+    std::string data;
+  };
+
+  TrafficCapture();
+  ~TrafficCapture();
+
+  bool open(const std::string& path);
+  void recordOpen(ClientHandler* client);
+  void recordData(ClientHandler* client, const char* data, size_t length);
+  void recordClose(ClientHandler* client);
+  void flush();
+
+  static bool load(const std::string& path, std::vector<Record>& records);
+
+ private:
+  TrafficCapture(const TrafficCapture&);
+  TrafficCapture& operator=(const TrafficCapture&);
+
+  struct Connection {
+    unsigned int number;
+    std::string tail;  // An unfinished line, held until it can be redacted
+  };
+
+  Connection& connectionFor(ClientHandler* client);
+  void putHeader(char type, unsigned int connection);
+  void putData(unsigned int connection, std::string& lines, size_t length);
+
+  int fd;
+  std::string buffer;  // Records not yet written
+  std::map<ClientHandler*, Connection> connections;
+  unsigned int nextConnection;
+  struct timeval last;  // Time of the previous record
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include "UserIndex.hpp"
+
+#include <algorithm>
+
+#include "Channel.hpp"
+#include "ClientHandler.hpp"
+#include "IRCServer.hpp"
+
+// Index entries visited per query per loop iteration, and the queued output
+// above which a client's WHO waits for its socket to drain.
+static const size_t kScanBudget = 512;
+static const size_t kOutputLimit = 64 * 1024;
+
+UserIndex::UserIndex(IRCServer* server) : server(server) {}
+
+std::string UserIndex::hostKey(const std::string& host) {
+  std::string key = WildcardMask::fold(host);
+  std::reverse(key.begin(), key.end());
+  return key;
+}
+
+void UserIndex::add(ClientHandler* user) {
+  nicks.insert(Key(WildcardMask::fold(user->getNickname()), user));
+  users.insert(Key(WildcardMask::fold(user->getUsername()), user));
+  hosts.insert(Key(hostKey(user->getHostname()), user));
+}
+
+// Must run before the user's nick, username or hostname changes.
+void UserIndex::remove(ClientHandler* user) {
+  nicks.erase(Key(WildcardMask::fold(user->getNickname()), user));
+  users.erase(Key(WildcardMask::fold(user->getUsername()), user));
+  hosts.erase(Key(hostKey(user->getHostname()), user));
+  queries.erase(user);
+}
+
+ClientHandler* UserIndex::findNick(const std::string& nick) const {
+  InternedString folded;
+  if (!InternedString::find(WildcardMask::fold(nick), folded)) {
+    return NULL;
+  }
+  Index::const_iterator it = nicks.lower_bound(Key(folded, NULL));
+  if (it == nicks.end() || it->first != folded) {
+    return NULL;
+  }
+  return it->second;
+}
+
+// A mask without '!' or '@' is a nick mask. Otherwise the part with the
+// longest literal anchor picks the index: nick or username by prefix, host
+// by suffix (the host index is reversed). Up to one chunk is sent now; the
+// rest follows from runQueries.
+void UserIndex::startWho(ClientHandler* requester, const std::string& mask) {
+  WhoQuery& query = queries[requester];
+  query = WhoQuery();
+  query.mask = mask.empty() || mask == "0" ? "*" : mask;
+  query.started = false;
+  query.index = &nicks;
+  if (query.mask[0] == '#') {
+    query.channel = query.mask;
+  } else {
+    size_t bang = query.mask.find('!');
+    size_t at = query.mask.find('@', bang == std::string::npos ? 0 : bang);
+    size_t nickEnd = std::min(bang, at);
+    query.nick = WildcardMask(query.mask.substr(0, nickEnd));
+    if (bang != std::string::npos) {
+      query.user = WildcardMask(query.mask.substr(
+          bang + 1, at == std::string::npos ? at : at - bang - 1));
+    }
+    if (at != std::string::npos) {
+      query.host = WildcardMask(query.mask.substr(at + 1));
+    }
+    query.prefix = query.nick.getPrefix();
+    if (query.user.getPrefix().size() > query.prefix.size()) {
+      query.index = &users;
+      query.prefix = query.user.getPrefix();
+    }
+    std::string hostSuffix = hostKey(query.host.getSuffix());
+    if (hostSuffix.size() > query.prefix.size()) {
+      query.index = &hosts;
+      query.prefix = hostSuffix;
+    }
+  }
+  if (step(requester, query)) {
+    queries.erase(requester);
+  }
+}
+
+// Send the next chunk of every WHO whose client is not backed up.
+void UserIndex::runQueries() {
+  std::map<ClientHandler*, WhoQuery>::iterator it = queries.begin();
+  while (it != queries.end()) {
+    if (it->first->getPendingOutputSize() < kOutputLimit &&
+        step(it->first, it->second)) {
+      queries.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+bool UserIndex::hasRunnableQueries() const {
+  std::map<ClientHandler*, WhoQuery>::const_iterator it;
+  for (it = queries.begin(); it != queries.end(); ++it) {
+    if (it->first->getPendingOutputSize() < kOutputLimit) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Visit up to kScanBudget entries. Returns true once the reply is complete.
+// The cursor is a key, not an iterator, so users leaving between chunks
+// cannot invalidate it.
+bool UserIndex::step(ClientHandler* requester, WhoQuery& query) {
+  bool done;
+  if (!query.channel.empty()) {
+    done = stepChannel(requester, query);
+  } else {
+    Index::const_iterator it =
+        query.started ? query.index->upper_bound(query.cursor)
+                      : query.index->lower_bound(
+                            Key(query.prefix, (ClientHandler*)NULL));
+    query.started = true;
+    size_t visited = 0;
+    for (; it != query.index->end() && visited < kScanBudget;
+         ++it, ++visited) {
+      if (it->first.str().compare(0, query.prefix.size(), query.prefix) != 0) {
+        break;
+      }
+      query.cursor = *it;
+      ClientHandler* user = it->second;
+      if (query.nick.matches(user->getNickname()) &&
+          query.user.matches(user->getUsername()) &&
+          query.host.matches(user->getHostname())) {
+        sendWhoReply(requester, "*", user, false);
+      }
+    }
+    done = it == query.index->end() ||
+           it->first.str().compare(0, query.prefix.size(), query.prefix) != 0;
+  }
+  if (done) {
+    requester->sendMessage(":Server 315 " + requester->getNickname() + " " +
+                           query.mask + " :End of WHO list");
+  }
+  return done;
+}
+
+// Members in pointer order, with the same visibility as NAMES (+u hides
+// non-operators from non-operators).
+bool UserIndex::stepChannel(ClientHandler* requester, WhoQuery& query) {
+  Channel* channel = server->findChannel(query.channel);
+  if (channel == NULL) {
+    return true;
+  }
+  const std::map<ClientHandler*, bool>& members = channel->getClients();
+  std::map<ClientHandler*, bool>::const_iterator it =
+      query.started ? members.upper_bound(query.cursor.second)
+                    : members.begin();
+  query.started = true;
+  bool showAll = !channel->isAuditorium() || channel->isOperator(requester);
+  for (size_t visited = 0; it != members.end() && visited < kScanBudget;
+       ++it, ++visited) {
+    query.cursor.second = it->first;
+    bool isOperator = channel->isOperator(it->first);
+    if (showAll || isOperator || it->first == requester) {
+      sendWhoReply(requester, query.channel, it->first, isOperator);
+    }
+  }
+  return it == members.end();
+}
+
+void UserIndex::sendWhoReply(ClientHandler* requester,
+                             const std::string& channel, ClientHandler* user,
+                             bool isOperator) {
+  const std::string& serverName = user->getUplink()
+                                      ? user->getServerName()
+                                      : server->getLinks().getName();
+  requester->sendMessage(":Server 352 " + requester->getNickname() + " " +
+                         channel + " " + user->getUsername() + " " +
+                         user->getHostname() + " " + serverName + " " +
+                         user->getNickname() + (isOperator ? " H@" : " H") +
+                         " :0 " + user->getUsername());
+}
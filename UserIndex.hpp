@@ -0,0 +1,62 @@
+#ifndef USERINDEX_HPP
+#define USERINDEX_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "InternedString.hpp"
+#include "WildcardMask.hpp"
+
+class ClientHandler;
+class IRCServer;
+
+// Registered users ordered by nick, username and reversed hostname (all
+// lowercase), so a WHO mask only walks the index range its literal prefix
+// (or, for hosts, suffix) allows. Large WHO replies are produced a chunk at
+// a time from the event loop instead of all at once. Keys are interned, so
+// users on the same host share one copy of it.
+class UserIndex {
+ public:
+  UserIndex(IRCServer* server);
+
+  void add(ClientHandler* user);
+  void remove(ClientHandler* user);  // Also drops the user's pending WHO
+  ClientHandler* findNick(const std::string& nick) const;  // Any case
+
+  // WHO #channel, or WHO <nick>[!<user>@<host>] with wildcards
+  void startWho(ClientHandler* requester, const std::string& mask);
+  void runQueries();
+  bool hasRunnableQueries() const;
+
+ private:
+  typedef std::pair<InternedString, ClientHandler*> Key;
+  typedef std::set<Key> Index;
+
+  struct WhoQuery {
+    std::string mask;
+    std::string channel;  // Set for WHO #channel
+    WildcardMask nick;
+    WildcardMask user;
+    WildcardMask host;
+    const Index* index;   // The index being walked
+    std::string prefix;   // Every key in range starts with this
+    Key cursor;           // Last key visited
+    bool started;
+  };
+
+  bool step(ClientHandler* requester, WhoQuery& query);
+  bool stepChannel(ClientHandler* requester, WhoQuery& query);
+  void sendWhoReply(ClientHandler* requester, const std::string& channel,
+                    ClientHandler* user, bool isOperator);
+  static std::string hostKey(const std::string& host);
+
+  IRCServer* server;
+  Index nicks;
+  Index users;
+  Index hosts;
+  std::map<ClientHandler*, WhoQuery> queries;  // Unfinished WHO replies
+};
+
+#endif
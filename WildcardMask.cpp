@@ -0,0 +1,127 @@
+#include "WildcardMask.hpp"
+
+#include <cctype>
+
+WildcardMask::WildcardMask()
+    : mask("*"), anchoredStart(false), anchoredEnd(false), minimumLength(0) {}
+
+WildcardMask::WildcardMask(const std::string& mask)
+    : mask(mask), anchoredStart(true), anchoredEnd(true), minimumLength(0) {
+  std::string folded = fold(mask);
+  size_t start = 0;
+  while (start <= folded.size()) {
+    size_t star = folded.find('*', start);
+    if (star == std::string::npos) {
+      star = folded.size();
+    }
+    if (star > start) {
+      segments.push_back(Segment());
+      segments.back().text = folded.substr(start, star - start);
+      segments.back().hasAnyChar =
+          segments.back().text.find('?') != std::string::npos;
+      minimumLength += star - start;
+    }
+    start = star + 1;
+  }
+  if (segments.empty()) {
+    anchoredStart = folded.empty();  // "" matches only ""; "*" matches all
+    anchoredEnd = anchoredStart;
+    return;
+  }
+  anchoredStart = folded[0] != '*';
+  anchoredEnd = folded[folded.size() - 1] != '*';
+  if (anchoredStart) {
+    prefix = segments[0].text.substr(0, segments[0].text.find('?'));
+  }
+  if (anchoredEnd) {
+    const std::string& last = segments.back().text;
+    size_t anyChar = last.rfind('?');
+    suffix = anyChar == std::string::npos ? last : last.substr(anyChar + 1);
+  }
+}
+
+std::string WildcardMask::fold(const std::string& text) {
+  std::string folded(text);
+  for (size_t i = 0; i < folded.size(); ++i) {
+    folded[i] = std::tolower(static_cast<unsigned char>(folded[i]));
+  }
+  return folded;
+}
+
+// Does segment match text at position? text is already folded.
+bool WildcardMask::segmentAt(const Segment& segment, const std::string& text,
+                             size_t position) {
+  if (!segment.hasAnyChar) {
+    return text.compare(position, segment.text.size(), segment.text) == 0;
+  }
+  for (size_t i = 0; i < segment.text.size(); ++i) {
+    if (segment.text[i] != '?' && segment.text[i] != text[position + i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Segments are fixed-length, so taking the leftmost fit for each middle
+// segment never rules out a match that a later choice would allow.
+bool WildcardMask::matches(const std::string& input) const {
+  if (input.size() < minimumLength) {
+    return false;
+  }
+  return matchesFolded(fold(input));
+}
+
+bool WildcardMask::matchesFolded(const std::string& text) const {
+  if (text.size() < minimumLength) {
+    return false;
+  }
+  if (segments.empty()) {
+    return !anchoredStart || text.empty();
+  }
+  size_t first = 0;
+  size_t last = segments.size();
+  size_t position = 0;
+  size_t end = text.size();
+  if (anchoredStart) {
+    if (!segmentAt(segments[0], text, 0)) {
+      return false;
+    }
+    position = segments[0].text.size();
+    first = 1;
+  }
+  if (anchoredEnd && last > first) {
+    const Segment& tail = segments[last - 1];
+    if (end - position < tail.text.size() ||
+        !segmentAt(tail, text, end - tail.text.size())) {
+      return false;
+    }
+    end -= tail.text.size();
+    --last;
+  } else if (anchoredEnd && segments.size() == 1) {
+    return text.size() == segments[0].text.size();  // No '*' at all
+  }
+  for (size_t i = first; i < last; ++i) {
+    const Segment& segment = segments[i];
+    while (true) {
+      if (end - position < segment.text.size()) {
+        return false;
+      }
+      if (segmentAt(segment, text, position)) {
+        break;
+      }
+      ++position;
+    }
+    position += segment.text.size();
+  }
+  return true;
+}
+
+bool WildcardMask::matchesAll() const {
+  return segments.empty() && !anchoredStart;
+}
+
+const std::string& WildcardMask::getMask() const { return mask; }
+
+const std::string& WildcardMask::getPrefix() const { return prefix; }
+
+const std::string& WildcardMask::getSuffix() const { return suffix; }
@@ -0,0 +1,44 @@
+#ifndef WILDCARDMASK_HPP
+#define WILDCARDMASK_HPP
+
+#include <string>
+#include <vector>
+
+// An IRC wildcard mask ('*' any run, '?' any one character) compiled once
+// into the literal pieces between the stars, so matching is a few
+// comparisons instead of a backtracking walk. Matching ignores ASCII case.
+class WildcardMask {
+ public:
+  WildcardMask();
+  explicit WildcardMask(const std::string& mask);
+
+  bool matches(const std::string& text) const;
+  bool matchesFolded(const std::string& folded) const;  // Already lowercase
+  bool matchesAll() const;  // "*" (or "**"...)
+  const std::string& getMask() const;
+  // Literal text every match starts or ends with (lowercase); used to pick
+  // an index range before matching.
+  const std::string& getPrefix() const;
+  const std::string& getSuffix() const;
+
+  static std::string fold(const std::string& text);
+
+ private:
+  struct Segment {
+    std::string text;
+    bool hasAnyChar;  // Contains '?'
+  };
+
+  static bool segmentAt(const Segment& segment, const std::string& text,
+                        size_t position);
+
+  std::string mask;
+  std::vector<Segment> segments;  // Pieces between '*', in order
+  bool anchoredStart;             // No leading '*'
+  bool anchoredEnd;               // No trailing '*'
+  size_t minimumLength;
+  std::string prefix;
+  std::string suffix;
+};
+
+#endif
@@ -0,0 +1,173 @@
+// Searches the message logs written by ircserv -l. Each file is mapped and
+// its records are matched in place; only matches are copied out, printed
+// one per line as the IRC line they stand for, prefixed with the time:
+//   2026-10-19T09:30:00.000000Z :nick!user@host PRIVMSG #channel :text
+// Filters combine: -c target (channel or nick), -n source nick, -t text
+// substring, -s/-u the first/last time (YYYY-MM-DDThh:mm:ss, UTC). Files
+// are searched in the order given, so "dir/messages.*.log" reads a
+// directory oldest first.
+#include <strings.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+
+#include "MessageLog.hpp"
+
+namespace {
+
+struct Filter {
+  std::string target;
+  std::string nick;
+  std::string text;
+  unsigned long long since;
+  unsigned long long until;
+  unsigned long matches;
+};
+
+bool sameName(const MessageLog::Field& field, const std::string& name) {
+  return field.size == name.size() &&
+         strncasecmp(field.data, name.data(), name.size()) == 0;
+}
+
+bool contains(const MessageLog::Field& field, const std::string& text) {
+  return memmem(field.data, field.size, text.data(), text.size()) != NULL;
+}
+
+// The nick is the source prefix up to its '!'.
+bool fromNick(const MessageLog::Field& source, const std::string& nick) {
+  const void* bang = memchr(source.data, '!', source.size);
+  MessageLog::Field name = source;
+  if (bang) {
+    name.size = static_cast<const char*>(bang) - source.data;
+  }
+  return sameName(name, nick);
+}
+
+std::string str(const MessageLog::Field& field) {
+  return std::string(field.data, field.size);
+}
+
+std::string formatTime(unsigned long long time) {
+  time_t seconds = time / 1000000;
+  struct tm parts;
+  gmtime_r(&seconds, &parts);
+  char buffer[40];
+  snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+           parts.tm_year + 1900, parts.tm_mon + 1, parts.tm_mday,
+           parts.tm_hour, parts.tm_min, parts.tm_sec,
+           static_cast<int>(time % 1000000));
+  return buffer;
+}
+
+bool parseTime(const char* text, unsigned long long& time) {
+  struct tm parts;
+  std::memset(&parts, 0, sizeof(parts));
+  if (sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2d", &parts.tm_year, &parts.tm_mon,
+             &parts.tm_mday, &parts.tm_hour, &parts.tm_min,
+             &parts.tm_sec) != 6) {
+    return false;
+  }
+  parts.tm_year -= 1900;
+  parts.tm_mon -= 1;
+  time = static_cast<unsigned long long>(timegm(&parts)) * 1000000;
+  return true;
+}
+
+void print(const MessageLog::Record& record) {
+  std::string line = formatTime(record.time) + " :" + str(record.source);
+  switch (record.type) {
+    case MessageLog::kPrivmsg:
+      line += " PRIVMSG " + str(record.target) + " :" + str(record.text);
+      break;
+    case MessageLog::kNotice:
+      line += " NOTICE " + str(record.target) + " :" + str(record.text);
+      break;
+    case MessageLog::kJoin:
+      line += " JOIN " + str(record.target);
+      break;
+    case MessageLog::kPart:
+      line += " PART " + str(record.target);
+      break;
+    case MessageLog::kKick:
+      line += " KICK " + str(record.target) + " " + str(record.text);
+      break;
+    case MessageLog::kQuit:
+      line += " QUIT " + str(record.target) + " :" + str(record.text);
+      break;
+    case MessageLog::kGap:
+      line = formatTime(record.time) + " -- " + str(record.text) +
+             " records dropped --";
+      break;
+    default:
+      line += " ? " + str(record.target) + " :" + str(record.text);
+  }
+  std::cout << line << '\n';
+}
+
+void visit(const MessageLog::Record& record, void* context) {
+  Filter& filter = *static_cast<Filter*>(context);
+  if (record.time < filter.since || record.time > filter.until ||
+      (!filter.target.empty() && !sameName(record.target, filter.target)) ||
+      (!filter.nick.empty() && !fromNick(record.source, filter.nick)) ||
+      (!filter.text.empty() && !contains(record.text, filter.text))) {
+    return;
+  }
+  ++filter.matches;
+  print(record);
+}
+
+int usage() {
+  std::cerr << "Usage: ./irclog [-c target] [-n nick] [-t text] "
+               "[-s since] [-u until] <file>..."
+            << std::endl
+            << "       Times are YYYY-MM-DDThh:mm:ss in UTC." << std::endl;
+  return 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Filter filter;
+  filter.since = 0;
+  filter.until = ~0ULL;
+  filter.matches = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:t:s:u:")) != -1) {
+    if (opt == 'c') {
+      filter.target = optarg;
+    } else if (opt == 'n') {
+      filter.nick = optarg;
+    } else if (opt == 't') {
+      filter.text = optarg;
+    } else if (opt == 's') {
+      if (!parseTime(optarg, filter.since)) {
+        return usage();
+      }
+    } else if (opt == 'u') {
+      if (!parseTime(optarg, filter.until)) {
+        return usage();
+      }
+      filter.until += 999999;  // The whole second
+    } else {
+      return usage();
+    }
+  }
+  if (optind == argc) {
+    return usage();
+  }
+  int status = 0;
+  for (int i = optind; i < argc; ++i) {
+    if (!MessageLog::scan(argv[i], visit, &filter)) {
+      std::cerr << argv[i] << ": not a message log, or ends in a torn record"
+                << std::endl;
+      status = 1;
+    }
+  }
+  std::cout.flush();
+  std::cerr << filter.matches << " matching records" << std::endl;
+  return status;
+}
@@ -0,0 +1,471 @@
+// Feeds a trace recorded with ircserv -C into a running server and reports
+// how fast the server took it. Every recorded connection is opened again
+// and sends the same bytes, on the original schedule divided by -x speed
+// (-x 0 sends everything as fast as the server accepts it). Write lag is
+// how long after its due time each record was taken by the server's
+// socket. With -p the replay also logs in a probe client that pings the
+// server every 10 ms and reports round trips, i.e. the latency an ordinary
+// user sees under the replayed load, and the recorded connections log in
+// with that password in place of their redacted ones. With -z every replayed connection
+// asks for compressed output (CAP REQ :deflate) and the report compares
+// the bytes received with what they decompress to.
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "DeflateStream.hpp"
+#include "TrafficCapture.hpp"
+
+namespace {
+
+const long long kProbeInterval = 10000;  // Microseconds between PINGs
+const long long kLinger = 1000000;       // Quiet time before stopping
+
+struct Connection {
+  int fd;
+  std::string pending;  // Recorded bytes not yet written
+  unsigned long long queued;
+  unsigned long long written;
+  // (queued count at the end of a record, when it was due) per record
+  // still in pending, to measure how late the server took it
+  std::deque<std::pair<unsigned long long, long long> > marks;
+  bool closing;  // The trace closed it; close once pending is out
+  std::string head;    // With -z: what arrived before the server's ACK
+  z_stream* inflater;  // With -z: set once the ACK arrived
+};
+
+struct Probe {
+  int fd;
+  std::string input;
+  bool registered;
+  bool waiting;  // A PING is out
+  long long sent;
+  long long next;
+  std::vector<long long> rtts;
+};
+
+long long now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+int connectTo(const struct sockaddr_in& address) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr*)&address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+// Read and discard what the server sent; returns false on EOF or error.
+bool drain(int fd, unsigned long long& bytes, std::string* keep) {
+  char buffer[65536];
+  for (;;) {
+    ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+    if (got > 0) {
+      bytes += got;
+      if (keep) {
+        keep->append(buffer, got);
+      }
+      continue;
+    }
+    return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+}
+
+// Write what the server will take; returns false if the connection broke.
+// Each record fully written adds its lateness to lag.
+void closeConnection(Connection& connection) {
+  close(connection.fd);
+  if (connection.inflater) {
+    inflateEnd(connection.inflater);
+    delete connection.inflater;
+  }
+}
+
+// With -z, everything after "CAP ... ACK :deflate" is one zlib stream
+// primed with the server's dictionary. Returns how many bytes the data
+// stands for once decompressed.
+unsigned long long inflateReceived(Connection& connection,
+                                   const std::string& data) {
+  static const char kAck[] = " ACK :deflate\r\n";
+  std::string input;
+  if (!connection.inflater) {
+    connection.head += data;
+    size_t ack = connection.head.find(kAck);
+    if (ack == std::string::npos) {
+      return data.size();
+    }
+    size_t start = ack + sizeof(kAck) - 1;
+    input = connection.head.substr(start);
+    unsigned long long plain = data.size() - input.size();
+    connection.head.clear();
+    connection.inflater = new z_stream;
+    std::memset(connection.inflater, 0, sizeof(z_stream));
+    inflateInit(connection.inflater);
+    return plain + inflateReceived(connection, input);
+  }
+  const std::string& words = DeflateStream::dictionary();
+  z_stream* stream = connection.inflater;
+  stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream->avail_in = data.size();
+  unsigned long long plain = 0;
+  char buffer[65536];
+  while (stream->avail_in > 0) {
+    stream->next_out = reinterpret_cast<Bytef*>(buffer);
+    stream->avail_out = sizeof(buffer);
+    int result = inflate(stream, Z_SYNC_FLUSH);
+    if (result == Z_NEED_DICT) {
+      inflateSetDictionary(stream,
+                           reinterpret_cast<const Bytef*>(words.data()),
+                           words.size());
+      continue;
+    }
+    plain += sizeof(buffer) - stream->avail_out;
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      std::cerr << "Bad compressed data from the server." << std::endl;
+      break;
+    }
+  }
+  return plain;
+}
+
+bool writePending(Connection& connection, unsigned long long& bytes,
+                  std::vector<long long>& lag) {
+  std::string& pending = connection.pending;
+  bool open = true;
+  while (!pending.empty()) {
+    ssize_t sent =
+        send(connection.fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+    if (sent < 0) {
+      open = errno == EAGAIN || errno == EWOULDBLOCK;
+      break;
+    }
+    bytes += sent;
+    connection.written += sent;
+    pending.erase(0, sent);
+  }
+  long long current = now();
+  while (!connection.marks.empty() &&
+         connection.marks.front().first <= connection.written) {
+    lag.push_back(current - connection.marks.front().second);
+    connection.marks.pop_front();
+  }
+  return open;
+}
+
+double percentile(std::vector<long long>& values, double fraction) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t index = static_cast<size_t>(fraction * (values.size() - 1));
+  return values[index] / 1000.0;
+}
+
+// The trace has "PASS <redacted>" where clients sent their password.
+void restorePassword(std::vector<TrafficCapture::Record>& records,
+                     const std::string& password) {
+  std::string redacted = std::string("PASS ") + TrafficCapture::kRedacted;
+  std::string login = "PASS " + password;
+  for (size_t i = 0; i < records.size(); ++i) {
+    std::string& data = records[i].data;
+    size_t found = 0;
+    while ((found = data.find(redacted, found)) != std::string::npos) {
+      data.replace(found, redacted.size(), login);
+      found += login.size();
+    }
+  }
+}
+
+int usage() {
+  std::cout << "Usage: ./ircreplay [-x speed] [-p password] [-z] "
+               "<trace> <host> <port>"
+            << std::endl;
+  return 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  double speed = 1;
+  std::string password;
+  bool compress = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "x:p:z")) != -1) {
+    if (opt == 'x') {
+      speed = std::atof(optarg);
+    } else if (opt == 'p') {
+      password = optarg;
+    } else if (opt == 'z') {
+      compress = true;
+    } else {
+      return usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc != 3 || speed < 0) {
+    return usage();
+  }
+  std::vector<TrafficCapture::Record> records;
+  if (!TrafficCapture::load(argv[0], records) && records.empty()) {
+    std::cerr << "Cannot read trace " << argv[0] << "." << std::endl;
+    return 1;
+  }
+  if (!password.empty()) {
+    restorePassword(records, password);
+  }
+  struct sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(std::atoi(argv[2]));
+  if (inet_pton(AF_INET, argv[1], &address.sin_addr) != 1) {
+    std::cerr << "Invalid address " << argv[1] << "." << std::endl;
+    return 1;
+  }
+
+  Probe probe;
+  probe.fd = -1;
+  probe.registered = false;
+  probe.waiting = false;
+  probe.sent = 0;
+  probe.next = 0;
+  if (!password.empty()) {
+    probe.fd = connectTo(address);
+    std::string login = "PASS " + password +
+                        "\r\nNICK replayprobe\r\n"
+                        "USER probe 0 * :ircreplay\r\n";
+    if (probe.fd < 0 ||
+        send(probe.fd, login.data(), login.size(), MSG_NOSIGNAL) < 0) {
+      std::cerr << "Probe could not connect." << std::endl;
+      return 1;
+    }
+  }
+
+  std::map<unsigned int, Connection> connections;
+  unsigned long long bytesOut = 0, bytesIn = 0, plainIn = 0, lines = 0;
+  unsigned int opened = 0, failed = 0;
+  std::vector<long long> lag;
+  size_t next = 0;
+  long long start = now();
+  long long finished = 0;   // When the last recorded byte went out
+  long long lastInput = start;
+  while (true) {
+    long long current = now();
+    // Apply every record that is due
+    while (next < records.size()) {
+      const TrafficCapture::Record& record = records[next];
+      long long due =
+          speed > 0 ? start + static_cast<long long>(record.time / speed)
+                    : current;
+      if (due > current) {
+        break;
+      }
+      ++next;
+      if (record.type == TrafficCapture::kOpen) {
+        Connection connection;
+        connection.fd = connectTo(address);
+        connection.queued = 0;
+        connection.written = 0;
+        connection.closing = false;
+        connection.inflater = NULL;
+        if (connection.fd < 0) {
+          ++failed;
+          continue;
+        }
+        if (compress) {
+          connection.pending = "CAP REQ :deflate\r\n";
+          connection.queued = connection.pending.size();
+        }
+        connections[record.connection] = connection;
+        ++opened;
+        continue;
+      }
+      std::map<unsigned int, Connection>::iterator it =
+          connections.find(record.connection);
+      if (it == connections.end()) {
+        continue;
+      }
+      if (record.type == TrafficCapture::kClose) {
+        // Flat out, a close would cut off replies the server has not
+        // produced yet; those connections are closed at the end instead
+        it->second.closing = speed > 0;
+      } else {
+        Connection& connection = it->second;
+        connection.pending += record.data;
+        connection.queued += record.data.size();
+        connection.marks.push_back(std::make_pair(connection.queued, due));
+        lines += std::count(record.data.begin(), record.data.end(), '\n');
+      }
+    }
+
+    std::vector<struct pollfd> fds;
+    std::vector<unsigned int> ids;
+    bool backlog = false;
+    for (std::map<unsigned int, Connection>::iterator it =
+             connections.begin();
+         it != connections.end();) {
+      Connection& connection = it->second;
+      if (!writePending(connection, bytesOut, lag) ||
+          (connection.closing && connection.pending.empty())) {
+        closeConnection(connection);
+        connections.erase(it++);
+        continue;
+      }
+      struct pollfd pfd;
+      pfd.fd = connection.fd;
+      pfd.events = POLLIN;
+      if (!connection.pending.empty()) {
+        pfd.events |= POLLOUT;
+        backlog = true;
+      }
+      pfd.revents = 0;
+      fds.push_back(pfd);
+      ids.push_back(it->first);
+      ++it;
+    }
+    if (next == records.size() && !backlog && finished == 0) {
+      finished = now();
+    }
+
+    if (probe.fd >= 0) {
+      if (!probe.waiting && probe.registered && current >= probe.next) {
+        static const char kPing[] = "PING replayprobe\r\n";
+        send(probe.fd, kPing, sizeof(kPing) - 1, MSG_NOSIGNAL);
+        probe.waiting = true;
+        probe.sent = current;
+      }
+      struct pollfd pfd;
+      pfd.fd = probe.fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      fds.push_back(pfd);
+    }
+
+    if (finished != 0 && (!probe.waiting || probe.fd < 0) &&
+        now() - std::max(finished, lastInput) >= kLinger) {
+      break;
+    }
+    int timeout = 10;
+    if (next < records.size()) {
+      long long due = speed > 0
+                          ? start + static_cast<long long>(
+                                        records[next].time / speed)
+                          : current;
+      timeout = static_cast<int>(std::max(0LL, (due - now()) / 1000));
+      timeout = std::min(timeout, 10);
+    }
+    if (poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout) < 0 &&
+        errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        unsigned long long before = bytesIn;
+        Connection& connection = connections[ids[i]];
+        std::string received;
+        bool open = drain(fds[i].fd, bytesIn, compress ? &received : NULL);
+        if (bytesIn != before) {
+          lastInput = now();
+          plainIn += compress ? inflateReceived(connection, received)
+                              : bytesIn - before;
+        }
+        if (!open) {
+          closeConnection(connection);
+          connections.erase(ids[i]);
+        }
+      }
+    }
+    if (probe.fd >= 0 && (fds.back().revents & (POLLIN | POLLHUP))) {
+      unsigned long long ignored = 0;
+      bool open = drain(probe.fd, ignored, &probe.input);
+      long long received = now();
+      size_t end;
+      while ((end = probe.input.find('\n')) != std::string::npos) {
+        std::string line = probe.input.substr(0, end);
+        probe.input.erase(0, end + 1);
+        if (line.find(" 001 ") != std::string::npos) {
+          probe.registered = true;
+        } else if (probe.waiting && line.find(" PONG ") != std::string::npos) {
+          probe.rtts.push_back(received - probe.sent);
+          probe.waiting = false;
+          probe.next = received + kProbeInterval;
+        }
+      }
+      if (!open) {
+        std::cerr << "Probe disconnected." << std::endl;
+        close(probe.fd);
+        probe.fd = -1;
+      }
+    }
+  }
+
+  // Rates are over the time until the server stopped answering, since the
+  // last bytes can sit in socket buffers long after they were written
+  double sent = (finished - start) / 1000000.0;
+  double elapsed = (std::max(finished, lastInput) - start) / 1000000.0;
+  if (elapsed <= 0) {
+    elapsed = 1e-6;
+  }
+  char report[1024];
+  snprintf(report, sizeof(report),
+           "connections %u (%u failed), lines %llu, bytes %llu\n"
+           "sent in %.3f s, last reply at %.3f s\n"
+           "%.0f lines/s, %.2f MB/s sent, %.2f MB/s received\n"
+           "write lag ms: p50 %.2f p99 %.2f max %.2f\n",
+           opened, failed, lines, bytesOut, sent, elapsed, lines / elapsed,
+           bytesOut / elapsed / 1e6, bytesIn / elapsed / 1e6,
+           percentile(lag, 0.5), percentile(lag, 0.99),
+           percentile(lag, 1.0));
+  std::cout << report;
+  if (compress) {
+    snprintf(report, sizeof(report),
+             "received %llu bytes for %llu uncompressed (%.1f%%)\n", bytesIn,
+             plainIn, plainIn ? 100.0 * bytesIn / plainIn : 100.0);
+    std::cout << report;
+  }
+  if (!password.empty()) {
+    size_t pings = probe.rtts.size();
+    snprintf(report, sizeof(report),
+             "probe %lu pings, rtt ms: p50 %.2f p99 %.2f max %.2f\n",
+             static_cast<unsigned long>(pings), percentile(probe.rtts, 0.5),
+             percentile(probe.rtts, 0.99), percentile(probe.rtts, 1.0));
+    std::cout << report;
+  }
+  for (std::map<unsigned int, Connection>::iterator it = connections.begin();
+       it != connections.end(); ++it) {
+    closeConnection(it->second);
+  }
+  if (probe.fd >= 0) {
+    close(probe.fd);
+  }
+  return 0;
+}
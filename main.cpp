@@ -1,24 +1,223 @@
 #include "IRCServer.hpp"
 
-int main(int argc, char **argv) {
-  if (argc != 3) {
-    std::cout << "Usage: ./ircserv <port> <password>" << std::endl;
+static bool parsePort(const char *arg, int &port) {
+  std::istringstream iss(arg);
+  port = 0;
+  iss >> port;
+  return !iss.fail() && iss.eof() && port > 0;
+}
+
+// "-A hosts:subnet:rate", e.g. "16:64:5"; 0 disables a limit.
+static bool parseLimits(const char *arg, unsigned limits[3]) {
+  std::istringstream iss(arg);
+  char colon1 = 0, colon2 = 0;
+  iss >> limits[0] >> colon1 >> limits[1] >> colon2 >> limits[2];
+  return !iss.fail() && iss.eof() && colon1 == ':' && colon2 == ':';
+}
+
+// ircserv -K: hash the password on standard input for an accounts file.
+static int printHash() {
+  std::string password;
+  std::getline(std::cin, password);
+  std::string hashed = AccountStore::hash(password);
+  std::fill(password.begin(), password.end(), '\0');
+  if (hashed.empty()) {
+    std::cerr << "Hashing failed." << std::endl;
     return 1;
   }
-  std::string password = argv[2];
-  std::istringstream iss(argv[1]);
+  std::cout << hashed << std::endl;
+  return 0;
+}
+
+// "-S port:options", e.g. "6667:nodelay,cork,sndbuf=262144"
+static bool parseSocketProfile(const char *arg, int &port,
+                               SocketProfile &profile) {
+  std::string spec(arg);
+  size_t colon = spec.find(':');
+  return colon != std::string::npos &&
+         parsePort(spec.substr(0, colon).c_str(), port) &&
+         profile.parse(spec.substr(colon + 1));
+}
+
+// "-l dir" or "-l dir:MB", the size at which log files rotate
+static bool parseMessageLog(const char *arg, std::string &directory,
+                            size_t &fileBytes) {
+  directory = arg;
+  fileBytes = MessageLog::kDefaultFileBytes;
+  size_t colon = directory.rfind(':');
+  if (colon == std::string::npos) {
+    return !directory.empty();
+  }
+  std::istringstream iss(directory.substr(colon + 1));
+  long megabytes = 0;
+  iss >> megabytes;
+  directory.erase(colon);
+  fileBytes = static_cast<size_t>(megabytes) * 1024 * 1024;
+  return !iss.fail() && iss.eof() && megabytes > 0 && !directory.empty();
+}
+
+static int usage() {
+  std::cout << "Usage: ./ircserv [-b poll|io_uring] [-s state-dir] "
+               "[-H history-MB] [-n server-name] [-p link-password] "
+               "[-L name@host[:port]]... "
+               "[-A per-ip:per-subnet:connects-per-sec] [-C trace-file] "
+               "[-F fan-out-threads] [-M module.so]... [-P pattern-file] "
+               "[-a accounts-file] [-W login-threads] "
+               "[-S port:socket-options]... [-R dns-server[:port]] "
+               "[-l log-dir[:MB]] "
+               "<port> <password> "
+               "[<tls-port> <cert.pem> <key.pem>]"
+            << std::endl
+            << "       ./ircserv -K < password  (prints a hash for -a)"
+            << std::endl;
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  std::string backend = "poll";
+  std::string stateDirectory;
+  long historyBudget = -1;
+  std::string serverName;
+  std::string linkPassword;
+  std::vector<std::string> peers;
+  std::vector<std::string> moduleFiles;
+  std::string patternFile;
+  unsigned limits[3] = {0, 0, 0};
+  bool haveLimits = false;
+  std::string captureFile;
+  long fanoutThreads = 0;
+  std::string accountFile;
+  long loginThreads = 2;
+  std::map<int, SocketProfile> socketProfiles;
+  std::string dnsServer;
+  std::string logDirectory;
+  size_t logFileBytes = 0;
+  int opt;
+  const char *options = "b:s:H:n:p:L:A:C:F:M:P:a:W:KS:R:l:";
+  while ((opt = getopt(argc, argv, options)) != -1) {
+    int profilePort = 0;
+    SocketProfile profile;
+    if (opt == 'b') {
+      backend = optarg;
+    } else if (opt == 's') {
+      stateDirectory = optarg;
+    } else if (opt == 'H') {
+      historyBudget = std::atol(optarg);
+    } else if (opt == 'n') {
+      serverName = optarg;
+    } else if (opt == 'p') {
+      linkPassword = optarg;
+    } else if (opt == 'L') {
+      peers.push_back(optarg);
+    } else if (opt == 'A' && parseLimits(optarg, limits)) {
+      haveLimits = true;
+    } else if (opt == 'C') {
+      captureFile = optarg;
+    } else if (opt == 'F') {
+      fanoutThreads = std::atol(optarg);
+    } else if (opt == 'M') {
+      moduleFiles.push_back(optarg);
+    } else if (opt == 'P') {
+      patternFile = optarg;
+    } else if (opt == 'a') {
+      accountFile = optarg;
+    } else if (opt == 'W' && std::atol(optarg) > 0) {
+      loginThreads = std::atol(optarg);
+    } else if (opt == 'K') {
+      return printHash();
+    } else if (opt == 'S' &&
+               parseSocketProfile(optarg, profilePort, profile)) {
+      socketProfiles[profilePort] = profile;
+    } else if (opt == 'R') {
+      dnsServer = optarg;
+    } else if (opt == 'l') {
+      if (!parseMessageLog(optarg, logDirectory, logFileBytes)) {
+        return usage();
+      }
+    } else {
+      return usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc != 2 && argc != 5) {
+    return usage();
+  }
+  std::string password = argv[1];
   int port = 0;
-  iss >> port;
-  if (iss.fail() || !iss.eof() || port <= 0 || password.empty()) {
+  if (!parsePort(argv[0], port) || password.empty()) {
     std::cout << "Invalid port or password." << std::endl;
     return 1;
   }
+  int tlsPort = 0;
+  if (argc == 5 && !parsePort(argv[2], tlsPort)) {
+    std::cout << "Invalid TLS port." << std::endl;
+    return 1;
+  }
 
   try {
     IRCServer server(port, password);
+    if (!server.setEventBackend(backend)) {
+      std::cout << "Unknown event backend: " << backend << std::endl;
+      return 1;
+    }
+    if (!serverName.empty()) {
+      server.getLinks().setName(serverName);
+    }
+    for (std::map<int, SocketProfile>::iterator it = socketProfiles.begin();
+         it != socketProfiles.end(); ++it) {
+      server.setSocketProfile(it->first, it->second);
+    }
+    if (!peers.empty() && linkPassword.empty()) {
+      std::cout << "Server links need a link password (-p)." << std::endl;
+      return 1;
+    }
+    server.getLinks().setPassword(linkPassword);
+    for (size_t i = 0; i < peers.size(); ++i) {
+      if (!server.getLinks().addPeer(peers[i])) {
+        return usage();
+      }
+    }
+    for (size_t i = 0; i < moduleFiles.size(); ++i) {
+      if (!server.getModules().load(moduleFiles[i])) {
+        return 1;
+      }
+    }
+    if (!patternFile.empty() && !server.enableContentFilter(patternFile)) {
+      return 1;
+    }
+    if (!accountFile.empty() &&
+        !server.enableAccounts(accountFile, loginThreads)) {
+      return 1;
+    }
+    if (!dnsServer.empty() && !server.enableResolver(dnsServer)) {
+      return 1;
+    }
+    if (haveLimits) {
+      server.getAdmission().configure(limits[0], limits[1], limits[2]);
+    }
+    if (historyBudget >= 0) {
+      server.setHistoryBudget(historyBudget);
+    }
+    if (!stateDirectory.empty() && !server.enableStateStore(stateDirectory)) {
+      return 1;
+    }
+    if (fanoutThreads > 0 && !server.enableFanoutThreads(fanoutThreads)) {
+      return 1;
+    }
+    if (!captureFile.empty() && !server.enableCapture(captureFile)) {
+      return 1;
+    }
+    if (!logDirectory.empty() &&
+        !server.enableMessageLog(logDirectory, logFileBytes)) {
+      return 1;
+    }
+    if (tlsPort > 0 && !server.enableTls(tlsPort, argv[3], argv[4])) {
+      return 1;
+    }
     server.run();
   } catch (std::exception &e) {
     exit(EXIT_FAILURE);
   }
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,45 @@
+// Example module: drops a channel message that repeats the one before it in
+// the same channel, and tells the sender. Build with make, load with
+// ./ircserv -M modules/repeatfilter.so <port> <password>.
+#include <map>
+#include <string>
+
+#include "../Channel.hpp"
+#include "../ClientHandler.hpp"
+#include "../ModuleManager.hpp"
+
+static std::map<Channel*, std::string> lastText;
+
+// ":nick!user@host PRIVMSG #channel :text" -> "text"; "" for other lines
+static std::string messageText(const std::string& line) {
+  size_t command = line.find(' ');
+  if (command == std::string::npos ||
+      line.compare(command + 1, 8, "PRIVMSG ") != 0) {
+    return "";
+  }
+  size_t text = line.find(" :", command + 9);
+  return text == std::string::npos ? "" : line.substr(text + 2);
+}
+
+static ModuleManager::Verdict filterRepeat(Channel* channel,
+                                           const std::string& line,
+                                           ClientHandler* sender, void*) {
+  std::string text = messageText(line);
+  if (sender == NULL || text.empty()) {
+    return ModuleManager::kPass;
+  }
+  std::string& last = lastText[channel];
+  if (text == last) {
+    sender->sendMessage(":Server NOTICE " + sender->getNickname() +
+                        " :Repeated message not sent to " +
+                        channel->getName());
+    return ModuleManager::kDrop;
+  }
+  last = text;
+  return ModuleManager::kPass;
+}
+
+extern "C" bool ircModuleInit(ModuleManager& modules) {
+  modules.addChannelHook(filterRepeat, NULL);
+  return true;
+}